@@ -1,10 +1,50 @@
 #include <iostream>
 #include <string>
+#include <sstream>
 #include <vector>
 #include <fstream>
 #include <ctime>
 #include <cstdlib>
 #include <algorithm>
+#include <cmath>
+#include <functional>
+#include <array>
+#include <utility>
+#include <tuple>
+#include <new>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <cstring>
+#include <cstdio>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -156,13 +196,125 @@ public:
     }
 };
 
+class MagicalItem : public Item {
+public:
+    int bonus;
+
+    MagicalItem(string name, int value, Rarity rarity, int bonus)
+        : Item(name, value, rarity), bonus(bonus) {}
+
+    void use() override {
+        cout << "Using magical item: " << name << " (Bonus: " << bonus << ")\n";
+    }
+
+    void display() override {
+        Item::display();
+        cout << "Magic Bonus: " << bonus << "\n";
+    }
+};
+
+// Derived Stats
+// Final values run through a fixed pipeline: base, then equipment modifiers, then
+// skill modifiers, then buffs. Each stage adds its flat bonuses and then scales
+// by its percent bonuses. The result is cached and only rebuilt after a base
+// value or modifier changes, so reads in combat are O(1).
+enum Stat { STAT_ATTACK, STAT_DEFENSE, STAT_COUNT };
+enum ModifierSource { SOURCE_EQUIPMENT, SOURCE_SKILL, SOURCE_BUFF, SOURCE_COUNT };
+
+struct StatModifier {
+    int id;
+    Stat stat;
+    ModifierSource source;
+    int flat;
+    int percent;
+};
+
+class StatBlock {
+private:
+    int base[STAT_COUNT];
+    vector<StatModifier> modifiers;
+    int cached[STAT_COUNT];
+    bool dirty;
+    int nextModifierId;
+
+    void rebuild() {
+        int flat[SOURCE_COUNT][STAT_COUNT] = {};
+        int percent[SOURCE_COUNT][STAT_COUNT] = {};
+        for (const auto& modifier : modifiers) {
+            flat[modifier.source][modifier.stat] += modifier.flat;
+            percent[modifier.source][modifier.stat] += modifier.percent;
+        }
+        for (int stat = 0; stat < STAT_COUNT; ++stat) {
+            int value = base[stat];
+            for (int source = 0; source < SOURCE_COUNT; ++source) {
+                value += flat[source][stat];
+                value = value * (100 + percent[source][stat]) / 100;
+            }
+            cached[stat] = max(0, value);
+        }
+        dirty = false;
+    }
+
+public:
+    StatBlock(int attackPower, int defensePower) : dirty(true), nextModifierId(1) {
+        base[STAT_ATTACK] = attackPower;
+        base[STAT_DEFENSE] = defensePower;
+    }
+
+    int get(Stat stat) {
+        if (dirty) {
+            rebuild();
+        }
+        return cached[stat];
+    }
+
+    int getBase(Stat stat) const {
+        return base[stat];
+    }
+
+    void addBase(Stat stat, int amount) {
+        base[stat] += amount;
+        dirty = true;
+    }
+
+    // Returns an ID for removeModifier().
+    int addModifier(Stat stat, ModifierSource source, int flat, int percent) {
+        modifiers.push_back({ nextModifierId, stat, source, flat, percent });
+        dirty = true;
+        return nextModifierId++;
+    }
+
+    void removeModifier(int id) {
+        for (size_t i = 0; i < modifiers.size(); ++i) {
+            if (modifiers[i].id == id) {
+                modifiers[i] = modifiers.back();
+                modifiers.pop_back();
+                dirty = true;
+                return;
+            }
+        }
+    }
+
+    void removeSource(ModifierSource source) {
+        size_t kept = 0;
+        for (const auto& modifier : modifiers) {
+            if (modifier.source != source) {
+                modifiers[kept++] = modifier;
+            }
+        }
+        if (kept != modifiers.size()) {
+            modifiers.resize(kept);
+            dirty = true;
+        }
+    }
+};
+
 class Character {
 protected:
     string name;
     int health;
     int maxHealth;
-    int attackPower;
-    int defensePower;
+    StatBlock stats;
     int level;
     int experience;
     vector<Item*> inventory;
@@ -170,16 +322,29 @@ protected:
     Item* equippedWeapon;
     Item* equippedArmor;
     Item* equippedPotion;
+    int weaponModifier;
+    int armorModifier;
     Skill currentSkill;
+    map<Skill, int> skillLevels;
+
+    // Skill modifiers are derived from skillLevels and rebuilt as a group.
+    void refreshSkillModifiers() {
+        stats.removeSource(SOURCE_SKILL);
+        for (const auto& skill : skillLevels) {
+            if (skill.first == STRENGTH_BOOST && skill.second > 0) {
+                stats.addModifier(STAT_ATTACK, SOURCE_SKILL, 0, 5 * skill.second);
+            }
+        }
+    }
 
 public:
     Character(string name, int health, int attackPower)
-        : name(name), health(health), maxHealth(health), attackPower(attackPower), defensePower(0), level(1), experience(0), currentSkill(NONE), equippedWeapon(nullptr), equippedArmor(nullptr), equippedPotion(nullptr) {}
+        : name(name), health(health), maxHealth(health), stats(attackPower, 0), level(1), experience(0), currentSkill(NONE), equippedWeapon(nullptr), equippedArmor(nullptr), equippedPotion(nullptr), weaponModifier(0), armorModifier(0) {}
 
     string getName() { return name; }
     int getHealth() { return health; }
-    int getAttackPower() { return attackPower + (equippedWeapon ? static_cast<Weapon*>(equippedWeapon)->attackPower : 0); }
-    int getDefensePower() { return defensePower + (equippedArmor ? static_cast<Armor*>(equippedArmor)->defensePower : 0); }
+    int getAttackPower() { return stats.get(STAT_ATTACK); }
+    int getDefensePower() { return stats.get(STAT_DEFENSE); }
     int getLevel() { return level; }
     int getExperience() { return experience; }
 
@@ -196,14 +361,20 @@ public:
         inventory.push_back(item);
     }
 
+    vector<Item*>& getInventory() {
+        return inventory;
+    }
+
     void equipWeapon(Weapon* weapon) {
+        stats.removeModifier(weaponModifier);
         equippedWeapon = weapon;
-        attackPower += weapon->attackPower;
+        weaponModifier = stats.addModifier(STAT_ATTACK, SOURCE_EQUIPMENT, weapon->attackPower, 0);
     }
 
     void equipArmor(Armor* armor) {
+        stats.removeModifier(armorModifier);
         equippedArmor = armor;
-        defensePower += armor->defensePower;
+        armorModifier = stats.addModifier(STAT_DEFENSE, SOURCE_EQUIPMENT, armor->defensePower, 0);
     }
 
     void equipPotion(Potion* potion) {
@@ -212,6 +383,23 @@ public:
 
     void equipScroll(Scroll* scroll) {
         currentSkill = scroll->skill;
+        if (skillLevels[scroll->skill] == 0) {
+            setSkillLevel(scroll->skill, 1);
+        }
+    }
+
+    void setSkillLevel(Skill skill, int skillLevel) {
+        skillLevels[skill] = skillLevel;
+        refreshSkillModifiers();
+    }
+
+    // Temporary effects; returns an ID for removeBuff().
+    int addBuff(Stat stat, int flat, int percent) {
+        return stats.addModifier(stat, SOURCE_BUFF, flat, percent);
+    }
+
+    void removeBuff(int id) {
+        stats.removeModifier(id);
     }
 
     void showInventory() {
@@ -232,7 +420,7 @@ public:
             cout << i + 1 << ". ";
             inventory[i]->display();
         }
-        cout << "Page " << page + 1 << " of " << (inventory.size() / itemsPerPage) + 1 << endl;
+        cout << "Page " << page + 1 << " of " << max<size_t>(1, (inventory.size() + itemsPerPage - 1) / itemsPerPage) << endl;
     }
 
     void useItem(int index) {
@@ -258,8 +446,8 @@ public:
             level++;
             experience = 0;
             maxHealth += 20;
-            attackPower += 5;
-            defensePower += 3;
+            stats.addBase(STAT_ATTACK, 5);
+            stats.addBase(STAT_DEFENSE, 3);
             cout << "Congratulations! You've leveled up to level " << level << "!\n";
         }
     }
@@ -329,6 +517,378 @@ public:
     }
 };
 
+// Headless Combat Simulation
+struct CombatantStats {
+    int health;
+    int attackPower;
+    int defensePower;
+};
+
+struct FightResult {
+    bool playerWon;
+    int turns;
+    int playerHealthLeft;
+    int enemiesDefeated;
+};
+
+struct BatchReport {
+    long long fights = 0;
+    long long wins = 0;
+    long long totalTurns = 0;
+    long long totalHealthLeft = 0;
+    int minTurns = 0;
+    int maxTurns = 0;
+
+    void add(const FightResult& result) {
+        if (fights == 0 || result.turns < minTurns) minTurns = result.turns;
+        if (fights == 0 || result.turns > maxTurns) maxTurns = result.turns;
+        fights++;
+        totalTurns += result.turns;
+        if (result.playerWon) {
+            wins++;
+            totalHealthLeft += result.playerHealthLeft;
+        }
+    }
+
+    void merge(const BatchReport& other) {
+        if (other.fights == 0) return;
+        if (fights == 0 || other.minTurns < minTurns) minTurns = other.minTurns;
+        if (fights == 0 || other.maxTurns > maxTurns) maxTurns = other.maxTurns;
+        fights += other.fights;
+        wins += other.wins;
+        totalTurns += other.totalTurns;
+        totalHealthLeft += other.totalHealthLeft;
+    }
+
+    void show() const {
+        cout << "Fights: " << fights << "\n";
+        cout << "Win Rate: " << (fights ? 100.0 * wins / fights : 0.0) << "%\n";
+        cout << "Turns: avg " << (fights ? (double)totalTurns / fights : 0.0)
+             << ", min " << minTurns << ", max " << maxTurns << "\n";
+        cout << "Health Left (wins): avg " << (wins ? (double)totalHealthLeft / wins : 0.0) << "\n";
+    }
+};
+
+class CombatSimulator {
+public:
+    // Turns a fight may last before it is called a loss (neither side can hurt the other).
+    static constexpr int maxTurns = 1000000;
+
+    static CombatantStats snapshot(Character& character) {
+        return { character.getHealth(), character.getAttackPower(), character.getDefensePower() };
+    }
+
+    static CombatantStats snapshot(Enemy& enemy) {
+        return { enemy.getHealth(), enemy.getAttackPower(), 0 };
+    }
+
+    // Same rules as Game::battle(): the player strikes first for full attack power,
+    // the enemy answers for its attack minus the player's defense, and the roster is
+    // fought in order without healing in between. Each duel is solved in closed form
+    // instead of swing by swing, so a fight costs O(roster size).
+    static FightResult resolve(const CombatantStats& player, const vector<CombatantStats>& roster) {
+        FightResult result = { true, 0, player.health, 0 };
+        for (const auto& enemy : roster) {
+            if (enemy.health <= 0) {
+                // Already down: battle() never trades a blow with it.
+                result.enemiesDefeated++;
+                continue;
+            }
+            int enemyDamage = max(0, enemy.attackPower - player.defensePower);
+            int swingsToKill = player.attackPower > 0
+                ? (enemy.health + player.attackPower - 1) / player.attackPower
+                : maxTurns;
+            int swingsToDie = enemyDamage > 0
+                ? (result.playerHealthLeft + enemyDamage - 1) / enemyDamage
+                : maxTurns;
+
+            if (swingsToKill <= swingsToDie && swingsToKill < maxTurns) {
+                result.turns += swingsToKill;
+                result.playerHealthLeft -= (swingsToKill - 1) * enemyDamage;
+                result.enemiesDefeated++;
+            } else {
+                result.turns += min(swingsToDie, maxTurns);
+                result.playerHealthLeft = swingsToDie < maxTurns ? 0 : result.playerHealthLeft;
+                result.playerWon = false;
+                break;
+            }
+        }
+        return result;
+    }
+
+    static BatchReport run(const vector<CombatantStats>& players, const vector<CombatantStats>& roster) {
+        BatchReport report;
+        for (const auto& player : players) {
+            report.add(resolve(player, roster));
+        }
+        return report;
+    }
+};
+
+// Runs a headless sweep over attack/defense around the starting character.
+void runSimulation(long long fights) {
+    Enemy goblin("Goblin", 50, 10);
+    Enemy troll("Troll", 120, 15);
+    vector<CombatantStats> roster = { CombatSimulator::snapshot(goblin), CombatSimulator::snapshot(troll) };
+
+    vector<CombatantStats> players;
+    players.reserve(fights);
+    for (long long i = 0; i < fights; ++i) {
+        players.push_back({ 100, 1 + (int)(i % 50), (int)((i / 50) % 20) });
+    }
+
+    auto begin = chrono::steady_clock::now();
+    BatchReport report = CombatSimulator::run(players, roster);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    report.show();
+    cout << "Fights per second: " << (seconds > 0 ? fights / seconds : 0.0) << "\n";
+}
+
+// Counter-Based Random Numbers
+// Every roll is a pure function of (seed, stream, counter), so a fight draws the
+// same numbers no matter which thread resolves it or in what order.
+struct CounterRng {
+    uint64_t key;
+    uint64_t counter;
+
+    CounterRng(uint64_t seed, uint64_t stream) : key(mix(seed ^ mix(stream + 1))), counter(0) {}
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t next() {
+        return mix(key + 0x9E3779B97F4A7C15ULL * ++counter);
+    }
+
+    // Uniform integer in [low, high].
+    int range(int low, int high) {
+        return low + (int)(((next() >> 32) * (uint64_t)(high - low + 1)) >> 32);
+    }
+};
+
+// Work-Stealing Thread Pool
+// Tasks are plain indices dealt round-robin to per-worker deques. A worker pops
+// from the back of its own deque and steals from the front of the others once
+// it runs dry. The calling thread takes part as worker 0.
+class WorkStealingPool {
+private:
+    struct Worker {
+        mutex lock;
+        deque<int> tasks;
+    };
+    vector<unique_ptr<Worker>> workers;
+
+    bool pop(int self, int& task) {
+        Worker& own = *workers[self];
+        lock_guard<mutex> guard(own.lock);
+        if (own.tasks.empty()) return false;
+        task = own.tasks.back();
+        own.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int self, int& task) {
+        for (size_t i = 1; i < workers.size(); ++i) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    template <typename Body>
+    void work(int self, Body& body) {
+        int task;
+        while (pop(self, task) || steal(self, task)) {
+            body(task);
+        }
+    }
+
+public:
+    WorkStealingPool(int threadCount) {
+        for (int i = 0; i < max(1, threadCount); ++i) {
+            workers.push_back(unique_ptr<Worker>(new Worker()));
+        }
+    }
+
+    int size() const { return (int)workers.size(); }
+
+    // Runs body(task) for every task in [0, taskCount) and returns when all are done.
+    template <typename Body>
+    void run(int taskCount, Body body) {
+        for (int task = 0; task < taskCount; ++task) {
+            workers[task % workers.size()]->tasks.push_back(task);
+        }
+        vector<thread> threads;
+        for (int i = 1; i < size(); ++i) {
+            threads.emplace_back([this, i, &body]() { work(i, body); });
+        }
+        work(0, body);
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+};
+
+// Monte Carlo Balance Sweep
+// Each cell of the attack/defense grid fights the roster many times with every
+// swing rolled within +/- damageSpread percent. Fights are cut into fixed-size
+// tasks whose RNG streams depend only on (cell, fight), and per-task reports are
+// merged in task order, so results are bit-identical for any thread count.
+struct SweepConfig {
+    int health = 100;
+    int minAttack = 1;
+    int maxAttack = 50;
+    int minDefense = 0;
+    int maxDefense = 19;
+    int fightsPerCell = 1000;
+    int damageSpread = 20;
+    uint64_t seed = 1;
+    int threads = (int)max(1u, thread::hardware_concurrency());
+};
+
+class BalanceSweep {
+public:
+    static constexpr int fightsPerTask = 4096;
+
+    static int roll(CounterRng& rng, int attack, int spread) {
+        int low = attack * (100 - spread) / 100;
+        int high = attack * (100 + spread) / 100;
+        return rng.range(low, high);
+    }
+
+    // Swing-by-swing version of CombatSimulator::resolve() with rolled damage. Each
+    // duel gets the same CombatSimulator::maxTurns cap and downed enemies are
+    // skipped, exactly as in the closed form.
+    static FightResult resolve(const CombatantStats& player, const vector<CombatantStats>& roster, int spread, CounterRng& rng) {
+        if (spread == 0) {
+            return CombatSimulator::resolve(player, roster);
+        }
+        FightResult result = { true, 0, player.health, 0 };
+        int highestHit = player.attackPower * (100 + spread) / 100;
+        for (const auto& enemy : roster) {
+            if (enemy.health <= 0) {
+                result.enemiesDefeated++;
+                continue;
+            }
+            int highestTaken = enemy.attackPower * (100 + spread) / 100 - player.defensePower;
+            if (highestHit <= 0 && highestTaken <= 0) {
+                // Neither side can ever land a blow: the duel runs out the cap.
+                result.turns += CombatSimulator::maxTurns;
+                result.playerWon = false;
+                return result;
+            }
+            int enemyHealth = enemy.health;
+            for (int duelTurns = 0; ; ++duelTurns) {
+                if (duelTurns >= CombatSimulator::maxTurns) {
+                    result.playerWon = false;
+                    return result;
+                }
+                result.turns++;
+                enemyHealth -= roll(rng, player.attackPower, spread);
+                if (enemyHealth <= 0) {
+                    result.enemiesDefeated++;
+                    break;
+                }
+                result.playerHealthLeft -= max(0, roll(rng, enemy.attackPower, spread) - player.defensePower);
+                if (result.playerHealthLeft <= 0) {
+                    result.playerHealthLeft = 0;
+                    result.playerWon = false;
+                    return result;
+                }
+            }
+        }
+        return result;
+    }
+
+    static vector<BatchReport> run(const SweepConfig& config, const vector<CombatantStats>& roster) {
+        int attacks = config.maxAttack - config.minAttack + 1;
+        int defenses = config.maxDefense - config.minDefense + 1;
+        int cells = attacks * defenses;
+        int tasksPerCell = (config.fightsPerCell + fightsPerTask - 1) / fightsPerTask;
+
+        vector<BatchReport> taskReports((size_t)cells * tasksPerCell);
+        WorkStealingPool pool(config.threads);
+        pool.run((int)taskReports.size(), [&](int task) {
+            int cell = task / tasksPerCell;
+            int firstFight = (task % tasksPerCell) * fightsPerTask;
+            int lastFight = min(config.fightsPerCell, firstFight + fightsPerTask);
+            CombatantStats player = { config.health, config.minAttack + cell % attacks, config.minDefense + cell / attacks };
+
+            BatchReport report;
+            for (int fight = firstFight; fight < lastFight; ++fight) {
+                CounterRng rng(config.seed, (uint64_t)cell * config.fightsPerCell + fight);
+                report.add(resolve(player, roster, config.damageSpread, rng));
+            }
+            taskReports[task] = report;
+        });
+
+        vector<BatchReport> cellReports(cells);
+        for (size_t task = 0; task < taskReports.size(); ++task) {
+            cellReports[task / tasksPerCell].merge(taskReports[task]);
+        }
+        return cellReports;
+    }
+};
+
+// Reads "name health attackPower" lines into a roster.
+bool loadRoster(const string& path, vector<CombatantStats>& roster) {
+    ifstream inFile(path);
+    if (!inFile) {
+        cout << "Could not open roster file: " << path << "\n";
+        return false;
+    }
+    string enemyName;
+    int health, attackPower;
+    while (inFile >> enemyName >> health >> attackPower) {
+        Enemy enemy(enemyName, health, attackPower);
+        roster.push_back(CombatSimulator::snapshot(enemy));
+    }
+    return !roster.empty();
+}
+
+// Prints one CSV row per grid cell followed by the overall totals.
+void runSweep(SweepConfig config, const string& rosterPath) {
+    vector<CombatantStats> roster;
+    if (rosterPath.empty()) {
+        Enemy goblin("Goblin", 50, 10);
+        Enemy troll("Troll", 120, 15);
+        roster = { CombatSimulator::snapshot(goblin), CombatSimulator::snapshot(troll) };
+    } else if (!loadRoster(rosterPath, roster)) {
+        return;
+    }
+
+    auto begin = chrono::steady_clock::now();
+    vector<BatchReport> cells = BalanceSweep::run(config, roster);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    int attacks = config.maxAttack - config.minAttack + 1;
+    BatchReport total;
+    cout << "attack,defense,fights,winRate,avgTurns,avgHealthLeft\n";
+    for (size_t i = 0; i < cells.size(); ++i) {
+        const BatchReport& cell = cells[i];
+        cout << config.minAttack + (int)i % attacks << ","
+             << config.minDefense + (int)i / attacks << ","
+             << cell.fights << ","
+             << (double)cell.wins / max(1LL, cell.fights) << ","
+             << (double)cell.totalTurns / max(1LL, cell.fights) << ","
+             << (double)cell.totalHealthLeft / max(1LL, cell.wins) << "\n";
+        total.merge(cell);
+    }
+    total.show();
+    cout << "Threads: " << config.threads << "\n";
+    cout << "Fights per second: " << (seconds > 0 ? total.fights / seconds : 0.0) << "\n";
+}
+
 class Game {
 private:
     Character* player;
@@ -474,20 +1034,20 @@ public:
 
     void equipItem() {
         cout << "Choose item to equip:\n";
-        for (int i = 0; i < player->inventory.size(); ++i) {
+        for (int i = 0; i < player->getInventory().size(); ++i) {
             cout << i + 1 << ". ";
-            player->inventory[i]->display();
+            player->getInventory()[i]->display();
         }
 
         int choice;
         cin >> choice;
 
-        if (choice < 1 || choice > player->inventory.size()) {
+        if (choice < 1 || choice > player->getInventory().size()) {
             cout << "Invalid choice!\n";
             return;
         }
 
-        Item* item = player->inventory[choice - 1];
+        Item* item = player->getInventory()[choice - 1];
         if (Weapon* weapon = dynamic_cast<Weapon*>(item)) {
             player->equipWeapon(weapon);
         } else if (Armor* armor = dynamic_cast<Armor*>(item)) {
@@ -501,15 +1061,15 @@ public:
 
     void useItem() {
         cout << "Choose item to use:\n";
-        for (int i = 0; i < player->inventory.size(); ++i) {
+        for (int i = 0; i < player->getInventory().size(); ++i) {
             cout << i + 1 << ". ";
-            player->inventory[i]->display();
+            player->getInventory()[i]->display();
         }
 
         int choice;
         cin >> choice;
 
-        if (choice < 1 || choice > player->inventory.size()) {
+        if (choice < 1 || choice > player->getInventory().size()) {
             cout << "Invalid choice!\n";
             return;
         }
@@ -569,12 +1129,129 @@ public:
     }
 };
 
-int main() {
+#ifdef RPG_BENCHMARK
+// Benchmarks (Google Benchmark)
+// Build with -DRPG_BENCHMARK and link -lbenchmark -lpthread. Run with
+// --benchmark_out=<file> --benchmark_out_format=json to keep results for
+// comparison between releases.
+#include <benchmark/benchmark.h>
+
+// Sends cout to a null sink while alive, so rendering can be timed without a terminal.
+class NullOutput {
+private:
+    class NullBuffer : public streambuf {
+    protected:
+        int overflow(int c) override { return c; }
+        streamsize xsputn(const char*, streamsize count) override { return count; }
+    };
+    NullBuffer sink;
+    streambuf* saved;
+
+public:
+    NullOutput() : saved(cout.rdbuf(&sink)) {}
+    ~NullOutput() { cout.rdbuf(saved); }
+};
+
+static void BM_CharacterTakeDamage(benchmark::State& state) {
+    Character hero("Bench", 1000000000, 20);
+    Armor armor("Leather Armor", 25, UNCOMMON, 5);
+    hero.equipArmor(&armor);
+    for (auto _ : state) {
+        hero.takeDamage(15);
+        benchmark::DoNotOptimize(hero.getHealth());
+    }
+}
+BENCHMARK(BM_CharacterTakeDamage);
+
+static void BM_CharacterHeal(benchmark::State& state) {
+    Character hero("Bench", 100, 20);
+    for (auto _ : state) {
+        hero.takeDamage(30);
+        hero.heal(30);
+        benchmark::DoNotOptimize(hero.getHealth());
+    }
+}
+BENCHMARK(BM_CharacterHeal);
+
+static void BM_CharacterGainExperience(benchmark::State& state) {
+    NullOutput quiet;
+    Character hero("Bench", 100, 20);
+    for (auto _ : state) {
+        hero.gainExperience(10);
+        benchmark::DoNotOptimize(hero.getLevel());
+    }
+}
+BENCHMARK(BM_CharacterGainExperience);
+
+// Full headless battle against a roster of state.range(0) enemies.
+static void BM_HeadlessBattle(benchmark::State& state) {
+    Character hero("Bench", 100000, 20);
+    vector<CombatantStats> roster;
+    for (int i = 0; i < state.range(0); ++i) {
+        Enemy enemy(i % 2 ? "Troll" : "Goblin", i % 2 ? 120 : 50, i % 2 ? 15 : 10);
+        roster.push_back(CombatSimulator::snapshot(enemy));
+    }
+    CombatantStats player = CombatSimulator::snapshot(hero);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(CombatSimulator::resolve(player, roster));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_HeadlessBattle)->Arg(2)->Arg(64);
+
+// Character doesn't own its items, so the benchmark keeps them in swords.
+static void fillInventory(Character& hero, vector<Weapon>& swords, int count) {
+    swords.assign(count, Weapon("Sword", 30, COMMON, 15));
+    for (Weapon& sword : swords) {
+        hero.addItem(&sword);
+    }
+}
+
+static void BM_ShowInventory(benchmark::State& state) {
+    NullOutput quiet;
+    Character hero("Bench", 100, 20);
+    vector<Weapon> swords;
+    fillInventory(hero, swords, state.range(0));
+    for (auto _ : state) {
+        hero.showInventory();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_ShowInventory)->Range(10, 10000);
+
+static void BM_ShowInventoryPage(benchmark::State& state) {
+    NullOutput quiet;
+    Character hero("Bench", 100, 20);
+    vector<Weapon> swords;
+    fillInventory(hero, swords, state.range(0));
+    for (auto _ : state) {
+        hero.showInventoryPage(state.range(0) / 10);
+    }
+}
+BENCHMARK(BM_ShowInventoryPage)->Range(10, 10000);
+
+BENCHMARK_MAIN();
+#else
+int main(int argc, char* argv[]) {
     srand(time(0));  // Initialize random seed
+    if (argc >= 3 && string(argv[1]) == "--simulate") {
+        runSimulation(atoll(argv[2]));
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "--sweep") {
+        // --sweep <fightsPerCell> [threads] [seed] [rosterFile]
+        SweepConfig config;
+        config.fightsPerCell = atoi(argv[2]);
+        if (argc >= 4) config.threads = atoi(argv[3]);
+        if (argc >= 5) config.seed = strtoull(argv[4], nullptr, 10);
+        runSweep(config, argc >= 6 ? argv[5] : "");
+        return 0;
+    }
     Game game;
     game.start();
     return 0;
 }
+#endif
 using namespace std;
 
 // Enum Definitions
@@ -971,6 +1648,132 @@ enum class QuestType { MAIN, SIDE };
 enum class Faction { NONE, TOWN, ENEMY, MERCHANT };
 enum class TimeOfDay { DAY, NIGHT };
 
+// Console Renderer
+// Output is built up in memory and written with one write() per screen instead
+// of flushing line by line. Each screen has a byte budget; anything past it is
+// dropped and counted. In quiet mode the stream is switched off, so display code
+// skips formatting entirely (simulation, benchmarks, headless sessions).
+enum class LogLevel { QUIET, NORMAL };
+
+class Renderer : public ostream {
+private:
+    class FrameBuffer : public streambuf {
+    public:
+        string frame;
+        size_t budget = 256 * 1024;
+        size_t dropped = 0;
+
+    protected:
+        int overflow(int c) override {
+            if (c != EOF) {
+                char ch = (char)c;
+                xsputn(&ch, 1);
+            }
+            return c;
+        }
+
+        streamsize xsputn(const char* text, streamsize count) override {
+            size_t room = frame.size() < budget ? budget - frame.size() : 0;
+            size_t kept = min((size_t)count, room);
+            frame.append(text, kept);
+            dropped += count - kept;
+            return count;
+        }
+    };
+
+    FrameBuffer buffer;
+    LogLevel level;
+    int fd;
+
+public:
+    Renderer() : ostream(nullptr), level(LogLevel::NORMAL), fd(STDOUT_FILENO) {
+        rdbuf(&buffer);
+    }
+
+    bool quiet() const {
+        return level == LogLevel::QUIET;
+    }
+
+    void setLevel(LogLevel newLevel) {
+        level = newLevel;
+        if (quiet()) {
+            setstate(ios::badbit);
+        } else {
+            clear();
+        }
+    }
+
+    void setFrameBudget(size_t bytes) {
+        buffer.budget = bytes;
+    }
+
+    size_t frameBudget() const {
+        return buffer.budget;
+    }
+
+    void setOutput(int outputFd) {
+        fd = outputFd;
+    }
+
+    // Hands the finished screen to the caller instead of writing it.
+    string take() {
+        string frame;
+        frame.swap(buffer.frame);
+        buffer.dropped = 0;
+        return frame;
+    }
+
+    void discard() {
+        buffer.frame.clear();
+        buffer.dropped = 0;
+    }
+
+    // Writes the current screen with a single write() and starts the next one.
+    void present() {
+        if (buffer.dropped > 0) {
+            buffer.frame += "... (" + to_string(buffer.dropped) + " more bytes not shown)\n";
+        }
+        size_t written = 0;
+        while (written < buffer.frame.size()) {
+            ssize_t n = ::write(fd, buffer.frame.data() + written, buffer.frame.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        discard();
+    }
+};
+
+Renderer& screen() {
+    static thread_local Renderer renderer;
+    return renderer;
+}
+
+// Counter-Based Random Numbers
+// Every roll is a pure function of (seed, stream, counter), so a batch of rolls
+// gives the same results however it is split up or ordered.
+struct CounterRng {
+    uint64_t key;
+    uint64_t counter;
+
+    CounterRng(uint64_t seed, uint64_t stream) : key(mix(seed ^ mix(stream + 1))), counter(0) {}
+
+    static uint64_t mix(uint64_t x) {
+        x += 0x9E3779B97F4A7C15ULL;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+
+    uint64_t next() {
+        return mix(key + 0x9E3779B97F4A7C15ULL * ++counter);
+    }
+
+    // Uniform integer in [low, high].
+    int range(int low, int high) {
+        return low + (int)(((next() >> 32) * (uint64_t)(high - low + 1)) >> 32);
+    }
+};
+
 // Base Item Class
 class Item {
 public:
@@ -984,7 +1787,8 @@ public:
 
     virtual void use() = 0;
     virtual void display() const {
-        cout << name << " (Value: " << value << ", Rarity: " << (int)rarity << ")" << endl;
+        if (screen().quiet()) return;
+        screen() << name << " (Value: " << value << ", Rarity: " << (int)rarity << ")\n";
     }
 
     virtual ~Item() = default;
@@ -999,12 +1803,12 @@ public:
         : Item(name, ItemType::WEAPON, value, rarity), attackPower(attackPower) {}
 
     void use() override {
-        cout << "Equipping weapon: " << name << endl;
+        screen() << "Equipping weapon: " << name << "\n";
     }
 
     void display() const override {
         Item::display();
-        cout << "Attack Power: " << attackPower << endl;
+        screen() << "Attack Power: " << attackPower << "\n";
     }
 };
 
@@ -1017,12 +1821,12 @@ public:
         : Item(name, ItemType::ARMOR, value, rarity), defensePower(defensePower) {}
 
     void use() override {
-        cout << "Equipping armor: " << name << endl;
+        screen() << "Equipping armor: " << name << "\n";
     }
 
     void display() const override {
         Item::display();
-        cout << "Defense Power: " << defensePower << endl;
+        screen() << "Defense Power: " << defensePower << "\n";
     }
 };
 
@@ -1035,12 +1839,12 @@ public:
         : Item(name, ItemType::POTION, value, rarity), healingAmount(healingAmount) {}
 
     void use() override {
-        cout << "Using potion: " << name << " restores " << healingAmount << " health." << endl;
+        screen() << "Using potion: " << name << " restores " << healingAmount << " health.\n";
     }
 
     void display() const override {
         Item::display();
-        cout << "Healing Amount: " << healingAmount << endl;
+        screen() << "Healing Amount: " << healingAmount << "\n";
     }
 };
 
@@ -1054,15 +1858,15 @@ public:
 
     void use() override {
         switch (skill) {
-            case Skill::FIREBALL: cout << "Casting Fireball!" << endl; break;
-            case Skill::HEALING_TOUCH: cout << "Casting Healing Touch!" << endl; break;
-            default: cout << "Casting Unknown Spell!" << endl; break;
+            case Skill::FIREBALL: screen() << "Casting Fireball!\n"; break;
+            case Skill::HEALING_TOUCH: screen() << "Casting Healing Touch!\n"; break;
+            default: screen() << "Casting Unknown Spell!\n"; break;
         }
     }
 
     void display() const override {
         Item::display();
-        cout << "Skill: " << (int)skill << endl;
+        screen() << "Skill: " << (int)skill << "\n";
     }
 };
 
@@ -1073,7 +1877,7 @@ public:
         : Item(name, ItemType::MATERIAL, value, rarity) {}
 
     void use() override {
-        cout << "Using material: " << name << endl;
+        screen() << name << " is a crafting material.\n";
     }
     
     void display() const override {
@@ -1081,354 +1885,7746 @@ public:
     }
 };
 
-// Quest Class
-class Quest {
+// String Interning
+// One small ID per distinct string, so bulk data can store a uint32_t instead of
+// its own std::string copy.
+class StringPool {
+private:
+    unordered_map<string, uint32_t> ids;
+    vector<const string*> strings;
+
 public:
-    string title;
-    string description;
-    QuestType type;
-    bool isCompleted;
-    vector<string> choices;
-    int rewardExp;
+    uint32_t intern(const string& text) {
+        auto found = ids.find(text);
+        if (found != ids.end()) {
+            return found->second;
+        }
+        uint32_t id = (uint32_t)strings.size();
+        strings.push_back(&ids.emplace(text, id).first->first);
+        return id;
+    }
 
-    Quest(string title, string description, QuestType type, int rewardExp = 0)
-        : title(title), description(description), type(type), isCompleted(false), rewardExp(rewardExp) {}
+    const string& get(uint32_t id) const {
+        return *strings[id];
+    }
 
-    void complete() {
-        isCompleted = true;
-        cout << "Quest " << title << " completed!" << endl;
+    size_t size() const {
+        return strings.size();
     }
 
-    void display() const {
-        cout << "Quest: " << title << endl;
-        cout << description << endl;
-        cout << "Status: " << (isCompleted ? "Completed" : "In Progress") << endl;
+    void reserve(size_t count) {
+        ids.reserve(count);
+        strings.reserve(count);
     }
+};
 
-    void addChoices(const vector<string>& newChoices) {
-        choices = newChoices;
-    }
+// Threads share one pool unless they install their own; a server worker gives
+// all of its sessions one pool (see SessionScope).
+StringPool*& currentNameTable() {
+    static StringPool shared;
+    static thread_local StringPool* current = &shared;
+    return current;
+}
 
-    void displayChoices() const {
-        if (!choices.empty()) {
-            cout << "Choices:\n";
-            for (size_t i = 0; i < choices.size(); ++i) {
-                cout << (i + 1) << ". " << choices[i] << endl;
-            }
-        }
-    }
+StringPool& nameTable() {
+    return *currentNameTable();
+}
+
+// Closed-Set Item Records
+// A flat tag-plus-payload copy of an item for hot paths such as combat. What each
+// ItemType does is described once in ItemTraits; itemTypeTable is generated from
+// those at compile time, so equipping and stat aggregation are table lookups and
+// never reach a virtual call or dynamic_cast.
+enum class EquipSlot : uint8_t { NONE, WEAPON, ARMOR };
+
+const size_t ITEM_TYPE_COUNT = (size_t)ItemType::MATERIAL + 1;
+
+struct ItemRecord {
+    ItemType type;
+    Rarity rarity;
+    int32_t value;
+    uint32_t nameId;  // nameTable()
+    union {
+        int32_t stat;  // raw payload, read through itemTypeTable
+        int32_t attackPower;
+        int32_t defensePower;
+        int32_t healingAmount;
+        Skill skill;
+    };
 };
 
-// Character Class with expanded features
-class Character {
-private:
-    string name;
-    int health;
-    int maxHealth;
-    int attackPower;
-    int defensePower;
-    int level;
-    int experience;
-    vector<Item*> inventory;
-    map<Skill, int> skillLevels;
+struct ItemTypeInfo {
+    EquipSlot slot;
+    int8_t attackWeight;   // stat contribution to attack power
+    int8_t defenseWeight;  // stat contribution to defense power
+    int8_t healWeight;     // stat contribution to healing when used
+    bool consumable;
+};
 
-public:
-    Character(string name)
-        : name(name), health(100), maxHealth(100), attackPower(10), defensePower(5), level(1), experience(0) {}
+template <ItemType T>
+struct ItemTraits {
+    static constexpr ItemTypeInfo info = { EquipSlot::NONE, 0, 0, 0, false };
+};
 
-    void heal(int amount) {
-        health = min(maxHealth, health + amount);
-        cout << name << " healed by " << amount << " health." << endl;
+template <>
+struct ItemTraits<ItemType::WEAPON> {
+    static constexpr ItemTypeInfo info = { EquipSlot::WEAPON, 1, 0, 0, false };
+};
+
+template <>
+struct ItemTraits<ItemType::ARMOR> {
+    static constexpr ItemTypeInfo info = { EquipSlot::ARMOR, 0, 1, 0, false };
+};
+
+template <>
+struct ItemTraits<ItemType::POTION> {
+    static constexpr ItemTypeInfo info = { EquipSlot::NONE, 0, 0, 1, true };
+};
+
+template <>
+struct ItemTraits<ItemType::SCROLL> {
+    static constexpr ItemTypeInfo info = { EquipSlot::NONE, 0, 0, 0, true };
+};
+
+template <size_t... Types>
+constexpr array<ItemTypeInfo, sizeof...(Types)> makeItemTypeTable(index_sequence<Types...>) {
+    return { { ItemTraits<(ItemType)Types>::info... } };
+}
+
+constexpr array<ItemTypeInfo, ITEM_TYPE_COUNT> itemTypeTable = makeItemTypeTable(make_index_sequence<ITEM_TYPE_COUNT>());
+
+inline const ItemTypeInfo& typeInfo(ItemType type) {
+    return itemTypeTable[(size_t)type];
+}
+
+// The type tag already says which class an item is, so static_cast is enough.
+ItemRecord toRecord(const Item* item) {
+    ItemRecord record;
+    record.type = item->type;
+    record.rarity = item->rarity;
+    record.value = item->value;
+    record.nameId = nameTable().intern(item->name);
+    switch (item->type) {
+        case ItemType::WEAPON: record.attackPower = static_cast<const Weapon*>(item)->attackPower; break;
+        case ItemType::ARMOR: record.defensePower = static_cast<const Armor*>(item)->defensePower; break;
+        case ItemType::POTION: record.healingAmount = static_cast<const Potion*>(item)->healingAmount; break;
+        case ItemType::SCROLL: record.skill = static_cast<const Scroll*>(item)->skill; break;
+        default: record.stat = 0; break;
     }
+    return record;
+}
 
-    void takeDamage(int damage) {
-        int damageTaken = max(0, damage - defensePower);
-        health = max(0, health - damageTaken);
-        cout << name << " took " << damageTaken << " damage!" << endl;
+// Same output as Item::display() and its overrides, straight from the record.
+void displayItem(const ItemRecord& record) {
+    if (screen().quiet()) return;
+    screen() << nameTable().get(record.nameId) << " (Value: " << record.value << ", Rarity: " << (int)record.rarity << ")\n";
+    switch (record.type) {
+        case ItemType::WEAPON: screen() << "Attack Power: " << record.attackPower << "\n"; break;
+        case ItemType::ARMOR: screen() << "Defense Power: " << record.defensePower << "\n"; break;
+        case ItemType::POTION: screen() << "Healing Amount: " << record.healingAmount << "\n"; break;
+        case ItemType::SCROLL: screen() << "Skill: " << (int)record.skill << "\n"; break;
+        default: break;
     }
+}
 
-    void levelUp() {
-        level++;
-        maxHealth += 20;
-        attackPower += 5;
-        defensePower += 3;
-        cout << name << " leveled up to level " << level << "!" << endl;
+struct EquipmentStats {
+    int attackPower = 0;
+    int defensePower = 0;
+};
+
+// Sums attack and defense over a set of records without branching on type.
+EquipmentStats aggregateStats(const ItemRecord* records, size_t count) {
+    EquipmentStats total;
+    for (size_t i = 0; i < count; ++i) {
+        const ItemTypeInfo& info = typeInfo(records[i].type);
+        total.attackPower += records[i].stat * info.attackWeight;
+        total.defensePower += records[i].stat * info.defenseWeight;
     }
+    return total;
+}
 
-    void gainExperience(int exp) {
-        experience += exp;
-        if (experience >= 100) {
-            experience = 0;
-            levelUp();
+// Status Effects
+// Lasting effects (damage over time, stuns, stat buffs) live in one engine. An
+// entity holds only a status ID; its totals (pending damage, bonuses, stun count)
+// are kept in a small StatusState and its effects are chained from it. Expiry and
+// periodic ticks are timers in a hierarchical wheel, so advancing one tick only
+// touches the timers that are due, however many effects are active. A tick is
+// one combat round: only fight() advances the engine, so effects cast between
+// fights wait for the next one.
+enum class EffectKind : uint8_t { BURN, POISON, STUN, ATTACK_UP, DEFENSE_UP };
+
+class TimerWheel {
+private:
+    static constexpr int levels = 4;
+    static constexpr int slotBits = 6;
+    static constexpr uint32_t slotCount = 1u << slotBits;
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Timer {
+        uint32_t prev;
+        uint32_t next;
+        uint32_t expires;
+        uint32_t payload;
+        int8_t level;  // -1 when not scheduled
+        uint8_t slot;
+    };
+
+    vector<Timer> timers;
+    vector<uint32_t> freeTimers;
+    uint32_t heads[levels][slotCount];
+    uint32_t now;
+
+    void link(uint32_t id) {
+        Timer& timer = timers[id];
+        uint32_t delta = timer.expires - now;
+        int level = 0;
+        while (level < levels - 1 && delta >= (1u << (slotBits * (level + 1)))) {
+            level++;
         }
+        timer.level = (int8_t)level;
+        timer.slot = (uint8_t)((min(timer.expires, now + (1u << (slotBits * levels)) - 1) >> (slotBits * level)) & (slotCount - 1));
+        timer.prev = none;
+        timer.next = heads[level][timer.slot];
+        if (timer.next != none) timers[timer.next].prev = id;
+        heads[level][timer.slot] = id;
     }
 
-    void addItem(Item* item) {
-        inventory.push_back(item);
+    void unlink(uint32_t id) {
+        Timer& timer = timers[id];
+        if (timer.prev != none) {
+            timers[timer.prev].next = timer.next;
+        } else {
+            heads[timer.level][timer.slot] = timer.next;
+        }
+        if (timer.next != none) timers[timer.next].prev = timer.prev;
+        timer.level = -1;
     }
 
-    void showInventory() const {
-        cout << "Inventory:\n";
-        for (auto& item : inventory) {
-            item->display();
+    // Moves every timer in one slot of a higher level down to where it now belongs.
+    void cascade(int level) {
+        uint32_t slot = (now >> (slotBits * level)) & (slotCount - 1);
+        uint32_t id = heads[level][slot];
+        heads[level][slot] = none;
+        while (id != none) {
+            uint32_t next = timers[id].next;
+            link(id);
+            id = next;
         }
     }
 
-    void useItem(int index) {
-        if (index < 0 || index >= inventory.size()) {
-            cout << "Invalid index!" << endl;
-            return;
+public:
+    TimerWheel() : now(0) {
+        for (auto& level : heads) {
+            fill(begin(level), end(level), none);
         }
-        inventory[index]->use();
     }
 
-    void equipItem(Item* item) {
-        if (item->type == ItemType::WEAPON) {
-            attackPower += dynamic_cast<Weapon*>(item)->attackPower;
-        } else if (item->type == ItemType::ARMOR) {
-            defensePower += dynamic_cast<Armor*>(item)->defensePower;
+    uint32_t time() const { return now; }
+
+    uint32_t schedule(uint32_t delay, uint32_t payload) {
+        uint32_t id;
+        if (!freeTimers.empty()) {
+            id = freeTimers.back();
+            freeTimers.pop_back();
+        } else {
+            id = (uint32_t)timers.size();
+            timers.push_back(Timer());
         }
-        cout << "Equipped " << item->name << endl;
+        timers[id].expires = now + max(delay, 1u);
+        timers[id].payload = payload;
+        link(id);
+        return id;
     }
 
-    void displayStats() const {
-        cout << name << "'s Stats:\n";
-        cout << "Health: " << health << "/" << maxHealth << endl;
-        cout << "Attack Power: " << attackPower << endl;
-        cout << "Defense Power: " << defensePower << endl;
-        cout << "Level: " << level << endl;
-        cout << "Experience: " << experience << endl;
+    void cancel(uint32_t id) {
+        if (id < timers.size() && timers[id].level >= 0) {
+            unlink(id);
+            freeTimers.push_back(id);
+        }
     }
 
-    vector<Item*>& getInventory() {
-        return inventory;
+    // Advances one tick and hands the payload of every timer due now to fire.
+    // The due slot is detached and all of it marked unscheduled first, so a
+    // fire that cancels another timer due this tick leaves the list alone
+    // instead of unlinking (and freeing) it a second time.
+    template <typename Fire>
+    void advance(Fire&& fire) {
+        now++;
+        for (int level = 1; level < levels && (now & ((1u << (slotBits * level)) - 1)) == 0; ++level) {
+            cascade(level);
+        }
+        uint32_t slot = now & (slotCount - 1);
+        uint32_t first = heads[0][slot];
+        heads[0][slot] = none;
+        for (uint32_t id = first; id != none; id = timers[id].next) {
+            timers[id].level = -1;
+        }
+        uint32_t id = first;
+        while (id != none) {
+            uint32_t next = timers[id].next;
+            if (timers[id].expires != now) {
+                link(id);  // clamped far-future timer, not due yet
+            } else {
+                freeTimers.push_back(id);
+                fire(timers[id].payload);
+            }
+            id = next;
+        }
     }
 
-    map<Skill, int>& getSkillLevels() {
-        return skillLevels;
+    size_t pending() const {
+        return timers.size() - freeTimers.size();
     }
+};
 
-    ~Character() {
-        for (auto item : inventory) {
-            delete item;
-        }
-    }
+struct StatusState {
+    int32_t pendingDamage;
+    int16_t attackBonus;
+    int16_t defenseBonus;
+    uint16_t stuns;
+    uint32_t firstEffect;
 };
 
-// Enemy Class with new abilities
-class Enemy {
+class StatusEngine {
 private:
-    string name;
-    int health;
-    int attackPower;
-    vector<Item*> loot;
-    map<Skill, int> abilities;
+    static constexpr uint32_t none = UINT32_MAX;
+
+    struct Effect {
+        uint32_t host;
+        uint32_t nextOnHost;
+        uint32_t expiry;   // timer
+        uint32_t ticker;   // timer for periodic damage, none for other kinds
+        int16_t magnitude;
+        uint16_t period;
+        EffectKind kind;
+        bool active;
+    };
+
+    TimerWheel wheel;
+    vector<StatusState> states;
+    vector<Effect> effects;
+    vector<uint32_t> freeEffects;
+
+    // Timer payloads carry the effect ID with the top bit set for periodic ticks.
+    static constexpr uint32_t tickFlag = 0x80000000u;
+
+    void adjust(const Effect& effect, int sign) {
+        StatusState& state = states[effect.host];
+        switch (effect.kind) {
+            case EffectKind::STUN: state.stuns += sign; break;
+            case EffectKind::ATTACK_UP: state.attackBonus += sign * effect.magnitude; break;
+            case EffectKind::DEFENSE_UP: state.defenseBonus += sign * effect.magnitude; break;
+            default: break;
+        }
+    }
 
-public:
-    Enemy(string name, int health, int attackPower)
-        : name(name), health(health), attackPower(attackPower) {}
+    void remove(uint32_t id) {
+        Effect& effect = effects[id];
+        adjust(effect, -1);
+        wheel.cancel(effect.expiry);
+        wheel.cancel(effect.ticker);
+        uint32_t* link = &states[effect.host].firstEffect;
+        while (*link != id) link = &effects[*link].nextOnHost;
+        *link = effect.nextOnHost;
+        effect.active = false;
+        freeEffects.push_back(id);
+    }
 
-    void takeDamage(int damage) {
-        health = max(0, health - damage);
-        cout << name << " took " << damage << " damage!" << endl;
+    void fire(uint32_t payload) {
+        uint32_t id = payload & ~tickFlag;
+        Effect& effect = effects[id];
+        if (!effect.active) return;
+        if (payload & tickFlag) {
+            states[effect.host].pendingDamage += effect.magnitude;
+            effect.ticker = wheel.schedule(effect.period, payload);
+        } else {
+            effect.expiry = none;
+            remove(id);
+        }
     }
 
-    void attack(Character& target) const {
-        target.takeDamage(attackPower);
+public:
+    uint32_t attach() {
+        states.push_back({ 0, 0, 0, 0, none });
+        return (uint32_t)states.size() - 1;
     }
 
-    void useAbility(Character& target) {
-        for (auto& ability : abilities) {
-            cout << name << " uses ability: " << (int)ability.first << endl;
-            // Apply effects based on ability
-            if (ability.first == Skill::FIREBALL) {
-                target.takeDamage(50);
+    // Adds an effect for duration ticks; damage kinds deal magnitude every period
+    // ticks. Reapplying a kind the host already has refreshes it instead of stacking.
+    void apply(uint32_t& host, EffectKind kind, int magnitude, uint32_t duration, uint32_t period = 1) {
+        if (host == none) {
+            host = attach();
+        }
+        for (uint32_t id = states[host].firstEffect; id != none; id = effects[id].nextOnHost) {
+            if (effects[id].kind == kind) {
+                remove(id);
+                break;
             }
         }
+        uint32_t id;
+        if (!freeEffects.empty()) {
+            id = freeEffects.back();
+            freeEffects.pop_back();
+        } else {
+            id = (uint32_t)effects.size();
+            effects.push_back(Effect());
+        }
+        bool periodic = kind == EffectKind::BURN || kind == EffectKind::POISON;
+        effects[id] = { host, states[host].firstEffect, none, none, (int16_t)magnitude, (uint16_t)max(period, 1u), kind, true };
+        states[host].firstEffect = id;
+        effects[id].expiry = wheel.schedule(duration, id);
+        if (periodic) {
+            effects[id].ticker = wheel.schedule(effects[id].period, id | tickFlag);
+        }
+        adjust(effects[id], 1);
     }
 
-    void addLoot(Item* item) {
-        loot.push_back(item);
+    void clear(uint32_t host) {
+        if (host == none) return;
+        while (states[host].firstEffect != none) {
+            remove(states[host].firstEffect);
+        }
+        states[host].pendingDamage = 0;
     }
 
-    void dropLoot() {
-        cout << name << " dropped the following loot:\n";
-        for (auto& item : loot) {
-            item->display();
+    void advance(uint32_t ticks = 1) {
+        for (uint32_t i = 0; i < ticks; ++i) {
+            wheel.advance([this](uint32_t payload) { fire(payload); });
         }
     }
 
-    void showStats() const {
-        cout << name << " (Health: " << health << ", Attack Power: " << attackPower << ")\n";
+    // Damage over time dealt since the last call.
+    int takePendingDamage(uint32_t host) {
+        if (host == none) return 0;
+        int damage = states[host].pendingDamage;
+        states[host].pendingDamage = 0;
+        return damage;
     }
 
-    bool isAlive() const {
-        return health > 0;
-    }
+    bool isStunned(uint32_t host) const { return host != none && states[host].stuns > 0; }
+    int attackBonus(uint32_t host) const { return host == none ? 0 : states[host].attackBonus; }
+    int defenseBonus(uint32_t host) const { return host == none ? 0 : states[host].defenseBonus; }
+    size_t activeEffects() const { return effects.size() - freeEffects.size(); }
+    size_t pendingTimers() const { return wheel.pending(); }
+    uint32_t time() const { return wheel.time(); }
+};
 
-    void addAbility(Skill skill) {
-        abilities[skill] = 1;
-    }
+// Shared by all threads unless a server session installs its own.
+StatusEngine*& currentStatusEngine() {
+    static StatusEngine shared;
+    static thread_local StatusEngine* current = &shared;
+    return current;
+}
 
-    ~Enemy() {
-        for (auto item : loot) {
-            delete item;
-        }
-    }
+StatusEngine& statusEngine() {
+    return *currentStatusEngine();
+}
+
+// Entity Component System
+// Entities are generational IDs; their components live in archetypes, one per
+// distinct set of component types, each storing every component type as a dense
+// column. Systems iterate with a Query, which caches the matching archetypes and
+// walks whole columns. Components are plain structs and are copied as bytes.
+struct Entity {
+    uint32_t index;
+    uint32_t generation;
 };
 
-// World Class
-class World {
-public:
-    vector<Location> locations;
-    TimeOfDay timeOfDay;
+constexpr Entity NO_ENTITY = { UINT32_MAX, 0 };
+
+struct Health {
+    int32_t current;
+    int32_t max;
+};
+
+struct Combat {
+    int32_t attack;
+    int32_t defense;
+};
+
+struct Progress {
+    int32_t level;
+    int32_t experience;
+};
+
+struct Named {
+    uint32_t nameId;  // nameTable()
+};
+
+struct Status {
+    uint32_t host;  // StatusEngine host, UINT32_MAX until an effect lands
+};
+
+struct Abilities {
+    Skill skills[4];
+    uint8_t count;
+    uint8_t next;
+};
+
+// An NPC that walks the location graph on its own; it has no facade object.
+struct Wander {
+    uint32_t location;
+    uint32_t nextMove;  // tick of the next step
+};
+
+template <typename T>
+struct ComponentTraits;
+
+template <> struct ComponentTraits<Health> { static constexpr uint32_t id = 0; };
+template <> struct ComponentTraits<Combat> { static constexpr uint32_t id = 1; };
+template <> struct ComponentTraits<Progress> { static constexpr uint32_t id = 2; };
+template <> struct ComponentTraits<Named> { static constexpr uint32_t id = 3; };
+template <> struct ComponentTraits<Status> { static constexpr uint32_t id = 4; };
+template <> struct ComponentTraits<Abilities> { static constexpr uint32_t id = 5; };
+template <> struct ComponentTraits<Wander> { static constexpr uint32_t id = 6; };
+
+const size_t COMPONENT_COUNT = 7;
+constexpr size_t componentSizes[COMPONENT_COUNT] = { sizeof(Health), sizeof(Combat), sizeof(Progress),
+                                                     sizeof(Named), sizeof(Status), sizeof(Abilities), sizeof(Wander) };
 
-    World() : timeOfDay(TimeOfDay::DAY) {}
+template <typename... Components>
+constexpr uint32_t componentMask() {
+    return (0u | ... | (1u << ComponentTraits<Components>::id));
+}
+
+struct Archetype {
+    uint32_t mask;
+    vector<Entity> entities;
+    vector<uint8_t> columns[COMPONENT_COUNT];  // empty unless the type is in mask
 
-    void addLocation(Location loc) {
-        locations.push_back(loc);
+    template <typename T>
+    T* column() {
+        return (T*)columns[ComponentTraits<T>::id].data();
     }
 
-    void cycleTime() {
-        if (timeOfDay == TimeOfDay::DAY) {
-            timeOfDay = TimeOfDay::NIGHT;
-        } else {
-            timeOfDay = TimeOfDay::DAY;
+    size_t size() const {
+        return entities.size();
+    }
+};
+
+class Registry {
+private:
+    struct Record {
+        uint32_t archetype;
+        uint32_t row;
+        uint32_t generation;
+        bool alive;
+    };
+
+    vector<Record> records;
+    vector<uint32_t> freeIndices;
+    vector<Archetype> archetypes;
+    unordered_map<uint32_t, uint32_t> archetypeByMask;
+
+    uint32_t archetypeFor(uint32_t mask) {
+        auto found = archetypeByMask.find(mask);
+        if (found != archetypeByMask.end()) {
+            return found->second;
         }
-        cout << "Time has shifted to " << (timeOfDay == TimeOfDay::DAY ? "Day" : "Night") << endl;
+        archetypes.push_back(Archetype());
+        archetypes.back().mask = mask;
+        archetypeByMask[mask] = (uint32_t)archetypes.size() - 1;
+        return (uint32_t)archetypes.size() - 1;
     }
 
-    void showMap() const {
-        cout << "World Map:\n";
-        for (const auto& location : locations) {
-            location.display();
+    // Appends a row for entity to an archetype, leaving its components zeroed.
+    uint32_t pushRow(uint32_t archetypeIndex, Entity entity) {
+        Archetype& archetype = archetypes[archetypeIndex];
+        for (size_t c = 0; c < COMPONENT_COUNT; ++c) {
+            if (archetype.mask & (1u << c)) {
+                archetype.columns[c].resize(archetype.columns[c].size() + componentSizes[c]);
+            }
         }
+        archetype.entities.push_back(entity);
+        return (uint32_t)archetype.size() - 1;
     }
 
-    void interactWithLocation(int index, Character& player) {
-        if (index < 0 || index >= locations.size()) {
-            cout << "Invalid location.\n";
-            return;
+    // Fills the hole at row with the archetype's last row.
+    void eraseRow(uint32_t archetypeIndex, uint32_t row) {
+        Archetype& archetype = archetypes[archetypeIndex];
+        uint32_t last = (uint32_t)archetype.size() - 1;
+        for (size_t c = 0; c < COMPONENT_COUNT; ++c) {
+            if (archetype.mask & (1u << c)) {
+                vector<uint8_t>& column = archetype.columns[c];
+                if (row != last) {
+                    memcpy(&column[row * componentSizes[c]], &column[last * componentSizes[c]], componentSizes[c]);
+                }
+                column.resize(last * componentSizes[c]);
+            }
         }
-        Location& location = locations[index];
-        cout << "You are at " << location.name << "!\n";
-        for (auto& quest : location.quests) {
-            quest.display();
+        if (row != last) {
+            archetype.entities[row] = archetype.entities[last];
+            records[archetype.entities[row].index].row = row;
         }
+        archetype.entities.pop_back();
+    }
+
+    void migrate(Entity entity, uint32_t newMask) {
+        Record& record = records[entity.index];
+        uint32_t target = archetypeFor(newMask);
+        uint32_t row = pushRow(target, entity);
+        Archetype& from = archetypes[record.archetype];
+        Archetype& to = archetypes[target];
+        for (size_t c = 0; c < COMPONENT_COUNT; ++c) {
+            if (from.mask & to.mask & (1u << c)) {
+                memcpy(&to.columns[c][row * componentSizes[c]], &from.columns[c][record.row * componentSizes[c]], componentSizes[c]);
+            }
+        }
+        eraseRow(record.archetype, record.row);
+        record.archetype = target;
+        record.row = row;
+    }
+
+    template <typename T>
+    void store(Entity entity, const T& component) {
+        *get<T>(entity) = component;
     }
-};
 
-// Location / Map Class
-class Location {
 public:
-    string name;
-    vector<Enemy> enemies;
-    vector<Quest> quests;
-    vector<Item*> items;
+    template <typename... Components>
+    Entity create(const Components&... components) {
+        uint32_t index;
+        if (!freeIndices.empty()) {
+            index = freeIndices.back();
+            freeIndices.pop_back();
+        } else {
+            index = (uint32_t)records.size();
+            records.push_back({ 0, 0, 0, false });
+        }
+        Entity entity = { index, records[index].generation };
+        uint32_t archetype = archetypeFor(componentMask<Components...>());
+        records[index] = { archetype, pushRow(archetype, entity), entity.generation, true };
+        (store(entity, components), ...);
+        return entity;
+    }
 
-    Location(string name) : name(name) {}
+    bool alive(Entity entity) const {
+        return entity.index < records.size() && records[entity.index].alive && records[entity.index].generation == entity.generation;
+    }
 
-    void addEnemy(Enemy enemy) {
-        enemies.push_back(enemy);
+    void destroy(Entity entity) {
+        if (!alive(entity)) return;
+        Record& record = records[entity.index];
+        eraseRow(record.archetype, record.row);
+        record.alive = false;
+        record.generation++;
+        freeIndices.push_back(entity.index);
     }
 
-    void addItem(Item* item) {
-        items.push_back(item);
+    // A new entity with a copy of every component of the original.
+    Entity clone(Entity entity) {
+        if (!alive(entity)) return NO_ENTITY;
+        Entity copy = create();
+        migrate(copy, archetypes[records[entity.index].archetype].mask);
+        const Record& source = records[entity.index];
+        const Record& target = records[copy.index];
+        Archetype& archetype = archetypes[source.archetype];
+        for (size_t c = 0; c < COMPONENT_COUNT; ++c) {
+            if (archetype.mask & (1u << c)) {
+                memcpy(&archetype.columns[c][target.row * componentSizes[c]], &archetype.columns[c][source.row * componentSizes[c]], componentSizes[c]);
+            }
+        }
+        return copy;
     }
 
-    void addQuest(Quest quest) {
-        quests.push_back(quest);
+    // nullptr if the entity is gone or lacks the component.
+    template <typename T>
+    T* get(Entity entity) {
+        if (!alive(entity)) return nullptr;
+        const Record& record = records[entity.index];
+        Archetype& archetype = archetypes[record.archetype];
+        if (!(archetype.mask & (1u << ComponentTraits<T>::id))) return nullptr;
+        return archetype.column<T>() + record.row;
     }
 
-    void display() const {
-        cout << "Location: " << name << endl;
-        cout << "Items here:\n";
-        for (auto& item : items) {
-            item->display();
+    template <typename T>
+    void add(Entity entity, const T& component) {
+        if (!alive(entity)) return;
+        uint32_t mask = archetypes[records[entity.index].archetype].mask;
+        if (!(mask & (1u << ComponentTraits<T>::id))) {
+            migrate(entity, mask | (1u << ComponentTraits<T>::id));
         }
+        store(entity, component);
     }
+
+    template <typename T>
+    void remove(Entity entity) {
+        if (!alive(entity)) return;
+        uint32_t mask = archetypes[records[entity.index].archetype].mask;
+        if (mask & (1u << ComponentTraits<T>::id)) {
+            migrate(entity, mask & ~(1u << ComponentTraits<T>::id));
+        }
+    }
+
+    size_t archetypeCount() const { return archetypes.size(); }
+    Archetype& archetype(size_t index) { return archetypes[index]; }
+    size_t count() const { return records.size() - freeIndices.size(); }
 };
 
-// Game Class with added features
-class Game {
+// One registry per thread, like screen(): each game runs on one thread. A server
+// thread hosting many sessions switches to each session's own registry.
+Registry*& currentRegistry() {
+    static thread_local Registry own;
+    static thread_local Registry* current = &own;
+    return current;
+}
+
+Registry& registry() {
+    return *currentRegistry();
+}
+
+// Visits every entity that has all of Components, archetype by archetype.
+template <typename... Components>
+class Query {
 private:
-    Character* player;
-    World world;
-    bool isRunning;
+    Registry& source;
+    vector<uint32_t> matches;
+    size_t checked;  // archetypes already tested against the mask
 
 public:
-    Game() : isRunning(true) {}
+    Query(Registry& source = registry()) : source(source), checked(0) {}
+
+    template <typename Visit>
+    void each(Visit&& visit) {
+        constexpr uint32_t mask = componentMask<Components...>();
+        for (; checked < source.archetypeCount(); ++checked) {
+            if ((source.archetype(checked).mask & mask) == mask) {
+                matches.push_back((uint32_t)checked);
+            }
+        }
+        for (uint32_t index : matches) {
+            Archetype& archetype = source.archetype(index);
+            size_t count = archetype.size();
+            const Entity* entities = archetype.entities.data();
+            tuple<Components*...> columns(archetype.column<Components>()...);
+            for (size_t row = 0; row < count; ++row) {
+                visit(entities[row], get<Components*>(columns)[row]...);
+            }
+        }
+    }
+};
+
+// The one damage rule for every combatant: defense (plus buffs) is subtracted
+// from the hit. Returns the damage actually taken.
+int applyDamage(Entity target, int damage) {
+    Health* health = registry().get<Health>(target);
+    if (!health) return 0;
+    const Combat* combat = registry().get<Combat>(target);
+    const Status* status = registry().get<Status>(target);
+    int defense = (combat ? combat->defense : 0) + (status ? statusEngine().defenseBonus(status->host) : 0);
+    int taken = max(0, damage - defense);
+    health->current = max(0, health->current - taken);
+    return taken;
+}
+
+int attackOf(Entity entity) {
+    const Combat* combat = registry().get<Combat>(entity);
+    const Status* status = registry().get<Status>(entity);
+    return (combat ? combat->attack : 0) + (status ? statusEngine().attackBonus(status->host) : 0);
+}
+
+// Applies damage over time that landed since the last call; armor does not help.
+int applyStatusDamage(Entity entity) {
+    Health* health = registry().get<Health>(entity);
+    Status* status = registry().get<Status>(entity);
+    if (!health || !status) return 0;
+    int damage = statusEngine().takePendingDamage(status->host);
+    health->current = max(0, health->current - damage);
+    return damage;
+}
+
+// Inventory Index
+// Identical items (same type, rarity, value, name and stat) share one stack, found
+// by hash in O(1). A stack is one ItemRecord and a count, so an item in the pack
+// costs nothing beyond its stack. Stacks are also listed by type and by rarity. A sorted view for
+// one filter and sort order is built once and reused until a stack is created or
+// emptied; adding to an existing stack keeps every view valid. Showing a page of
+// a built view only touches the stacks on that page.
+enum class InventorySort : uint8_t { VALUE, RARITY, NAME };
+
+struct InventoryFilter {
+    int type = -1;    // ItemType, -1 for any
+    int rarity = -1;  // Rarity, -1 for any
+};
+
+struct ItemStack {
+    ItemRecord record;
+    size_t count;
+};
+
+class InventoryIndex {
+private:
+    struct View {
+        uint64_t version = UINT64_MAX;
+        vector<uint32_t> order;
+    };
+
+    vector<ItemStack> stacks;
+    unordered_map<uint64_t, vector<uint32_t>> stacksByKey;  // hash -> stacks with that hash
+    unordered_map<uint32_t, vector<uint32_t>> stacksByName;
+    vector<uint32_t> byType[ITEM_TYPE_COUNT];
+    vector<uint32_t> byRarity[4];
+    unordered_map<uint32_t, View> views;
+    uint64_t version;  // bumped when a stack appears or empties
+    size_t itemCount;
+
+    static uint64_t keyOf(const ItemRecord& record) {
+        uint64_t key = CounterRng::mix(((uint64_t)record.type << 8) | (uint64_t)record.rarity);
+        key = CounterRng::mix(key ^ (uint32_t)record.value);
+        key = CounterRng::mix(key ^ record.nameId);
+        return CounterRng::mix(key ^ (uint32_t)record.stat);
+    }
+
+    static bool sameItem(const ItemRecord& a, const ItemRecord& b) {
+        return a.type == b.type && a.rarity == b.rarity && a.value == b.value && a.nameId == b.nameId && a.stat == b.stat;
+    }
+
+    const View& view(InventoryFilter filter, InventorySort sort) {
+        uint32_t key = ((uint32_t)(filter.type + 1) * 5 + (uint32_t)(filter.rarity + 1)) * 3 + (uint32_t)sort;
+        View& cached = views[key];
+        if (cached.version == version) {
+            return cached;
+        }
+        cached.version = version;
+        cached.order.clear();
+        auto consider = [&](uint32_t id) {
+            const ItemStack& stack = stacks[id];
+            if (stack.count == 0) return;
+            if (filter.type >= 0 && (int)stack.record.type != filter.type) return;
+            if (filter.rarity >= 0 && (int)stack.record.rarity != filter.rarity) return;
+            cached.order.push_back(id);
+        };
+        if (filter.type >= 0) {
+            for (uint32_t id : byType[filter.type]) consider(id);
+        } else if (filter.rarity >= 0) {
+            for (uint32_t id : byRarity[filter.rarity]) consider(id);
+        } else {
+            for (uint32_t id = 0; id < stacks.size(); ++id) consider(id);
+        }
+        const vector<ItemStack>& all = stacks;
+        auto byName = [&](uint32_t a, uint32_t b) {
+            return nameTable().get(all[a].record.nameId) < nameTable().get(all[b].record.nameId);
+        };
+        switch (sort) {
+            case InventorySort::VALUE:
+                stable_sort(cached.order.begin(), cached.order.end(), [&](uint32_t a, uint32_t b) {
+                    return all[a].record.value > all[b].record.value;
+                });
+                break;
+            case InventorySort::RARITY:
+                stable_sort(cached.order.begin(), cached.order.end(), [&](uint32_t a, uint32_t b) {
+                    if (all[a].record.rarity != all[b].record.rarity) return all[a].record.rarity > all[b].record.rarity;
+                    return all[a].record.value > all[b].record.value;
+                });
+                break;
+            case InventorySort::NAME:
+                stable_sort(cached.order.begin(), cached.order.end(), byName);
+                break;
+        }
+        return cached;
+    }
+
+public:
+    InventoryIndex() : version(0), itemCount(0) {}
+
+    void add(const ItemRecord& record, size_t count = 1) {
+        if (count == 0) return;
+        vector<uint32_t>& candidates = stacksByKey[keyOf(record)];
+        for (uint32_t id : candidates) {
+            if (sameItem(stacks[id].record, record)) {
+                if (stacks[id].count == 0) version++;
+                stacks[id].count += count;
+                itemCount += count;
+                return;
+            }
+        }
+        uint32_t id = (uint32_t)stacks.size();
+        stacks.push_back({ record, count });
+        candidates.push_back(id);
+        stacksByName[record.nameId].push_back(id);
+        byType[(size_t)record.type].push_back(id);
+        byRarity[(size_t)record.rarity].push_back(id);
+        itemCount += count;
+        version++;
+    }
+
+    ItemStack* find(const ItemRecord& record) {
+        auto candidates = stacksByKey.find(keyOf(record));
+        if (candidates == stacksByKey.end()) return nullptr;
+        for (uint32_t id : candidates->second) {
+            if (sameItem(stacks[id].record, record)) return &stacks[id];
+        }
+        return nullptr;
+    }
+
+    // Stacks keep their position for life (an emptied stack is only hidden), so
+    // an ID from idOf() stays valid.
+    uint32_t idOf(const ItemStack* stack) const { return (uint32_t)(stack - stacks.data()); }
+    const ItemStack& stack(uint32_t id) const { return stacks[id]; }
+
+    size_t size() const { return itemCount; }
+
+    // Items of that name across all stacks.
+    size_t count(uint32_t nameId) const {
+        auto found = stacksByName.find(nameId);
+        if (found == stacksByName.end()) return 0;
+        size_t total = 0;
+        for (uint32_t id : found->second) total += stacks[id].count;
+        return total;
+    }
+
+    // Takes up to count items off one stack.
+    size_t take(ItemStack& stack, size_t count) {
+        size_t taken = min(count, stack.count);
+        stack.count -= taken;
+        itemCount -= taken;
+        if (taken && stack.count == 0) version++;
+        return taken;
+    }
+
+    // Takes up to count items of that name, stack by stack.
+    size_t take(uint32_t nameId, size_t count) {
+        auto found = stacksByName.find(nameId);
+        if (found == stacksByName.end()) return 0;
+        size_t taken = 0;
+        for (uint32_t id : found->second) {
+            taken += take(stacks[id], count - taken);
+            if (taken == count) break;
+        }
+        return taken;
+    }
+
+    // visit(stack) for every non-empty stack, in the order they were created.
+    template <typename Visit>
+    void forEachStack(Visit visit) const {
+        for (const auto& stack : stacks) {
+            if (stack.count) visit(stack);
+        }
+    }
+
+    // Stacks on one page of a sorted, filtered view, and the number of pages.
+    size_t page(InventoryFilter filter, InventorySort sort, size_t pageIndex, size_t pageSize, vector<ItemStack*>& out) {
+        const View& sorted = view(filter, sort);
+        out.clear();
+        for (size_t i = pageIndex * pageSize; i < sorted.order.size() && i < (pageIndex + 1) * pageSize; ++i) {
+            out.push_back(&stacks[sorted.order[i]]);
+        }
+        return max<size_t>(1, (sorted.order.size() + pageSize - 1) / pageSize);
+    }
+};
+
+// Quest Class
+class Quest {
+public:
+    string title;
+    string description;
+    QuestType type;
+    bool isCompleted;
+    vector<string> choices;
+    int rewardExp;
+    bool dirty;
+
+    Quest(string title, string description, QuestType type, int rewardExp = 0)
+        : title(title), description(description), type(type), isCompleted(false), rewardExp(rewardExp), dirty(true) {}
+
+    void complete() {
+        isCompleted = true;
+        dirty = true;
+        screen() << "Quest " << title << " completed!\n";
+    }
+
+    void display() const {
+        screen() << "Quest: " << title << "\n";
+        screen() << description << "\n";
+        screen() << "Status: " << (isCompleted ? "Completed" : "In Progress") << "\n";
+    }
+
+    void addChoices(const vector<string>& newChoices) {
+        choices = newChoices;
+        dirty = true;
+    }
+
+    void displayChoices() const {
+        if (!choices.empty()) {
+            screen() << "Choices:\n";
+            for (size_t i = 0; i < choices.size(); ++i) {
+                screen() << (i + 1) << ". " << choices[i] << "\n";
+            }
+        }
+    }
+};
+
+// Quest Engine
+// A quest is a state machine of stages. A stage is done when all its objectives
+// are met; it then moves to its one next stage, or waits for the player to pick
+// one of its choices, each leading to its own stage. Objectives subscribe to a
+// trigger index keyed by (trigger, target), so an event only reaches the quests
+// waiting on exactly that; subscriptions left behind by a finished stage are
+// dropped the next time their key fires.
+enum class QuestTrigger : uint8_t { KILL, COLLECT, REACH };
+
+static constexpr uint32_t QUEST_DONE = UINT32_MAX;
+
+struct QuestObjective {
+    QuestTrigger trigger;
+    uint32_t target;  // enemy or item name ID, or location ID
+    uint32_t count;
+};
+
+struct QuestStage {
+    vector<QuestObjective> objectives;
+    vector<string> choices;  // empty: go straight on to next[0]
+    vector<uint32_t> next;   // per choice; empty or QUEST_DONE finishes the quest
+};
+
+struct QuestDefinition {
+    string title;
+    vector<QuestStage> stages;
+};
+
+class QuestEngine {
+private:
+    struct Instance {
+        uint32_t definition;
+        uint32_t stage;
+        uint32_t generation;  // bumped on every stage change; stale subscriptions mismatch
+        vector<uint32_t> progress;
+        bool active;
+        bool choosing;
+    };
+
+    struct Subscription {
+        uint32_t instance;
+        uint32_t generation;
+        uint32_t objective;
+    };
+
+    vector<QuestDefinition> definitions;
+    vector<Instance> instances;
+    vector<uint32_t> freeInstances;
+    unordered_map<uint64_t, vector<Subscription>> triggers;
+    vector<uint32_t> finishedStages;
+    vector<uint32_t> completed;  // definitions, until takeCompleted()
+    vector<uint32_t> choosing;   // instances, until takeChoices()
+    bool changed = false;        // progress not saved yet
+
+    static uint64_t keyOf(QuestTrigger trigger, uint32_t target) {
+        return ((uint64_t)trigger << 32) | target;
+    }
+
+    uint32_t allocate(uint32_t definition) {
+        uint32_t id;
+        if (!freeInstances.empty()) {
+            id = freeInstances.back();
+            freeInstances.pop_back();
+        } else {
+            id = (uint32_t)instances.size();
+            instances.push_back({ 0, 0, 0, {}, false, false });
+        }
+        instances[id].definition = definition;
+        instances[id].active = true;
+        return id;
+    }
+
+    void subscribe(uint32_t id) {
+        const Instance& quest = instances[id];
+        const QuestStage& current = definitions[quest.definition].stages[quest.stage];
+        for (uint32_t i = 0; i < current.objectives.size(); ++i) {
+            const QuestObjective& objective = current.objectives[i];
+            triggers[keyOf(objective.trigger, objective.target)].push_back({ id, quest.generation, i });
+        }
+    }
+
+    void enter(uint32_t id, uint32_t stage) {
+        Instance& quest = instances[id];
+        quest.generation++;
+        quest.choosing = false;
+        changed = true;
+        if (stage == QUEST_DONE || stage >= definitions[quest.definition].stages.size()) {
+            quest.active = false;
+            completed.push_back(quest.definition);
+            freeInstances.push_back(id);
+            return;
+        }
+        quest.stage = stage;
+        const QuestStage& current = definitions[quest.definition].stages[stage];
+        quest.progress.assign(current.objectives.size(), 0);
+        subscribe(id);
+        if (current.objectives.empty()) {
+            finishStage(id);
+        }
+    }
+
+    void finishStage(uint32_t id) {
+        Instance& quest = instances[id];
+        const QuestStage& current = definitions[quest.definition].stages[quest.stage];
+        if (current.choices.empty()) {
+            enter(id, current.next.empty() ? QUEST_DONE : current.next[0]);
+            return;
+        }
+        quest.generation++;
+        quest.choosing = true;
+        changed = true;
+        choosing.push_back(id);
+    }
+
+public:
+    uint32_t define(const string& title) {
+        definitions.push_back({ title, {} });
+        return (uint32_t)definitions.size() - 1;
+    }
+
+    // Stages are numbered in the order they are added, from 0.
+    uint32_t addStage(uint32_t definition, const QuestStage& stage) {
+        definitions[definition].stages.push_back(stage);
+        return (uint32_t)definitions[definition].stages.size() - 1;
+    }
+
+    size_t definitionCount() const { return definitions.size(); }
+    const QuestDefinition& definition(uint32_t index) const { return definitions[index]; }
+
+    uint32_t start(uint32_t definition) {
+        uint32_t id = allocate(definition);
+        enter(id, 0);
+        return id;
+    }
+
+    // Puts a saved quest back where it was: in the given stage with the given
+    // objective counts, or waiting on its choice. A decision still to be made
+    // is handed out again by takeChoices().
+    uint32_t resume(uint32_t definition, uint32_t stage, const uint32_t* progress, size_t count, bool isChoosing) {
+        uint32_t id = allocate(definition);
+        Instance& quest = instances[id];
+        const QuestStage& current = definitions[definition].stages[stage];
+        quest.generation++;
+        quest.stage = stage;
+        quest.progress.assign(current.objectives.size(), 0);
+        for (size_t i = 0; i < current.objectives.size() && i < count; ++i) {
+            quest.progress[i] = min(progress[i], current.objectives[i].count);
+        }
+        quest.choosing = isChoosing;
+        if (isChoosing) {
+            choosing.push_back(id);
+        } else {
+            subscribe(id);
+        }
+        changed = true;
+        return id;
+    }
+
+    // Drops every running quest, e.g. before loading a save.
+    void clear() {
+        instances.clear();
+        freeInstances.clear();
+        triggers.clear();
+        completed.clear();
+        choosing.clear();
+    }
+
+    // Counts an event toward the objectives waiting on it.
+    void notify(QuestTrigger trigger, uint32_t target, uint32_t amount = 1) {
+        auto found = triggers.find(keyOf(trigger, target));
+        if (found == triggers.end()) return;
+        vector<Subscription>& subscriptions = found->second;
+        for (size_t i = 0; i < subscriptions.size();) {
+            Subscription subscription = subscriptions[i];
+            Instance& quest = instances[subscription.instance];
+            if (!quest.active || quest.generation != subscription.generation) {
+                subscriptions[i] = subscriptions.back();
+                subscriptions.pop_back();
+                continue;
+            }
+            ++i;
+            const QuestStage& current = definitions[quest.definition].stages[quest.stage];
+            uint32_t& progress = quest.progress[subscription.objective];
+            uint32_t needed = current.objectives[subscription.objective].count;
+            if (progress >= needed) continue;
+            progress = min(needed, progress + amount);
+            changed = true;
+            if (progress < needed) continue;
+            bool done = true;
+            for (size_t o = 0; o < current.objectives.size() && done; ++o) {
+                done = quest.progress[o] >= current.objectives[o].count;
+            }
+            if (done) finishedStages.push_back(subscription.instance);
+        }
+        if (subscriptions.empty()) {
+            triggers.erase(found);
+        }
+        // Entering the next stage adds subscriptions, so it waits until the scan is over.
+        vector<uint32_t> finished;
+        finished.swap(finishedStages);
+        for (uint32_t id : finished) {
+            finishStage(id);
+        }
+    }
+
+    // Takes the branch the player picked at a stage that offers choices.
+    bool choose(uint32_t id, size_t choice) {
+        if (id >= instances.size() || !instances[id].active || !instances[id].choosing) return false;
+        const QuestStage& current = definitions[instances[id].definition].stages[instances[id].stage];
+        if (choice >= current.choices.size()) return false;
+        enter(id, choice < current.next.size() ? current.next[choice] : QUEST_DONE);
+        return true;
+    }
+
+    bool isChoosing(uint32_t id) const { return instances[id].choosing; }
+    const QuestStage& currentStage(uint32_t id) const {
+        return definitions[instances[id].definition].stages[instances[id].stage];
+    }
+    uint32_t progress(uint32_t id, size_t objective) const { return instances[id].progress[objective]; }
+    uint32_t definitionOf(uint32_t id) const { return instances[id].definition; }
+    uint32_t stageOf(uint32_t id) const { return instances[id].stage; }
+
+    bool hasChanges() const { return changed; }
+    void markClean() { changed = false; }
+
+    // Running quests in start order: visit(instance id).
+    template <typename Visit>
+    void forEachActive(Visit visit) const {
+        for (uint32_t id = 0; id < instances.size(); ++id) {
+            if (instances[id].active) visit(id);
+        }
+    }
+
+    size_t subscriptionCount() const {
+        size_t total = 0;
+        for (const auto& entry : triggers) total += entry.second.size();
+        return total;
+    }
+
+    void takeCompleted(vector<uint32_t>& out) {
+        out.swap(completed);
+        completed.clear();
+    }
+
+    void takeChoices(vector<uint32_t>& out) {
+        out.swap(choosing);
+        choosing.clear();
+    }
+};
+
+// Event Bus
+// Subsystems announce what happened instead of calling whoever cares. Each event
+// type has its own bounded ring that any thread may post to without a lock; the
+// game thread hands the queued events to their subscribers in batches, type by
+// type, until nothing is left, so handlers may post further events. The
+// dispatcher drains a full ring itself. Another thread that finds one full
+// cannot wait for it (the dispatcher may be waiting on that thread), so it
+// appends to the channel's overflow list under a lock, as do later posts until
+// the dispatcher has taken the list; each thread's events still arrive in order.
+struct EnemyDefeated {
+    uint32_t nameId;
+    uint32_t location;
+    int experience;
+};
+
+struct ItemAcquired {
+    uint32_t nameId;
+    uint32_t count;
+};
+
+struct LevelUp {
+    uint32_t nameId;  // the character's name
+    int level;
+};
+
+struct QuestCompleted {
+    uint32_t quest;  // QuestEngine definition
+};
+
+struct TimeOfDayChanged {
+    TimeOfDay timeOfDay;
+};
+
+// Bounded multi-producer, single-consumer queue. Every cell carries a sequence
+// number telling producers whether it is free for their position and the
+// consumer whether it has been filled.
+template <typename T>
+class MpscRing {
+private:
+    struct Cell {
+        atomic<size_t> sequence;
+        T value;
+    };
+
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> tail;  // next position producers claim
+    alignas(64) size_t head;          // next position the consumer reads
+
+public:
+    // Capacity must be a power of two.
+    explicit MpscRing(size_t capacity) : cells(new Cell[capacity]), mask(capacity - 1), tail(0), head(0) {
+        for (size_t i = 0; i < capacity; ++i) {
+            cells[i].sequence.store(i, memory_order_relaxed);
+        }
+    }
+
+    bool push(const T& value) {
+        size_t position = tail.load(memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            intptr_t difference = (intptr_t)cell.sequence.load(memory_order_acquire) - (intptr_t)position;
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;  // full: the consumer has not read this cell yet
+            } else {
+                position = tail.load(memory_order_relaxed);
+            }
+        }
+        Cell& cell = cells[position & mask];
+        cell.value = value;
+        cell.sequence.store(position + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T& out) {
+        Cell& cell = cells[head & mask];
+        if (cell.sequence.load(memory_order_acquire) != head + 1) {
+            return false;
+        }
+        out = cell.value;
+        cell.sequence.store(head + mask + 1, memory_order_release);
+        head++;
+        return true;
+    }
+};
+
+template <typename Event>
+struct EventChannel {
+    static constexpr size_t capacity = 1024;
+    MpscRing<Event> ring;
+    vector<function<void(const Event&)>> subscribers;
+    mutex overflowLock;
+    vector<Event> overflow;     // posted while the ring was full
+    atomic<bool> spilled;       // overflow is not empty
+
+    EventChannel() : ring(capacity), spilled(false) {}
+};
+
+class EventBus {
+private:
+    tuple<EventChannel<EnemyDefeated>, EventChannel<ItemAcquired>, EventChannel<LevelUp>, EventChannel<QuestCompleted>,
+          EventChannel<TimeOfDayChanged>> channels;
+    atomic<thread::id> dispatcher;
+    uint64_t dispatched;
+
+    template <typename Event>
+    EventChannel<Event>& channel() {
+        return get<EventChannel<Event>>(channels);
+    }
+
+    // One event at a time, so a handler may post to the ring being drained.
+    // The ring goes first: whatever a thread posted before it spilled is in
+    // the ring by the time the spill is seen.
+    template <typename Event>
+    size_t drain() {
+        EventChannel<Event>& queue = channel<Event>();
+        Event event;
+        size_t count = 0;
+        for (;;) {
+            bool spilled = queue.spilled.load(memory_order_acquire);
+            while (queue.ring.pop(event)) {
+                for (auto& subscriber : queue.subscribers) {
+                    subscriber(event);
+                }
+                count++;
+            }
+            if (!spilled) break;
+            vector<Event> late;
+            {
+                lock_guard<mutex> guard(queue.overflowLock);
+                late.swap(queue.overflow);
+                queue.spilled.store(false, memory_order_relaxed);
+            }
+            for (const Event& spilledEvent : late) {
+                for (auto& subscriber : queue.subscribers) {
+                    subscriber(spilledEvent);
+                }
+                count++;
+            }
+        }
+        return count;
+    }
+
+public:
+    EventBus() : dispatcher(this_thread::get_id()), dispatched(0) {}
+
+    EventBus(const EventBus&) = delete;
+    EventBus& operator=(const EventBus&) = delete;
+
+    // Subscribers are added while setting up, before anything is posted.
+    template <typename Event>
+    void subscribe(function<void(const Event&)> handler) {
+        channel<Event>().subscribers.push_back(move(handler));
+    }
+
+    // Safe from any thread; never waits for the dispatcher.
+    template <typename Event>
+    void post(const Event& event) {
+        EventChannel<Event>& queue = channel<Event>();
+        if (this_thread::get_id() == dispatcher.load(memory_order_relaxed)) {
+            while (!queue.ring.push(event)) {
+                dispatched += drain<Event>();
+            }
+            return;
+        }
+        if (!queue.spilled.load(memory_order_acquire) && queue.ring.push(event)) {
+            return;
+        }
+        lock_guard<mutex> guard(queue.overflowLock);
+        queue.overflow.push_back(event);
+        queue.spilled.store(true, memory_order_release);
+    }
+
+    // Delivers everything queued, including what the handlers post, and returns
+    // how many events that was. Only one thread may dispatch at a time.
+    size_t dispatch() {
+        dispatcher.store(this_thread::get_id(), memory_order_relaxed);
+        size_t total = 0;
+        for (;;) {
+            size_t round = drain<EnemyDefeated>() + drain<ItemAcquired>() + drain<LevelUp>() + drain<QuestCompleted>() +
+                           drain<TimeOfDayChanged>();
+            if (round == 0) break;
+            total += round;
+        }
+        dispatched += total;
+        return total;
+    }
+
+    uint64_t dispatchedCount() const { return dispatched; }
+};
+
+// Character Class with expanded features
+class Character {
+private:
+    static constexpr uint32_t NOTHING_WORN = UINT32_MAX;
+
+    Entity id;
+    InventoryIndex inventory;
+    map<Skill, int> skillLevels;
+    uint32_t weaponStack;  // inventory stack of the worn weapon, or NOTHING_WORN
+    uint32_t armorStack;
+    bool dirty;
+    EventBus* events;
+
+    Health& health() const { return *registry().get<Health>(id); }
+    Combat& combat() const { return *registry().get<Combat>(id); }
+    Progress& progress() const { return *registry().get<Progress>(id); }
+    Status& status() const { return *registry().get<Status>(id); }
+
+    void unequipIfGone(uint32_t& worn) {
+        if (worn != NOTHING_WORN && inventory.stack(worn).count == 0) {
+            unequipRecord(inventory.stack(worn).record);
+            worn = NOTHING_WORN;
+        }
+    }
+
+public:
+    Character(string name)
+        : id(registry().create(Health{ 100, 100 }, Combat{ 10, 5 }, Progress{ 1, 0 }, Named{ nameTable().intern(name) }, Status{ UINT32_MAX })),
+          weaponStack(NOTHING_WORN), armorStack(NOTHING_WORN), dirty(true), events(nullptr) {}
+
+    Character(const Character&) = delete;
+    Character& operator=(const Character&) = delete;
+
+    ~Character() {
+        statusEngine().clear(status().host);
+        registry().destroy(id);
+    }
+
+    // Where level-ups are announced; without one they happen silently.
+    void attachEvents(EventBus* bus) { events = bus; }
+
+    // Set by every change since the last autosave.
+    bool isDirty() const { return dirty; }
+    void markClean() { dirty = false; }
+
+    Entity entity() const { return id; }
+    const string& getName() const { return nameTable().get(registry().get<Named>(id)->nameId); }
+    int getHealth() const { return health().current; }
+    int getMaxHealth() const { return health().max; }
+    int getAttackPower() const { return combat().attack; }
+    int getDefensePower() const { return combat().defense; }
+    int getLevel() const { return progress().level; }
+    int getExperience() const { return progress().experience; }
+    const ItemRecord* getEquippedWeapon() const { return weaponStack == NOTHING_WORN ? nullptr : &inventory.stack(weaponStack).record; }
+    const ItemRecord* getEquippedArmor() const { return armorStack == NOTHING_WORN ? nullptr : &inventory.stack(armorStack).record; }
+
+    // Used by loadGame(): saved attack/defense already include equipment bonuses.
+    // The worn items must already be in the inventory.
+    void restore(int health, int maxHealth, int attackPower, int defensePower, int level, int experience,
+                 const ItemRecord* weapon, const ItemRecord* armor) {
+        this->health() = { health, maxHealth };
+        combat() = { attackPower, defensePower };
+        progress() = { level, experience };
+        const ItemStack* worn = weapon ? inventory.find(*weapon) : nullptr;
+        weaponStack = worn ? inventory.idOf(worn) : NOTHING_WORN;
+        worn = armor ? inventory.find(*armor) : nullptr;
+        armorStack = worn ? inventory.idOf(worn) : NOTHING_WORN;
+        dirty = true;
+    }
+
+    void heal(int amount) {
+        health().current = min(health().max, health().current + amount);
+        dirty = true;
+        screen() << getName() << " healed by " << amount << " health.\n";
+    }
+
+    void takeDamage(int damage) {
+        int damageTaken = applyDamage(id, damage);
+        dirty = true;
+        screen() << getName() << " took " << damageTaken << " damage!\n";
+    }
+
+    int effectiveAttack() const { return attackOf(id); }
+    int effectiveDefense() const { return combat().defense + statusEngine().defenseBonus(status().host); }
+    bool isStunned() const { return statusEngine().isStunned(status().host); }
+
+    void addEffect(EffectKind kind, int magnitude, uint32_t duration, uint32_t period = 1) {
+        statusEngine().apply(status().host, kind, magnitude, duration, period);
+    }
+
+    void applyStatus() {
+        int damage = applyStatusDamage(id);
+        if (damage > 0) {
+            dirty = true;
+            screen() << getName() << " suffers " << damage << " damage over time!\n";
+        }
+    }
+
+    void castSkill(Skill skill) {
+        switch (skill) {
+            case Skill::HEALING_TOUCH: heal(30); break;
+            case Skill::STRENGTH_BOOST: addEffect(EffectKind::ATTACK_UP, 10, 5); break;
+            default: break;
+        }
+    }
+
+    void levelUp() {
+        progress().level++;
+        dirty = true;
+        health().max += 20;
+        combat().attack += 5;
+        combat().defense += 3;
+        if (events) {
+            events->post(LevelUp{ registry().get<Named>(id)->nameId, progress().level });
+        }
+    }
+
+    void gainExperience(int exp) {
+        progress().experience += exp;
+        dirty = true;
+        if (progress().experience >= 100) {
+            progress().experience = 0;
+            levelUp();
+        }
+    }
+
+    void addItem(const ItemRecord& record, size_t count = 1) {
+        inventory.add(record, count);
+        dirty = true;
+    }
+
+    void showInventory() const {
+        if (screen().quiet()) return;
+        screen() << "Inventory:\n";
+        inventory.forEachStack([](const ItemStack& stack) {
+            for (size_t i = 0; i < stack.count; ++i) {
+                displayItem(stack.record);
+            }
+        });
+    }
+
+    // Shows one page of stacks, numbered across the whole view. Returns the page count.
+    size_t showInventoryPage(size_t page, InventoryFilter filter = InventoryFilter(), InventorySort sort = InventorySort::VALUE) {
+        static const size_t itemsPerPage = 10;
+        vector<ItemStack*> stacks;
+        size_t pages = inventory.page(filter, sort, page, itemsPerPage, stacks);
+        screen() << "Inventory (" << inventory.size() << " items):\n";
+        for (size_t i = 0; i < stacks.size(); ++i) {
+            const ItemRecord& record = stacks[i]->record;
+            screen() << page * itemsPerPage + i + 1 << ". " << nameTable().get(record.nameId);
+            if (stacks[i]->count > 1) screen() << " x" << stacks[i]->count;
+            screen() << " (Value: " << record.value << ", Rarity: " << (int)record.rarity << ")\n";
+        }
+        screen() << "Page " << min(page + 1, pages) << " of " << pages << "\n";
+        return pages;
+    }
+
+    size_t countItems(uint32_t nameId) const {
+        return inventory.count(nameId);
+    }
+
+    // Takes items of that name out of the inventory. A worn item goes only with
+    // the last item of its stack, and is unequipped then.
+    size_t takeItems(uint32_t nameId, size_t count) {
+        size_t taken = inventory.take(nameId, count);
+        unequipIfGone(weaponStack);
+        unequipIfGone(armorStack);
+        dirty = true;
+        return taken;
+    }
+
+    // The non-empty stack at position number (1-based) of a view, or nullptr.
+    ItemStack* stackFromView(size_t number, InventoryFilter filter = InventoryFilter(), InventorySort sort = InventorySort::VALUE) {
+        vector<ItemStack*> stacks;
+        if (number == 0) return nullptr;
+        inventory.page(filter, sort, number - 1, 1, stacks);
+        return stacks.empty() || stacks[0]->count == 0 ? nullptr : stacks[0];
+    }
+
+    // Equips an item from the stack at position number (1-based) of a view. The
+    // stack's record picks the slot and the bonus through the type table; the
+    // stack is remembered so saves know which item is worn.
+    void equipFromView(size_t number, InventoryFilter filter = InventoryFilter(), InventorySort sort = InventorySort::VALUE) {
+        ItemStack* stack = stackFromView(number, filter, sort);
+        if (!stack) {
+            screen() << "Invalid index!\n";
+            return;
+        }
+        const ItemRecord& record = stack->record;
+        EquipSlot slot = typeInfo(record.type).slot;
+        if (slot == EquipSlot::NONE) {
+            screen() << nameTable().get(record.nameId) << " cannot be equipped.\n";
+            return;
+        }
+        uint32_t& worn = slot == EquipSlot::WEAPON ? weaponStack : armorStack;
+        if (worn != NOTHING_WORN) {
+            unequipRecord(inventory.stack(worn).record);
+        }
+        equipRecord(record);
+        worn = inventory.idOf(stack);
+        screen() << "Equipped " << nameTable().get(record.nameId) << "\n";
+    }
+
+    // Uses one item from the stack at position number (1-based) of a view through
+    // its record. Consumables are used up; used gets the record, for effects
+    // beyond the character (Fireball).
+    bool useFromView(size_t number, InventoryFilter filter, InventorySort sort, ItemRecord& used) {
+        ItemStack* stack = stackFromView(number, filter, sort);
+        if (!stack) {
+            screen() << "Invalid index!\n";
+            return false;
+        }
+        used = stack->record;
+        if (!typeInfo(used.type).consumable) {
+            screen() << nameTable().get(used.nameId) << " cannot be used.\n";
+            return false;
+        }
+        if (used.type == ItemType::SCROLL) {
+            static const char* const spells[] = { "Unknown Spell", "Fireball", "Healing Touch", "Strength Boost", "Ice Blast", "Lightning Strike" };
+            screen() << "Casting " << spells[(int)used.skill] << "!\n";
+            castSkill(used.skill);
+        } else {
+            screen() << "Using potion: " << nameTable().get(used.nameId) << " restores " << used.healingAmount << " health.\n";
+            useRecord(used);
+        }
+        inventory.take(*stack, 1);
+        dirty = true;
+        return true;
+    }
+
+    // Equipping, unequipping and using go through ItemRecord and the type table;
+    // these are silent, and the callers print.
+    void equipRecord(const ItemRecord& record) {
+        const ItemTypeInfo& info = typeInfo(record.type);
+        combat().attack += record.stat * info.attackWeight;
+        combat().defense += record.stat * info.defenseWeight;
+        dirty = true;
+    }
+
+    void unequipRecord(const ItemRecord& record) {
+        const ItemTypeInfo& info = typeInfo(record.type);
+        combat().attack -= record.stat * info.attackWeight;
+        combat().defense -= record.stat * info.defenseWeight;
+        dirty = true;
+    }
+
+    void useRecord(const ItemRecord& record) {
+        health().current = min(health().max, health().current + record.stat * typeInfo(record.type).healWeight);
+        dirty = true;
+    }
+
+    void displayStats() const {
+        if (screen().quiet()) return;
+        screen() << getName() << "'s Stats:\n";
+        screen() << "Health: " << health().current << "/" << health().max << "\n";
+        screen() << "Attack Power: " << combat().attack << "\n";
+        screen() << "Defense Power: " << combat().defense << "\n";
+        if (status().host != UINT32_MAX) {
+            screen() << "Status Bonuses: +" << statusEngine().attackBonus(status().host) << " attack, +"
+                     << statusEngine().defenseBonus(status().host) << " defense" << (isStunned() ? ", stunned" : "") << "\n";
+        }
+        screen() << "Level: " << progress().level << "\n";
+        screen() << "Experience: " << progress().experience << "\n";
+    }
+
+    const InventoryIndex& getInventory() const {
+        return inventory;
+    }
+
+    map<Skill, int>& getSkillLevels() {
+        return skillLevels;
+    }
+
+};
+
+// Enemy Class with new abilities
+// A handle to an entity in registry(). Copying an Enemy copies the entity, so
+// Location::enemies keeps value semantics; moving hands the entity over.
+class Enemy {
+private:
+    Entity id;
+
+    Health& health() const { return *registry().get<Health>(id); }
+    Status& status() const { return *registry().get<Status>(id); }
+    Abilities& abilities() const { return *registry().get<Abilities>(id); }
+
+public:
+    Enemy(string name, int health, int attackPower)
+        : id(registry().create(Health{ health, health }, Combat{ attackPower, 0 }, Named{ nameTable().intern(name) },
+                               Status{ UINT32_MAX }, Abilities{ {}, 0, 0 })) {}
+
+    Enemy(const Enemy& other) : id(registry().clone(other.id)) {
+        status().host = UINT32_MAX;
+    }
+
+    Enemy(Enemy&& other) noexcept : id(other.id) {
+        other.id = NO_ENTITY;
+    }
+
+    Enemy& operator=(Enemy other) {
+        swap(id, other.id);
+        return *this;
+    }
+
+    ~Enemy() {
+        if (registry().alive(id)) {
+            statusEngine().clear(status().host);
+            registry().destroy(id);
+        }
+    }
+
+    Entity entity() const { return id; }
+    const string& getName() const { return nameTable().get(registry().get<Named>(id)->nameId); }
+    int getHealth() const { return health().current; }
+    int getAttackPower() const { return registry().get<Combat>(id)->attack; }
+
+    void takeDamage(int damage) {
+        int damageTaken = applyDamage(id, damage);
+        screen() << getName() << " took " << damageTaken << " damage!\n";
+    }
+
+    void attack(Character& target) const {
+        if (isStunned()) {
+            screen() << getName() << " is stunned and cannot attack!\n";
+            return;
+        }
+        target.takeDamage(attackOf(id));
+    }
+
+    // Uses the next ability in turn rather than every ability at once.
+    void useAbility(Character& target) {
+        Abilities& known = abilities();
+        if (known.count == 0 || isStunned()) return;
+        Skill ability = known.skills[known.next++ % known.count];
+        screen() << getName() << " uses ability: " << (int)ability << "\n";
+        switch (ability) {
+            case Skill::FIREBALL:
+                target.takeDamage(50);
+                target.addEffect(EffectKind::BURN, 5, 3);
+                break;
+            case Skill::ICE_BLAST:
+                target.takeDamage(20);
+                target.addEffect(EffectKind::STUN, 0, 2);
+                break;
+            case Skill::LIGHTNING_STRIKE:
+                target.takeDamage(35);
+                target.addEffect(EffectKind::STUN, 0, 1);
+                break;
+            case Skill::STRENGTH_BOOST:
+                addEffect(EffectKind::ATTACK_UP, 10, 5);
+                break;
+            default:
+                break;
+        }
+    }
+
+    bool isStunned() const { return statusEngine().isStunned(status().host); }
+
+    void addEffect(EffectKind kind, int magnitude, uint32_t duration, uint32_t period = 1) {
+        statusEngine().apply(status().host, kind, magnitude, duration, period);
+    }
+
+    void applyStatus() {
+        int damage = applyStatusDamage(id);
+        if (damage > 0) {
+            screen() << getName() << " suffers " << damage << " damage over time!\n";
+        }
+    }
+
+    // Drops any effects still running, e.g. once the enemy is defeated.
+    void clearStatus() {
+        statusEngine().clear(status().host);
+    }
+
+    void showStats() const {
+        screen() << getName() << " (Health: " << health().current << ", Attack Power: " << getAttackPower() << ")\n";
+    }
+
+    bool isAlive() const {
+        return health().current > 0;
+    }
+
+    void addAbility(Skill skill) {
+        Abilities& known = abilities();
+        if (known.count < 4 && find(known.skills, known.skills + known.count, skill) == known.skills + known.count) {
+            known.skills[known.count++] = skill;
+        }
+    }
+};
+
+// Item Pool
+// Items are carved out of per-class slabs instead of one new/delete each. Every
+// item belongs to a region (the player's pack, a location, a loot table) and the
+// pool owns it: a region is freed in one call, and nothing else deletes items.
+// Handles pair a slot with a generation, so a handle to a freed item goes stale
+// instead of dangling.
+struct ItemHandle {
+    uint32_t slot;
+    uint32_t generation;
+};
+
+class ItemPool {
+private:
+    template <typename T>
+    class Slab {
+    private:
+        union Cell {
+            Cell* next;
+            alignas(T) unsigned char storage[sizeof(T)];
+        };
+        // Chunks start small and double up to the largest size, so a game with a
+        // handful of items (one server session) does not reserve 1024 of each class.
+        static constexpr size_t firstChunkCells = 8;
+        static constexpr size_t cellsPerChunk = 1024;
+        vector<unique_ptr<Cell[]>> chunks;
+        Cell* freeList = nullptr;
+
+    public:
+        size_t live = 0;
+        size_t capacity = 0;
+
+        void* allocate() {
+            if (!freeList) {
+                size_t cells = min(cellsPerChunk, max(firstChunkCells, capacity));
+                chunks.emplace_back(new Cell[cells]);
+                Cell* chunk = chunks.back().get();
+                for (size_t i = cells; i-- > 0;) {
+                    chunk[i].next = freeList;
+                    freeList = &chunk[i];
+                }
+                capacity += cells;
+            }
+            Cell* cell = freeList;
+            freeList = cell->next;
+            live++;
+            return cell->storage;
+        }
+
+        void release(void* memory) {
+            Cell* cell = (Cell*)memory;
+            cell->next = freeList;
+            freeList = cell;
+            live--;
+        }
+
+        void showStats(const char* label) const {
+            screen() << label << ": " << live << " live, " << capacity << " reserved, "
+                 << capacity * sizeof(Cell) << " bytes\n";
+        }
+    };
+
+    struct Slot {
+        Item* item;
+        uint32_t generation;
+        uint32_t region;
+        uint32_t regionIndex;  // position inside regions[region]
+    };
+
+    Slab<Weapon> weapons;
+    Slab<Armor> armors;
+    Slab<Potion> potions;
+    Slab<Scroll> scrolls;
+    Slab<Material> materials;
+    vector<Slot> slots;
+    vector<uint32_t> freeSlots;
+    vector<vector<uint32_t>> regions;
+    vector<uint32_t> freeRegions;
+
+    Slab<Weapon>& slabFor(Weapon*) { return weapons; }
+    Slab<Armor>& slabFor(Armor*) { return armors; }
+    Slab<Potion>& slabFor(Potion*) { return potions; }
+    Slab<Scroll>& slabFor(Scroll*) { return scrolls; }
+    Slab<Material>& slabFor(Material*) { return materials; }
+
+    template <typename T>
+    void destroyAs(Item* item) {
+        T* typed = static_cast<T*>(item);
+        typed->~T();
+        slabFor(typed).release(typed);
+    }
+
+    void destroy(Item* item) {
+        switch (item->type) {
+            case ItemType::WEAPON: destroyAs<Weapon>(item); break;
+            case ItemType::ARMOR: destroyAs<Armor>(item); break;
+            case ItemType::POTION: destroyAs<Potion>(item); break;
+            case ItemType::SCROLL: destroyAs<Scroll>(item); break;
+            case ItemType::MATERIAL: destroyAs<Material>(item); break;
+            default: break;
+        }
+    }
+
+    void freeSlot(uint32_t slot) {
+        destroy(slots[slot].item);
+        slots[slot].item = nullptr;
+        slots[slot].generation++;
+        freeSlots.push_back(slot);
+    }
+
+    void detach(uint32_t slot) {
+        vector<uint32_t>& members = regions[slots[slot].region];
+        uint32_t last = members.back();
+        members[slots[slot].regionIndex] = last;
+        slots[last].regionIndex = slots[slot].regionIndex;
+        members.pop_back();
+    }
+
+    void attach(uint32_t slot, uint32_t region) {
+        slots[slot].region = region;
+        slots[slot].regionIndex = (uint32_t)regions[region].size();
+        regions[region].push_back(slot);
+    }
+
+public:
+    ItemPool() {}
+    ItemPool(const ItemPool&) = delete;
+    ItemPool& operator=(const ItemPool&) = delete;
+
+    ~ItemPool() {
+        for (uint32_t slot = 0; slot < slots.size(); ++slot) {
+            if (slots[slot].item) {
+                destroy(slots[slot].item);
+            }
+        }
+    }
+
+    uint32_t createRegion() {
+        if (!freeRegions.empty()) {
+            uint32_t region = freeRegions.back();
+            freeRegions.pop_back();
+            return region;
+        }
+        regions.emplace_back();
+        return (uint32_t)regions.size() - 1;
+    }
+
+    // Frees every item in the region at once; the region ID may be reused afterwards.
+    void releaseRegion(uint32_t region) {
+        for (uint32_t slot : regions[region]) {
+            freeSlot(slot);
+        }
+        regions[region].clear();
+        freeRegions.push_back(region);
+    }
+
+    template <typename T, typename... Args>
+    ItemHandle create(uint32_t region, Args&&... args) {
+        T* item = new (slabFor((T*)nullptr).allocate()) T(forward<Args>(args)...);
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slot = (uint32_t)slots.size();
+            slots.push_back({ nullptr, 0, 0, 0 });
+        }
+        slots[slot].item = item;
+        attach(slot, region);
+        return { slot, slots[slot].generation };
+    }
+
+    template <typename T, typename... Args>
+    T* make(uint32_t region, Args&&... args) {
+        return static_cast<T*>(get(create<T>(region, forward<Args>(args)...)));
+    }
+
+    // Returns nullptr once the item behind the handle has been freed.
+    Item* get(ItemHandle handle) const {
+        if (handle.slot >= slots.size() || slots[handle.slot].generation != handle.generation) {
+            return nullptr;
+        }
+        return slots[handle.slot].item;
+    }
+
+    void release(ItemHandle handle) {
+        if (get(handle)) {
+            detach(handle.slot);
+            freeSlot(handle.slot);
+        }
+    }
+
+    // Frees the given items of one region with a single pass over the region.
+    void releaseItems(uint32_t region, const vector<Item*>& items) {
+        unordered_set<Item*> doomed(items.begin(), items.end());
+        vector<uint32_t> found;
+        for (uint32_t slot : regions[region]) {
+            if (doomed.count(slots[slot].item)) found.push_back(slot);
+        }
+        for (uint32_t slot : found) {
+            detach(slot);
+            freeSlot(slot);
+        }
+    }
+
+    // Hands an item to another owner, e.g. when the player picks it up.
+    void moveToRegion(ItemHandle handle, uint32_t region) {
+        if (get(handle)) {
+            detach(handle.slot);
+            attach(handle.slot, region);
+        }
+    }
+
+    size_t regionSize(uint32_t region) const {
+        return regions[region].size();
+    }
+
+    void showStats() const {
+        screen() << "Item Pool:\n";
+        weapons.showStats("Weapons");
+        armors.showStats("Armor");
+        potions.showStats("Potions");
+        scrolls.showStats("Scrolls");
+        materials.showStats("Materials");
+        screen() << "Regions: " << regions.size() - freeRegions.size() << ", Slots: " << slots.size() - freeSlots.size() << "\n";
+    }
+};
+
+// Content Packs
+// Items, enemies and quests are written as a text source, one "kind|key|fields"
+// line each, and compileContent() turns that into a binary table: fixed-size
+// records followed by one blob of NUL-terminated strings. Loading a table interns
+// each distinct string once into nameTable(), so prototypes carry only IDs.
+const char DEFAULT_CONTENT[] =
+    "# kind|key|fields...\n"
+    "item|healing_potion|POTION|COMMON|30|50|Healing Potion|Restores health.\n"
+    "item|sword|WEAPON|RARE|100|30|Sword|A plain steel sword.\n"
+    "item|leather_armor|ARMOR|COMMON|40|10|Leather Armor|Light armor of hardened leather.\n"
+    "item|fireball_scroll|SCROLL|UNCOMMON|60|FIREBALL|Fireball Scroll|Teaches Fireball.\n"
+    "item|iron_ore|MATERIAL|COMMON|5|0|Iron Ore|A lump of raw iron.\n"
+    "item|wood|MATERIAL|COMMON|2|0|Wood|A seasoned branch.\n"
+    "item|leather_scrap|MATERIAL|COMMON|3|0|Leather Scrap|An offcut of tanned hide.\n"
+    "item|iron_ingot|MATERIAL|UNCOMMON|20|0|Iron Ingot|Smelted from iron ore.\n"
+    "item|sword_hilt|MATERIAL|UNCOMMON|10|0|Sword Hilt|A wrapped wooden grip.\n"
+    "item|iron_sword|WEAPON|RARE|150|35|Iron Sword|A forged iron blade.\n"
+    "item|studded_armor|ARMOR|UNCOMMON|80|18|Studded Armor|Leather armor set with iron studs.\n"
+    "enemy|goblin|50|10|Goblin\n"
+    "enemy|troll|100|30|Troll\n"
+    "enemy|skeleton|30|6|Skeleton\n"
+    "quest|town_elder|MAIN|50|Visit the Town Elder|Speak with the elder in town.\n"
+    "quest|dungeon_troll|SIDE|100|Defeat the Troll|Defeat the troll guarding the dungeon.\n";
+
+struct ContentHeader {
+    char magic[4];  // "RPGC"
+    uint32_t version;
+    uint32_t itemCount;
+    uint32_t enemyCount;
+    uint32_t questCount;
+    uint32_t stringCount;
+    uint32_t stringBytes;
+};
+
+// String fields are indices into the blob of strings that follows the records.
+struct PackedItem {
+    uint8_t type;
+    uint8_t rarity;
+    uint16_t reserved;
+    int32_t value;
+    int32_t stat;
+    uint32_t key;
+    uint32_t name;
+    uint32_t description;
+};
+
+struct PackedEnemy {
+    int32_t health;
+    int32_t attack;
+    uint32_t key;
+    uint32_t name;
+};
+
+struct PackedQuest {
+    uint8_t type;
+    uint8_t reserved[3];
+    int32_t rewardExp;
+    uint32_t key;
+    uint32_t title;
+    uint32_t description;
+};
+
+struct ItemPrototype {
+    ItemRecord record;
+    uint32_t keyId;
+    uint32_t descriptionId;
+};
+
+struct EnemyPrototype {
+    uint32_t keyId;
+    uint32_t nameId;
+    int32_t health;
+    int32_t attack;
+};
+
+struct QuestPrototype {
+    uint32_t keyId;
+    uint32_t titleId;
+    uint32_t descriptionId;
+    QuestType type;
+    int32_t rewardExp;
+};
+
+static constexpr uint32_t CONTENT_VERSION = 1;
+
+// Parses the text form and writes the binary table to out. Reports the first bad
+// line and returns false.
+bool compileContent(const string& source, vector<char>& out) {
+    static const char* const itemTypes[] = { "WEAPON", "ARMOR", "POTION", "SCROLL", "TRAP", "ARTIFACT", "MATERIAL" };
+    static const char* const rarities[] = { "COMMON", "UNCOMMON", "RARE", "LEGENDARY" };
+    static const char* const skills[] = { "NONE", "FIREBALL", "HEALING_TOUCH", "STRENGTH_BOOST", "ICE_BLAST", "LIGHTNING_STRIKE" };
+    static const char* const questTypes[] = { "MAIN", "SIDE" };
+    auto lookup = [](const char* const* names, size_t count, const string& text) {
+        for (size_t i = 0; i < count; ++i) {
+            if (text == names[i]) return (int)i;
+        }
+        return -1;
+    };
+
+    vector<PackedItem> items;
+    vector<PackedEnemy> enemies;
+    vector<PackedQuest> quests;
+    string blob;
+    unordered_map<string, uint32_t> indices;
+    auto addString = [&](const string& text) {
+        auto found = indices.find(text);
+        if (found != indices.end()) return found->second;
+        uint32_t index = (uint32_t)indices.size();
+        blob.append(text).push_back('\0');
+        indices.emplace(text, index);
+        return index;
+    };
+
+    size_t lineNumber = 0;
+    size_t position = 0;
+    vector<string> fields;
+    while (position < source.size()) {
+        size_t end = source.find('\n', position);
+        if (end == string::npos) end = source.size();
+        string line = source.substr(position, end - position);
+        position = end + 1;
+        lineNumber++;
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+
+        fields.clear();
+        size_t start = 0;
+        for (size_t bar; (bar = line.find('|', start)) != string::npos; start = bar + 1) {
+            fields.push_back(line.substr(start, bar - start));
+        }
+        fields.push_back(line.substr(start));
+
+        bool ok = false;
+        if (fields[0] == "item" && fields.size() == 8) {
+            int type = lookup(itemTypes, 7, fields[2]);
+            int rarity = lookup(rarities, 4, fields[3]);
+            int stat = type == (int)ItemType::SCROLL ? lookup(skills, 6, fields[5]) : atoi(fields[5].c_str());
+            if (type >= 0 && rarity >= 0 && stat >= 0) {
+                items.push_back({ (uint8_t)type, (uint8_t)rarity, 0, atoi(fields[4].c_str()), stat,
+                                  addString(fields[1]), addString(fields[6]), addString(fields[7]) });
+                ok = true;
+            }
+        } else if (fields[0] == "enemy" && fields.size() == 5) {
+            enemies.push_back({ atoi(fields[2].c_str()), atoi(fields[3].c_str()), addString(fields[1]), addString(fields[4]) });
+            ok = true;
+        } else if (fields[0] == "quest" && fields.size() == 6) {
+            int type = lookup(questTypes, 2, fields[2]);
+            if (type >= 0) {
+                quests.push_back({ (uint8_t)type, { 0, 0, 0 }, atoi(fields[3].c_str()),
+                                   addString(fields[1]), addString(fields[4]), addString(fields[5]) });
+                ok = true;
+            }
+        }
+        if (!ok) {
+            screen() << "Content error on line " << lineNumber << ": " << line << "\n";
+            return false;
+        }
+    }
+
+    ContentHeader header = { { 'R', 'P', 'G', 'C' }, CONTENT_VERSION, (uint32_t)items.size(),
+                             (uint32_t)enemies.size(), (uint32_t)quests.size(), (uint32_t)indices.size(), (uint32_t)blob.size() };
+    out.clear();
+    auto put = [&](const void* data, size_t size) {
+        out.insert(out.end(), (const char*)data, (const char*)data + size);
+    };
+    put(&header, sizeof(header));
+    put(items.data(), items.size() * sizeof(PackedItem));
+    put(enemies.data(), enemies.size() * sizeof(PackedEnemy));
+    put(quests.data(), quests.size() * sizeof(PackedQuest));
+    put(blob.data(), blob.size());
+    return true;
+}
+
+class ContentPack {
+private:
+    vector<ItemPrototype> items;
+    vector<EnemyPrototype> enemies;
+    vector<QuestPrototype> quests;
+    unordered_map<uint32_t, uint32_t> itemByKey;
+    unordered_map<uint32_t, uint32_t> enemyByKey;
+    unordered_map<uint32_t, uint32_t> questByKey;
+
+    static uint32_t indexOf(const unordered_map<uint32_t, uint32_t>& index, const string& key) {
+        auto found = index.find(nameTable().intern(key));
+        return found == index.end() ? UINT32_MAX : found->second;
+    }
+
+public:
+    bool load(const char* data, size_t size) {
+        ContentHeader header;
+        if (size < sizeof(header)) {
+            screen() << "Content table is truncated.\n";
+            return false;
+        }
+        memcpy(&header, data, sizeof(header));
+        size_t expected = sizeof(header) + header.itemCount * sizeof(PackedItem) + header.enemyCount * sizeof(PackedEnemy)
+                          + header.questCount * sizeof(PackedQuest) + header.stringBytes;
+        if (memcmp(header.magic, "RPGC", 4) != 0 || header.version != CONTENT_VERSION || size != expected) {
+            screen() << "Content table is not valid.\n";
+            return false;
+        }
+        const char* cursor = data + sizeof(header);
+        const PackedItem* packedItems = (const PackedItem*)cursor;
+        cursor += header.itemCount * sizeof(PackedItem);
+        const PackedEnemy* packedEnemies = (const PackedEnemy*)cursor;
+        cursor += header.enemyCount * sizeof(PackedEnemy);
+        const PackedQuest* packedQuests = (const PackedQuest*)cursor;
+        cursor += header.questCount * sizeof(PackedQuest);
+        const char* blob = cursor;
+        if ((header.stringBytes && blob[header.stringBytes - 1] != '\0') || header.stringCount > header.stringBytes) {
+            screen() << "Content table is not valid.\n";
+            return false;
+        }
+
+        // Every record is checked before anything is added, so a bad table leaves
+        // the pack as it was. spawn() has no class for traps or artifacts.
+        auto text = [&header](uint32_t index) { return index < header.stringCount; };
+        const uint32_t skillLimit = (uint32_t)Skill::LIGHTNING_STRIKE;
+        for (uint32_t i = 0; i < header.itemCount; ++i) {
+            const PackedItem& packed = packedItems[i];
+            bool spawnable = packed.type < ITEM_TYPE_COUNT && packed.type != (uint8_t)ItemType::TRAP && packed.type != (uint8_t)ItemType::ARTIFACT;
+            if (!text(packed.key) || !text(packed.name) || !text(packed.description) || !spawnable ||
+                packed.rarity > (uint8_t)Rarity::LEGENDARY || (packed.type == (uint8_t)ItemType::SCROLL && (uint32_t)packed.stat > skillLimit)) {
+                screen() << "Content table has a bad item record.\n";
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < header.enemyCount; ++i) {
+            if (!text(packedEnemies[i].key) || !text(packedEnemies[i].name)) {
+                screen() << "Content table has a bad enemy record.\n";
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < header.questCount; ++i) {
+            const PackedQuest& packed = packedQuests[i];
+            if (!text(packed.key) || !text(packed.title) || !text(packed.description) || packed.type > (uint8_t)QuestType::SIDE) {
+                screen() << "Content table has a bad quest record.\n";
+                return false;
+            }
+        }
+
+        // The compiler stores each distinct string once, so each is interned once.
+        vector<uint32_t> ids;
+        ids.reserve(header.stringCount);
+        nameTable().reserve(nameTable().size() + header.stringCount);
+        for (const char* text = blob; text < blob + header.stringBytes; text += strlen(text) + 1) {
+            ids.push_back(nameTable().intern(text));
+        }
+        if (ids.size() != header.stringCount) {
+            screen() << "Content table is not valid.\n";
+            return false;
+        }
+        auto id = [&](uint32_t index) { return ids[index]; };
+        itemByKey.reserve(itemByKey.size() + header.itemCount);
+
+        items.reserve(items.size() + header.itemCount);
+        for (uint32_t i = 0; i < header.itemCount; ++i) {
+            const PackedItem& packed = packedItems[i];
+            ItemPrototype prototype;
+            prototype.record.type = (ItemType)packed.type;
+            prototype.record.rarity = (Rarity)packed.rarity;
+            prototype.record.value = packed.value;
+            prototype.record.nameId = id(packed.name);
+            prototype.record.stat = packed.stat;
+            prototype.keyId = id(packed.key);
+            prototype.descriptionId = id(packed.description);
+            itemByKey[prototype.keyId] = (uint32_t)items.size();
+            items.push_back(prototype);
+        }
+        for (uint32_t i = 0; i < header.enemyCount; ++i) {
+            const PackedEnemy& packed = packedEnemies[i];
+            enemyByKey[id(packed.key)] = (uint32_t)enemies.size();
+            enemies.push_back({ id(packed.key), id(packed.name), packed.health, packed.attack });
+        }
+        for (uint32_t i = 0; i < header.questCount; ++i) {
+            const PackedQuest& packed = packedQuests[i];
+            questByKey[id(packed.key)] = (uint32_t)quests.size();
+            quests.push_back({ id(packed.key), id(packed.title), id(packed.description), (QuestType)packed.type, packed.rewardExp });
+        }
+        return true;
+    }
+
+    bool loadFile(const string& path) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+        vector<char> data;
+        char buffer[65536];
+        size_t got;
+        while ((got = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            data.insert(data.end(), buffer, buffer + got);
+        }
+        fclose(file);
+        return load(data.data(), data.size());
+    }
+
+    bool loadText(const string& source) {
+        vector<char> table;
+        return compileContent(source, table) && load(table.data(), table.size());
+    }
+
+    uint32_t findItem(const string& key) const { return indexOf(itemByKey, key); }
+    uint32_t findEnemy(const string& key) const { return indexOf(enemyByKey, key); }
+    uint32_t findQuest(const string& key) const { return indexOf(questByKey, key); }
+
+    size_t itemCount() const { return items.size(); }
+    const ItemPrototype& item(uint32_t index) const { return items[index]; }
+    const EnemyPrototype& enemy(uint32_t index) const { return enemies[index]; }
+
+    // Builds a full Item in the pool, for code that needs the class hierarchy.
+    // Inventories and locations hold the prototype's ItemRecord instead.
+    Item* spawn(ItemPool& pool, uint32_t region, const ItemRecord& record) const {
+        const string& name = nameTable().get(record.nameId);
+        switch (record.type) {
+            case ItemType::WEAPON: return pool.make<Weapon>(region, name, record.value, record.rarity, record.attackPower);
+            case ItemType::ARMOR: return pool.make<Armor>(region, name, record.value, record.rarity, record.defensePower);
+            case ItemType::POTION: return pool.make<Potion>(region, name, record.value, record.rarity, record.healingAmount);
+            case ItemType::SCROLL: return pool.make<Scroll>(region, name, record.value, record.rarity, record.skill);
+            case ItemType::MATERIAL: return pool.make<Material>(region, name, record.value, record.rarity);
+            default: return nullptr;
+        }
+    }
+
+    Quest makeQuest(uint32_t index) const {
+        const QuestPrototype& prototype = quests[index];
+        return Quest(nameTable().get(prototype.titleId), nameTable().get(prototype.descriptionId), prototype.type, prototype.rewardExp);
+    }
+};
+
+// Loot Tables
+// A table is a list of weighted entries (an item prototype, a nested table, or
+// nothing) rolled a fixed number of times, plus drops that always happen. Each
+// table is turned into Vose alias arrays on first use, so a roll costs one random
+// number and two array reads however many entries there are. Tables are found
+// by enemy name, so every Troll shares one.
+enum class LootKind : uint8_t { ITEM, TABLE, NOTHING };
+
+struct LootEntry {
+    LootKind kind;
+    uint16_t minCount;
+    uint16_t maxCount;
+    uint32_t target;  // item prototype or table index
+    double weight;
+};
+
+struct LootDrop {
+    uint32_t prototype;
+    uint32_t count;
+};
+
+// Default weight for an item entry, by rarity.
+static constexpr double RARITY_WEIGHTS[] = { 60.0, 25.0, 12.0, 3.0 };
+
+class LootSystem {
+private:
+    struct Table {
+        uint32_t nameId;
+        int rolls;
+        vector<LootEntry> entries;
+        vector<LootEntry> guaranteed;
+        vector<uint32_t> threshold;  // alias columns: keep the entry if the coin is below this
+        vector<uint32_t> alias;
+        bool built = false;
+    };
+
+    static constexpr int maxDepth = 8;
+
+    const ContentPack& content;
+    vector<Table> tables;
+    unordered_map<uint32_t, uint32_t> tableByName;
+
+    // Vose's alias method: split the scaled weights into small and large columns,
+    // then fill each small column up to 1 with part of a large one.
+    static void build(Table& table) {
+        size_t count = table.entries.size();
+        table.threshold.assign(count, UINT32_MAX);
+        table.alias.resize(count);
+        double total = 0;
+        for (const auto& entry : table.entries) total += entry.weight;
+        vector<double> scaled(count);
+        vector<uint32_t> small, large;
+        for (size_t i = 0; i < count; ++i) {
+            table.alias[i] = (uint32_t)i;
+            scaled[i] = table.entries[i].weight * count / total;
+            (scaled[i] < 1.0 ? small : large).push_back((uint32_t)i);
+        }
+        while (!small.empty() && !large.empty()) {
+            uint32_t less = small.back(), more = large.back();
+            small.pop_back();
+            table.threshold[less] = (uint32_t)min(scaled[less] * 4294967296.0, 4294967295.0);
+            table.alias[less] = more;
+            scaled[more] -= 1.0 - scaled[less];
+            if (scaled[more] < 1.0) {
+                large.pop_back();
+                small.push_back(more);
+            }
+        }
+        table.built = true;
+    }
+
+    const LootEntry* pick(Table& table, CounterRng& rng) {
+        if (table.entries.empty()) return nullptr;
+        if (!table.built) build(table);
+        uint64_t bits = rng.next();
+        uint32_t column = (uint32_t)(((bits >> 32) * table.entries.size()) >> 32);
+        uint32_t coin = (uint32_t)bits;
+        return &table.entries[coin < table.threshold[column] ? column : table.alias[column]];
+    }
+
+    template <typename Emit>
+    void rollInto(uint32_t index, CounterRng& rng, int depth, Emit& emit) {
+        Table& table = tables[index];
+        auto apply = [&](const LootEntry& entry) {
+            if (entry.kind == LootKind::ITEM) {
+                emit(entry.target, (uint32_t)rng.range(entry.minCount, entry.maxCount));
+            } else if (entry.kind == LootKind::TABLE && depth < maxDepth) {
+                rollInto(entry.target, rng, depth + 1, emit);
+            }
+        };
+        for (const auto& entry : table.guaranteed) {
+            apply(entry);
+        }
+        for (int i = 0; i < table.rolls; ++i) {
+            if (const LootEntry* entry = pick(table, rng)) {
+                apply(*entry);
+            }
+        }
+    }
+
+    // Mean count of each prototype per roll of the table, written into expected.
+    void expectation(uint32_t index, double scale, int depth, vector<double>& expected) const {
+        const Table& table = tables[index];
+        auto apply = [&](const LootEntry& entry, double chance) {
+            if (entry.kind == LootKind::ITEM) {
+                expected[entry.target] += chance * (entry.minCount + entry.maxCount) / 2.0;
+            } else if (entry.kind == LootKind::TABLE && depth < maxDepth) {
+                expectation(entry.target, chance, depth + 1, expected);
+            }
+        };
+        for (const auto& entry : table.guaranteed) {
+            apply(entry, scale);
+        }
+        double total = 0;
+        for (const auto& entry : table.entries) total += entry.weight;
+        for (const auto& entry : table.entries) {
+            apply(entry, scale * table.rolls * entry.weight / total);
+        }
+    }
+
+public:
+    LootSystem(const ContentPack& content) : content(content) {}
+
+    // Creates a table, or returns the existing one of that name.
+    uint32_t addTable(const string& name, int rolls) {
+        uint32_t nameId = nameTable().intern(name);
+        auto found = tableByName.find(nameId);
+        if (found != tableByName.end()) {
+            return found->second;
+        }
+        tables.push_back(Table());
+        tables.back().nameId = nameId;
+        tables.back().rolls = rolls;
+        tableByName[nameId] = (uint32_t)tables.size() - 1;
+        return (uint32_t)tables.size() - 1;
+    }
+
+    uint32_t findTable(const string& name) const {
+        auto found = tableByName.find(nameTable().intern(name));
+        return found == tableByName.end() ? UINT32_MAX : found->second;
+    }
+
+    size_t tableCount() const {
+        return tables.size();
+    }
+
+    const string& tableName(uint32_t table) const {
+        return nameTable().get(tables[table].nameId);
+    }
+
+    // weight <= 0 uses the item's rarity weight.
+    void addItem(uint32_t table, const string& itemKey, double weight = 0, int minCount = 1, int maxCount = 1) {
+        uint32_t prototype = content.findItem(itemKey);
+        if (prototype == UINT32_MAX) {
+            screen() << "Unknown loot item: " << itemKey << "\n";
+            return;
+        }
+        if (weight <= 0) {
+            weight = RARITY_WEIGHTS[(int)content.item(prototype).record.rarity];
+        }
+        tables[table].entries.push_back({ LootKind::ITEM, (uint16_t)minCount, (uint16_t)maxCount, prototype, weight });
+        tables[table].built = false;
+    }
+
+    // A table may only nest tables created before it, so there are no cycles.
+    void addSubTable(uint32_t table, uint32_t subTable, double weight) {
+        if (subTable >= table) {
+            screen() << "Loot tables can only nest earlier tables.\n";
+            return;
+        }
+        tables[table].entries.push_back({ LootKind::TABLE, 1, 1, subTable, weight });
+        tables[table].built = false;
+    }
+
+    void addNothing(uint32_t table, double weight) {
+        tables[table].entries.push_back({ LootKind::NOTHING, 0, 0, 0, weight });
+        tables[table].built = false;
+    }
+
+    void addGuaranteed(uint32_t table, const string& itemKey, int minCount = 1, int maxCount = 1) {
+        uint32_t prototype = content.findItem(itemKey);
+        if (prototype == UINT32_MAX) {
+            screen() << "Unknown loot item: " << itemKey << "\n";
+            return;
+        }
+        tables[table].guaranteed.push_back({ LootKind::ITEM, (uint16_t)minCount, (uint16_t)maxCount, prototype, 1.0 });
+    }
+
+    void roll(uint32_t table, CounterRng& rng, vector<LootDrop>& drops) {
+        auto emit = [&](uint32_t prototype, uint32_t count) {
+            if (count) drops.push_back({ prototype, count });
+        };
+        rollInto(table, rng, 0, emit);
+    }
+
+    // Rolls the table once per kill and adds up the drops per item prototype.
+    // Kill i always uses stream i of the seed, so totals do not depend on batching.
+    void rollBatch(uint32_t table, uint64_t firstKill, uint64_t kills, uint64_t seed, vector<uint64_t>& counts) {
+        counts.resize(content.itemCount(), 0);
+        auto emit = [&](uint32_t prototype, uint32_t count) {
+            counts[prototype] += count;
+        };
+        for (uint64_t kill = firstKill; kill < firstKill + kills; ++kill) {
+            CounterRng rng(seed, kill);
+            rollInto(table, rng, 0, emit);
+        }
+    }
+
+    vector<double> expectedPerKill(uint32_t table) const {
+        vector<double> expected(content.itemCount(), 0.0);
+        expectation(table, 1.0, 0, expected);
+        return expected;
+    }
+
+    // Observed drops per kill against the exact expectation, grouped by rarity.
+    void showDistribution(uint32_t table, uint64_t kills, uint64_t seed) {
+        vector<uint64_t> counts;
+        rollBatch(table, 0, kills, seed, counts);
+        vector<double> expected = expectedPerKill(table);
+        double observedByRarity[4] = {}, expectedByRarity[4] = {};
+        for (size_t i = 0; i < counts.size(); ++i) {
+            int rarity = (int)content.item((uint32_t)i).record.rarity;
+            observedByRarity[rarity] += (double)counts[i] / kills;
+            expectedByRarity[rarity] += expected[i];
+        }
+        static const char* const names[] = { "Common", "Uncommon", "Rare", "Legendary" };
+        screen() << "Loot table " << nameTable().get(tables[table].nameId) << ", " << kills << " kills:\n";
+        for (int rarity = 0; rarity < 4; ++rarity) {
+            screen() << names[rarity] << ": " << observedByRarity[rarity] << " per kill (expected "
+                     << expectedByRarity[rarity] << ")\n";
+        }
+    }
+
+    // Table for an enemy type, or UINT32_MAX if it drops nothing.
+    uint32_t tableFor(uint32_t enemyNameId) const {
+        return findTable(nameTable().get(enemyNameId));
+    }
+};
+
+// Crafting
+// A recipe turns a multiset of item prototypes into some number of one output.
+// Recipes are indexed by their sorted ingredient list, so the items put together
+// by the player are matched with one hash lookup. An output may be an ingredient
+// of other recipes but never of its own inputs, so recipes form a DAG. Planning
+// "as many as possible" makes each missing ingredient with its first recipe:
+// whether n crafts are possible is one pass down the chain, from the target to
+// raw materials, using inventory counts, and n is found by binary search.
+struct RecipeIngredient {
+    uint32_t prototype;
+    uint32_t count;
+};
+
+struct CraftStep {
+    uint32_t recipe;
+    uint64_t times;
+};
+
+class CraftingSystem {
+private:
+    struct Recipe {
+        uint32_t output;
+        uint32_t outputCount;
+        vector<RecipeIngredient> ingredients;  // sorted by prototype, one entry each
+    };
+
+    const ContentPack& content;
+    vector<Recipe> recipes;
+    unordered_map<uint64_t, vector<uint32_t>> recipesByIngredients;
+    unordered_map<uint32_t, vector<uint32_t>> producers;  // output prototype -> recipes
+
+    static uint64_t keyOf(const vector<RecipeIngredient>& ingredients) {
+        uint64_t key = ingredients.size();
+        for (const auto& ingredient : ingredients) {
+            key = CounterRng::mix(key ^ ((uint64_t)ingredient.prototype << 32 | ingredient.count));
+        }
+        return key;
+    }
+
+    // Sorts and merges repeated prototypes.
+    static vector<RecipeIngredient> normalize(vector<RecipeIngredient> ingredients) {
+        sort(ingredients.begin(), ingredients.end(), [](const RecipeIngredient& a, const RecipeIngredient& b) {
+            return a.prototype < b.prototype;
+        });
+        vector<RecipeIngredient> merged;
+        for (const auto& ingredient : ingredients) {
+            if (!merged.empty() && merged.back().prototype == ingredient.prototype) {
+                merged.back().count += ingredient.count;
+            } else {
+                merged.push_back(ingredient);
+            }
+        }
+        return merged;
+    }
+
+    uint32_t producerOf(uint32_t prototype) const {
+        auto found = producers.find(prototype);
+        return found == producers.end() ? UINT32_MAX : found->second.front();
+    }
+
+    // True if making prototype can take target, through any recipe.
+    bool needs(uint32_t prototype, uint32_t target, unordered_set<uint32_t>& seen) const {
+        if (prototype == target) return true;
+        if (!seen.insert(prototype).second) return false;
+        auto found = producers.find(prototype);
+        if (found == producers.end()) return false;
+        for (uint32_t recipe : found->second) {
+            for (const auto& ingredient : recipes[recipe].ingredients) {
+                if (needs(ingredient.prototype, target, seen)) return true;
+            }
+        }
+        return false;
+    }
+
+    // Everything the recipe can draw on through first recipes, each item listed
+    // after all the items that use it.
+    vector<uint32_t> chainOf(uint32_t recipe) const {
+        unordered_map<uint32_t, int> level;
+        function<int(uint32_t)> visit = [&](uint32_t prototype) {
+            auto known = level.find(prototype);
+            if (known != level.end()) return known->second;
+            int depth = 0;
+            uint32_t producer = producerOf(prototype);
+            if (producer != UINT32_MAX) {
+                for (const auto& ingredient : recipes[producer].ingredients) {
+                    depth = max(depth, visit(ingredient.prototype) + 1);
+                }
+            }
+            level[prototype] = depth;
+            return depth;
+        };
+        for (const auto& ingredient : recipes[recipe].ingredients) {
+            visit(ingredient.prototype);
+        }
+        vector<uint32_t> order;
+        for (const auto& entry : level) order.push_back(entry.first);
+        sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return level[a] != level[b] ? level[a] > level[b] : a < b;
+        });
+        return order;
+    }
+
+    // Fills crafts (indexed like chain, plus the target last) if n target crafts
+    // can be made from the counts in have.
+    bool feasible(uint32_t recipe, uint64_t n, const vector<uint32_t>& chain, const vector<uint64_t>& have,
+                  unordered_map<uint32_t, size_t>& position, vector<uint64_t>& need, vector<CraftStep>& crafts) const {
+        need.assign(chain.size(), 0);
+        crafts.clear();
+        for (const auto& ingredient : recipes[recipe].ingredients) {
+            need[position[ingredient.prototype]] += n * ingredient.count;
+        }
+        for (size_t i = 0; i < chain.size(); ++i) {
+            if (need[i] <= have[i]) continue;
+            uint32_t producer = producerOf(chain[i]);
+            if (producer == UINT32_MAX) return false;
+            uint64_t times = (need[i] - have[i] + recipes[producer].outputCount - 1) / recipes[producer].outputCount;
+            crafts.push_back({ producer, times });
+            for (const auto& ingredient : recipes[producer].ingredients) {
+                need[position[ingredient.prototype]] += times * ingredient.count;
+            }
+        }
+        reverse(crafts.begin(), crafts.end());
+        crafts.push_back({ recipe, n });
+        return true;
+    }
+
+public:
+    CraftingSystem(const ContentPack& content) : content(content) {}
+
+    // Returns the recipe index, or UINT32_MAX if a key is unknown or the recipe
+    // would let an item be made from itself.
+    uint32_t addRecipe(const string& outputKey, uint32_t outputCount, const vector<pair<string, uint32_t>>& ingredientKeys) {
+        uint32_t output = content.findItem(outputKey);
+        vector<RecipeIngredient> ingredients;
+        for (const auto& ingredient : ingredientKeys) {
+            uint32_t prototype = content.findItem(ingredient.first);
+            if (prototype == UINT32_MAX || ingredient.second == 0) {
+                screen() << "Unknown recipe ingredient: " << ingredient.first << "\n";
+                return UINT32_MAX;
+            }
+            ingredients.push_back({ prototype, ingredient.second });
+        }
+        if (output == UINT32_MAX || outputCount == 0 || ingredients.empty()) {
+            screen() << "Invalid recipe for " << outputKey << "\n";
+            return UINT32_MAX;
+        }
+        ingredients = normalize(ingredients);
+        for (const auto& ingredient : ingredients) {
+            unordered_set<uint32_t> seen;
+            if (needs(ingredient.prototype, output, seen)) {
+                screen() << "Recipe for " << outputKey << " would form a cycle.\n";
+                return UINT32_MAX;
+            }
+        }
+        uint32_t index = (uint32_t)recipes.size();
+        recipes.push_back({ output, outputCount, ingredients });
+        recipesByIngredients[keyOf(ingredients)].push_back(index);
+        producers[output].push_back(index);
+        return index;
+    }
+
+    size_t recipeCount() const { return recipes.size(); }
+    uint32_t output(uint32_t recipe) const { return recipes[recipe].output; }
+    uint32_t outputCount(uint32_t recipe) const { return recipes[recipe].outputCount; }
+    const vector<RecipeIngredient>& ingredients(uint32_t recipe) const { return recipes[recipe].ingredients; }
+
+    // The recipe that takes exactly these items (in any order), or UINT32_MAX.
+    uint32_t match(const vector<uint32_t>& prototypes) const {
+        vector<RecipeIngredient> ingredients;
+        for (uint32_t prototype : prototypes) ingredients.push_back({ prototype, 1 });
+        auto found = recipesByIngredients.find(keyOf(normalize(ingredients)));
+        if (found == recipesByIngredients.end()) return UINT32_MAX;
+        ingredients = normalize(ingredients);
+        for (uint32_t recipe : found->second) {
+            const auto& wanted = recipes[recipe].ingredients;
+            if (wanted.size() == ingredients.size() &&
+                equal(wanted.begin(), wanted.end(), ingredients.begin(), [](const RecipeIngredient& a, const RecipeIngredient& b) {
+                    return a.prototype == b.prototype && a.count == b.count;
+                })) {
+                return recipe;
+            }
+        }
+        return UINT32_MAX;
+    }
+
+    // Plans up to wanted crafts of the recipe, making missing ingredients along
+    // the way. Steps come in the order they must run; returns the crafts planned.
+    uint64_t plan(const Character& player, uint32_t recipe, uint64_t wanted, vector<CraftStep>& steps) const {
+        vector<uint32_t> chain = chainOf(recipe);
+        unordered_map<uint32_t, size_t> position;
+        vector<uint64_t> have(chain.size());
+        for (size_t i = 0; i < chain.size(); ++i) {
+            position[chain[i]] = i;
+            have[i] = player.countItems(content.item(chain[i]).record.nameId);
+        }
+        vector<uint64_t> need;
+        vector<CraftStep> crafts;
+        steps.clear();
+        // Grow the bound until it fails, then narrow it down.
+        uint64_t low = 0, high = 1;
+        while (high <= wanted && feasible(recipe, high, chain, have, position, need, crafts)) {
+            low = high;
+            steps = crafts;
+            high *= 2;
+        }
+        high = min(high, wanted + 1);
+        while (high - low > 1) {
+            uint64_t middle = low + (high - low) / 2;
+            if (feasible(recipe, middle, chain, have, position, need, crafts)) {
+                low = middle;
+                steps = crafts;
+            } else {
+                high = middle;
+            }
+        }
+        return low;
+    }
+
+    // Runs a plan: takes the ingredients of each step from the player and adds
+    // the outputs, one stack update per ingredient and output.
+    uint64_t craft(Character& player, uint32_t recipe, uint64_t wanted) const {
+        vector<CraftStep> steps;
+        uint64_t crafted = plan(player, recipe, wanted, steps);
+        for (const auto& step : steps) {
+            const Recipe& current = recipes[step.recipe];
+            for (const auto& ingredient : current.ingredients) {
+                player.takeItems(content.item(ingredient.prototype).record.nameId, step.times * ingredient.count);
+            }
+            player.addItem(content.item(current.output).record, step.times * current.outputCount);
+        }
+        return crafted;
+    }
+};
+
+void addDefaultRecipes(CraftingSystem& crafting) {
+    crafting.addRecipe("iron_ingot", 1, { { "iron_ore", 3 } });
+    crafting.addRecipe("sword_hilt", 1, { { "wood", 1 }, { "leather_scrap", 1 } });
+    crafting.addRecipe("iron_sword", 1, { { "iron_ingot", 2 }, { "sword_hilt", 1 } });
+    crafting.addRecipe("studded_armor", 1, { { "leather_armor", 1 }, { "iron_ingot", 1 }, { "leather_scrap", 2 } });
+}
+
+// Structure-of-Arrays Enemy Store
+// Large hordes keep their hot fields in parallel arrays with one alive bit per
+// enemy, so an area-of-effect hit is a single linear pass over health[].
+class EnemyStore {
+public:
+    vector<int32_t> health;
+    vector<int32_t> attackPower;
+    vector<uint32_t> nameId;
+    vector<uint64_t> alive;
+
+    size_t size() const {
+        return health.size();
+    }
+
+    void add(uint32_t name, int32_t hitPoints, int32_t attack) {
+        size_t index = size();
+        health.push_back(hitPoints);
+        attackPower.push_back(attack);
+        nameId.push_back(name);
+        if (alive.size() * 64 <= index) {
+            alive.push_back(0);
+        }
+        if (hitPoints > 0) {
+            alive[index >> 6] |= 1ULL << (index & 63);
+        }
+    }
+
+    void add(const Enemy& enemy) {
+        add(nameTable().intern(enemy.getName()), enemy.getHealth(), enemy.getAttackPower());
+    }
+
+    bool isAlive(size_t index) const {
+        return (alive[index >> 6] >> (index & 63)) & 1;
+    }
+
+    size_t aliveCount() const {
+        size_t count = 0;
+        for (uint64_t word : alive) {
+            count += __builtin_popcountll(word);
+        }
+        return count;
+    }
+
+    // The first living enemy, which is marked dead here so the caller can take it
+    // over as an Enemy of its own; SIZE_MAX if none is left.
+    size_t takeFirstAlive() {
+        for (size_t word = 0; word < alive.size(); ++word) {
+            if (alive[word] != 0) {
+                size_t index = word * 64 + __builtin_ctzll(alive[word]);
+                alive[word] &= alive[word] - 1;
+                return index;
+            }
+        }
+        return SIZE_MAX;
+    }
+
+    // Subtracts damage from every enemy (clamped at zero) and refreshes the alive
+    // bits. Returns how many enemies this wave killed, and appends their name IDs
+    // to defeated if given.
+    size_t applyDamageWave(int damage, vector<uint32_t>* defeated = nullptr) {
+        vector<uint64_t> wasAlive;
+        if (defeated) wasAlive = alive;
+        size_t before = aliveCount();
+        size_t count = size();
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256i wave = _mm256_set1_epi32(damage);
+        const __m256i zero = _mm256_setzero_si256();
+        for (; i + 8 <= count; i += 8) {
+            __m256i h = _mm256_loadu_si256((const __m256i*)&health[i]);
+            h = _mm256_max_epi32(_mm256_sub_epi32(h, wave), zero);
+            _mm256_storeu_si256((__m256i*)&health[i], h);
+            uint64_t bits = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(h, zero)));
+            setAliveBits(i, bits, 0xFF);
+        }
+#elif defined(__SSE2__)
+        const __m128i wave = _mm_set1_epi32(damage);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 4 <= count; i += 4) {
+            __m128i h = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&health[i]), wave);
+            __m128i positive = _mm_cmpgt_epi32(h, zero);
+            h = _mm_and_si128(h, positive);
+            _mm_storeu_si128((__m128i*)&health[i], h);
+            setAliveBits(i, (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(positive)), 0xF);
+        }
+#endif
+        for (; i < count; ++i) {
+            health[i] = max(0, health[i] - damage);
+            setAliveBits(i, health[i] > 0 ? 1 : 0, 1);
+        }
+        if (defeated) {
+            for (size_t word = 0; word < alive.size(); ++word) {
+                for (uint64_t bits = wasAlive[word] & ~alive[word]; bits != 0; bits &= bits - 1) {
+                    defeated->push_back(nameId[word * 64 + __builtin_ctzll(bits)]);
+                }
+            }
+        }
+        return before - aliveCount();
+    }
+
+    // Moves the survivors to the front, keeping their order, and drops the rest.
+    void compact() {
+        size_t kept = 0;
+        for (size_t word = 0; word < alive.size(); ++word) {
+            for (uint64_t bits = alive[word]; bits != 0; bits &= bits - 1) {
+                size_t index = word * 64 + __builtin_ctzll(bits);
+                health[kept] = health[index];
+                attackPower[kept] = attackPower[index];
+                nameId[kept] = nameId[index];
+                kept++;
+            }
+        }
+        health.resize(kept);
+        attackPower.resize(kept);
+        nameId.resize(kept);
+        alive.assign((kept + 63) / 64, ~0ULL);
+        if (kept & 63) {
+            alive.back() = (1ULL << (kept & 63)) - 1;
+        }
+    }
+
+private:
+    void setAliveBits(size_t index, uint64_t bits, uint64_t mask) {
+        uint64_t& word = alive[index >> 6];
+        int shift = index & 63;
+        word = (word & ~(mask << shift)) | (bits << shift);
+    }
+};
+
+// World Templates
+// The starting map is built once and shared read-only by every game that plays
+// it. A Location made from a template points at its LocationTemplate and keeps
+// only what its own game changed: the indices of template entries it has taken
+// over (an enemy fought, a quest completed, an item picked up) and whatever it
+// added itself. Template entries are read in place until they are taken.
+struct TemplateEnemy {
+    string name;
+    int health;
+    int attackPower;
+};
+
+// Kept by name rather than as an ItemRecord, since games with their own name
+// tables share the template; record() interns the name into the current one.
+struct TemplateItem {
+    string name;
+    ItemType type;
+    Rarity rarity;
+    int32_t value;
+    int32_t stat;
+
+    ItemRecord record() const {
+        ItemRecord made;
+        made.type = type;
+        made.rarity = rarity;
+        made.value = value;
+        made.nameId = nameTable().intern(name);
+        made.stat = stat;
+        return made;
+    }
+};
+
+// Many copies of one enemy, kept in the location's EnemyStore once taken over.
+struct TemplateHorde {
+    TemplateEnemy kind;
+    uint32_t count;
+};
+
+struct LocationTemplate {
+    string name;
+    float x, y;
+    vector<TemplateEnemy> enemies;
+    vector<Quest> quests;
+    vector<TemplateItem> items;
+    vector<TemplateHorde> hordes;
+};
+
+struct TemplateEdge {
+    uint32_t from, to;
+    float cost;
+};
+
+class WorldTemplate {
+public:
+    vector<LocationTemplate> locations;
+    vector<TemplateEdge> edges;
+    uint32_t start;
+
+    WorldTemplate() : start(0) {}
+
+    uint32_t addLocation(const string& name, float x, float y) {
+        locations.push_back({ name, x, y, {}, {}, {}, {} });
+        return (uint32_t)locations.size() - 1;
+    }
+
+    // The add functions skip content keys the pack doesn't define, with a message.
+    void addEnemy(uint32_t location, const ContentPack& content, const string& key) {
+        uint32_t index = content.findEnemy(key);
+        if (index == UINT32_MAX) {
+            screen() << "Unknown enemy: " << key << "\n";
+            return;
+        }
+        const EnemyPrototype& prototype = content.enemy(index);
+        locations[location].enemies.push_back({ nameTable().get(prototype.nameId), prototype.health, prototype.attack });
+    }
+
+    void addHorde(uint32_t location, const ContentPack& content, const string& key, uint32_t count) {
+        uint32_t index = content.findEnemy(key);
+        if (index == UINT32_MAX) {
+            screen() << "Unknown enemy: " << key << "\n";
+            return;
+        }
+        const EnemyPrototype& prototype = content.enemy(index);
+        locations[location].hordes.push_back({ { nameTable().get(prototype.nameId), prototype.health, prototype.attack }, count });
+    }
+
+    void addQuest(uint32_t location, const ContentPack& content, const string& key) {
+        uint32_t index = content.findQuest(key);
+        if (index == UINT32_MAX) {
+            screen() << "Unknown quest: " << key << "\n";
+            return;
+        }
+        locations[location].quests.push_back(content.makeQuest(index));
+    }
+
+    void addItem(uint32_t location, const ContentPack& content, const string& key) {
+        uint32_t index = content.findItem(key);
+        if (index == UINT32_MAX) {
+            screen() << "Unknown item: " << key << "\n";
+            return;
+        }
+        const ItemRecord& record = content.item(index).record;
+        locations[location].items.push_back({ nameTable().get(record.nameId), record.type, record.rarity, record.value, record.stat });
+    }
+
+    // The first content key standard() needs that content doesn't define, or "".
+    static string missingKey(const ContentPack& content) {
+        for (const char* key : { "healing_potion", "sword" }) {
+            if (content.findItem(key) == UINT32_MAX) return key;
+        }
+        for (const char* key : { "troll", "skeleton", "goblin" }) {
+            if (content.findEnemy(key) == UINT32_MAX) return key;
+        }
+        for (const char* key : { "town_elder", "dungeon_troll" }) {
+            if (content.findQuest(key) == UINT32_MAX) return key;
+        }
+        return "";
+    }
+
+    void addEdge(uint32_t from, uint32_t to, float cost) {
+        edges.push_back({ from, to, cost });
+    }
+
+    // Town, Dungeon and Forest. Built from the first content pack that asks and shared by
+    // every game in the process after that; the template holds no name IDs, so
+    // games with their own name tables can share it.
+    static shared_ptr<const WorldTemplate> standard(const ContentPack& content) {
+        static const shared_ptr<const WorldTemplate> shared = [&content]() {
+            shared_ptr<WorldTemplate> map = make_shared<WorldTemplate>();
+            uint32_t town = map->addLocation("Town", 0, 0);
+            uint32_t dungeon = map->addLocation("Dungeon", 10, 0);
+            uint32_t forest = map->addLocation("Forest", 0, 10);
+            map->addQuest(town, content, "town_elder");
+            map->addQuest(dungeon, content, "dungeon_troll");
+            map->addItem(town, content, "healing_potion");
+            map->addItem(dungeon, content, "sword");
+            map->addEnemy(dungeon, content, "troll");
+            map->addHorde(dungeon, content, "skeleton", 40);
+            for (int i = 0; i < 3; ++i) {
+                map->addEnemy(forest, content, "goblin");
+            }
+            map->addEdge(town, dungeon, 10);
+            map->addEdge(town, forest, 10);
+            map->start = town;
+            return shared_ptr<const WorldTemplate>(map);
+        }();
+        return shared;
+    }
+};
+
+// content.pak if it loads and defines everything the starting map needs,
+// otherwise the built-in content. The pack holds IDs from the current
+// nameTable(), so the games that share it must share that name table too.
+shared_ptr<const ContentPack> loadContentPack() {
+    shared_ptr<ContentPack> content = make_shared<ContentPack>();
+    bool loaded = content->loadFile("content.pak");
+    string missing = loaded ? WorldTemplate::missingKey(*content) : "";
+    if (!missing.empty()) {
+        screen() << "content.pak has no " << missing << "; using the built-in content.\n";
+        content = make_shared<ContentPack>();
+        loaded = false;
+    }
+    if (!loaded) {
+        content->loadText(DEFAULT_CONTENT);
+    }
+    return content;
+}
+
+// Location / Map Class
+class Location {
+public:
+    string name;
+    vector<Enemy> enemies;
+    vector<Quest> quests;
+    vector<ItemRecord> items;
+    EnemyStore horde;
+    bool dirty;
+
+    // Shared starting contents, or nullptr. The vectors above then hold only what
+    // this game added, and these list the template entries it has taken over.
+    const LocationTemplate* base;
+    vector<uint16_t> takenEnemies;
+    vector<uint16_t> takenQuests;
+    vector<uint16_t> takenItems;
+    bool hordeTaken;
+
+    static bool taken(const vector<uint16_t>& indices, size_t index) {
+        return std::find(indices.begin(), indices.end(), (uint16_t)index) != indices.end();
+    }
+
+    Location(string name) : name(name), dirty(true), base(nullptr), hordeTaken(true) {}
+
+    Location(const LocationTemplate& place) : name(place.name), dirty(true), base(&place), hordeTaken(false) {}
+
+    // visit(name, health, attackPower) for every enemy here, template ones first.
+    template <typename Visit>
+    void forEachEnemy(Visit visit) const {
+        if (base) {
+            for (size_t i = 0; i < base->enemies.size(); ++i) {
+                if (!taken(takenEnemies, i)) visit(base->enemies[i].name, base->enemies[i].health, base->enemies[i].attackPower);
+            }
+        }
+        for (const auto& enemy : enemies) {
+            visit(enemy.getName(), enemy.getHealth(), enemy.getAttackPower());
+        }
+    }
+
+    // visit(name, health, attackPower) for every living horde member here.
+    template <typename Visit>
+    void forEachHordeMember(Visit visit) const {
+        if (!hordeTaken) {
+            for (const auto& group : base->hordes) {
+                for (uint32_t i = 0; i < group.count; ++i) {
+                    visit(group.kind.name, group.kind.health, group.kind.attackPower);
+                }
+            }
+            return;
+        }
+        for (size_t i = 0; i < horde.size(); ++i) {
+            if (horde.isAlive(i)) visit(nameTable().get(horde.nameId[i]), horde.health[i], horde.attackPower[i]);
+        }
+    }
+
+    size_t hordeSize() const {
+        if (hordeTaken) return horde.aliveCount();
+        size_t count = 0;
+        for (const auto& group : base->hordes) {
+            count += group.count;
+        }
+        return count;
+    }
+
+    template <typename Visit>
+    void forEachQuest(Visit visit) const {
+        if (base) {
+            for (size_t i = 0; i < base->quests.size(); ++i) {
+                if (!taken(takenQuests, i)) visit(base->quests[i]);
+            }
+        }
+        for (const auto& quest : quests) {
+            visit(quest);
+        }
+    }
+
+    // visit(record) for every item here, template ones first.
+    template <typename Visit>
+    void forEachItem(Visit visit) const {
+        if (base) {
+            for (size_t i = 0; i < base->items.size(); ++i) {
+                if (!taken(takenItems, i)) visit(base->items[i].record());
+            }
+        }
+        for (const auto& record : items) {
+            visit(record);
+        }
+    }
+
+    size_t enemyCount() const { return enemies.size() + (base ? base->enemies.size() - takenEnemies.size() : 0); }
+    size_t questCount() const { return quests.size() + (base ? base->quests.size() - takenQuests.size() : 0); }
+    size_t itemCount() const { return items.size() + (base ? base->items.size() - takenItems.size() : 0); }
+
+    // Copies template enemies into this location so they can be fought.
+    void takeTemplateEnemies() {
+        if (!base) return;
+        for (size_t i = 0; i < base->enemies.size(); ++i) {
+            if (taken(takenEnemies, i)) continue;
+            const TemplateEnemy& enemy = base->enemies[i];
+            enemies.push_back(Enemy(enemy.name, enemy.health, enemy.attackPower));
+            takenEnemies.push_back((uint16_t)i);
+            dirty = true;
+        }
+    }
+
+    // Fills the horde store from the template's hordes.
+    void takeTemplateHorde() {
+        if (hordeTaken) return;
+        for (const auto& group : base->hordes) {
+            uint32_t nameId = nameTable().intern(group.kind.name);
+            for (uint32_t i = 0; i < group.count; ++i) {
+                horde.add(nameId, group.kind.health, group.kind.attackPower);
+            }
+        }
+        hordeTaken = true;
+        dirty = true;
+    }
+
+    // The first living enemy here, or nullptr. Once the single enemies are down,
+    // horde members step out of the store one at a time to be fought.
+    Enemy* nextEnemy() {
+        takeTemplateEnemies();
+        for (auto& enemy : enemies) {
+            if (enemy.isAlive()) return &enemy;
+        }
+        takeTemplateHorde();
+        size_t index = horde.takeFirstAlive();
+        if (index == SIZE_MAX) return nullptr;
+        enemies.push_back(Enemy(nameTable().get(horde.nameId[index]), horde.health[index], horde.attackPower[index]));
+        horde.compact();
+        dirty = true;
+        return &enemies.back();
+    }
+
+    // The quest with that title, copied out of the template first if it is there.
+    Quest* editQuest(const string& title) {
+        for (auto& quest : quests) {
+            if (quest.title == title) return &quest;
+        }
+        if (base) {
+            for (size_t i = 0; i < base->quests.size(); ++i) {
+                if (!taken(takenQuests, i) && base->quests[i].title == title) return &takeTemplateQuest(i);
+            }
+        }
+        return nullptr;
+    }
+
+    // Copies a template quest into this location (to be changed), by template index.
+    Quest& takeTemplateQuest(size_t index) {
+        quests.push_back(base->quests[index]);
+        takenQuests.push_back((uint16_t)index);
+        dirty = true;
+        return quests.back();
+    }
+
+    void addEnemy(Enemy enemy) {
+        enemies.push_back(enemy);
+        dirty = true;
+    }
+
+    void addHorde(const Enemy& prototype, int count) {
+        for (int i = 0; i < count; ++i) {
+            horde.add(prototype);
+        }
+        dirty = true;
+    }
+
+    // Hits every enemy here at once (e.g. Fireball): the horde in one pass over
+    // the store, then the single enemies. Appends the name ID of each enemy
+    // defeated and returns how many that was.
+    int applyAreaDamage(int damage, vector<uint32_t>& defeated) {
+        takeTemplateEnemies();
+        takeTemplateHorde();
+        int count = (int)horde.applyDamageWave(damage, &defeated);
+        horde.compact();
+        dirty = true;
+        for (auto& enemy : enemies) {
+            if (!enemy.isAlive()) continue;
+            enemy.takeDamage(damage);
+            if (!enemy.isAlive()) {
+                defeated.push_back(nameTable().intern(enemy.getName()));
+                count++;
+            }
+        }
+        return count;
+    }
+
+    void addItem(const ItemRecord& record) {
+        items.push_back(record);
+        dirty = true;
+    }
+
+    void addQuest(Quest quest) {
+        quests.push_back(quest);
+        dirty = true;
+    }
+
+    bool hasChanges() const {
+        if (dirty) return true;
+        for (const auto& quest : quests) {
+            if (quest.dirty) return true;
+        }
+        return false;
+    }
+
+    void markClean() {
+        dirty = false;
+        for (auto& quest : quests) {
+            quest.dirty = false;
+        }
+    }
+
+    void display() const {
+        if (screen().quiet()) return;
+        screen() << "Location: " << name << "\n";
+        if (size_t lurking = hordeSize()) {
+            screen() << "A horde of " << lurking << " enemies lurks here.\n";
+        }
+        screen() << "Items here:\n";
+        forEachItem([](const ItemRecord& record) {
+            displayItem(record);
+        });
+    }
+};
+
+// Spatial Grid
+// Buckets location IDs by square cell for "what is near this point" queries.
+class SpatialGrid {
+private:
+    float cellSize;
+    unordered_map<uint64_t, vector<uint32_t>> cells;
+
+    static uint64_t key(int cellX, int cellY) {
+        return ((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY;
+    }
+
+public:
+    SpatialGrid(float cellSize) : cellSize(cellSize) {}
+
+    void insert(uint32_t id, float x, float y) {
+        cells[key((int)floor(x / cellSize), (int)floor(y / cellSize))].push_back(id);
+    }
+
+    // Calls visit(id) for every ID in the cells overlapping the square around (x, y).
+    template <typename Visit>
+    void query(float x, float y, float radius, Visit visit) const {
+        int minX = (int)floor((x - radius) / cellSize), maxX = (int)floor((x + radius) / cellSize);
+        int minY = (int)floor((y - radius) / cellSize), maxY = (int)floor((y + radius) / cellSize);
+        for (int cellX = minX; cellX <= maxX; ++cellX) {
+            for (int cellY = minY; cellY <= maxY; ++cellY) {
+                auto found = cells.find(key(cellX, cellY));
+                if (found == cells.end()) continue;
+                for (uint32_t id : found->second) {
+                    visit(id);
+                }
+            }
+        }
+    }
+};
+
+// Supplies the contents of chunks that are not in memory. load() fills one
+// Location per ID, in order; store() receives a modified chunk being evicted,
+// or a single location restored from a save into a streamed-out chunk, and must
+// copy what it keeps, since the World drops those locations afterwards.
+class ChunkSource {
+public:
+    virtual void load(uint32_t chunk, const vector<uint32_t>& ids, vector<Location>& out) = 0;
+    virtual void store(uint32_t chunk, const vector<uint32_t>& ids, const vector<Location>& locations) = 0;
+    virtual ~ChunkSource() = default;
+};
+
+// World Class
+// Every location has a resident node (position, chunk, edges). Location contents
+// live in square chunks; without a ChunkSource all chunks stay resident, with one
+// they are streamed in around the focus point and evicted beyond it.
+struct LocationNode {
+    float x, y;
+    uint32_t chunk;
+    uint32_t slot;  // index inside the chunk
+};
+
+struct LocationEdge {
+    uint32_t to;
+    float cost;
+};
+
+struct WorldChunk {
+    int cellX, cellY;
+    vector<uint32_t> ids;
+    vector<Location> locations;  // parallel to ids while resident
+    bool resident;
+    bool modified;
+    uint64_t lastUsed;
+};
+
+class World {
+private:
+    vector<LocationNode> nodes;
+    vector<WorldChunk> chunks;
+    unordered_map<uint64_t, uint32_t> chunkByCell;
+    SpatialGrid grid;
+    ChunkSource* source;
+    float chunkSize;
+    int streamRadius;
+    size_t residentLimit;
+    size_t residentCount;
+    uint64_t clock;
+    vector<uint32_t> edgeChanges;  // chunk of every edge endpoint touched, in order
+    float minCostPerDistance;
+
+    void noteEdge(uint32_t from, uint32_t to, float cost) {
+        float dx = nodes[from].x - nodes[to].x, dy = nodes[from].y - nodes[to].y;
+        float distance = sqrt(dx * dx + dy * dy);
+        if (distance > 0) {
+            minCostPerDistance = min(minCostPerDistance, cost / distance);
+        }
+        edgeChanges.push_back(nodes[from].chunk);
+        edgeChanges.push_back(nodes[to].chunk);
+    }
+
+    uint32_t chunkAt(float x, float y) {
+        int cellX = (int)floor(x / chunkSize), cellY = (int)floor(y / chunkSize);
+        uint64_t cell = ((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY;
+        auto found = chunkByCell.find(cell);
+        if (found != chunkByCell.end()) {
+            return found->second;
+        }
+        chunks.push_back({ cellX, cellY, {}, {}, source == nullptr, false, 0 });
+        if (source == nullptr) residentCount++;
+        chunkByCell.emplace(cell, (uint32_t)chunks.size() - 1);
+        return (uint32_t)chunks.size() - 1;
+    }
+
+    uint32_t addNode(float x, float y) {
+        uint32_t id = (uint32_t)nodes.size();
+        uint32_t chunk = chunkAt(x, y);
+        nodes.push_back({ x, y, chunk, (uint32_t)chunks[chunk].ids.size() });
+        edges.emplace_back();
+        grid.insert(id, x, y);
+        chunks[chunk].ids.push_back(id);
+        return id;
+    }
+
+    void makeResident(uint32_t index) {
+        WorldChunk& chunk = chunks[index];
+        chunk.lastUsed = ++clock;
+        if (chunk.resident) {
+            return;
+        }
+        chunk.locations.reserve(chunk.ids.size());
+        source->load(index, chunk.ids, chunk.locations);
+        chunk.resident = true;
+        chunk.modified = false;
+        residentCount++;
+    }
+
+    void evict(uint32_t index) {
+        WorldChunk& chunk = chunks[index];
+        if (!chunk.resident || source == nullptr) {
+            return;
+        }
+        if (chunk.modified) {
+            source->store(index, chunk.ids, chunk.locations);
+        }
+        vector<Location>().swap(chunk.locations);
+        chunk.resident = false;
+        residentCount--;
+    }
+
+public:
+    vector<vector<LocationEdge>> edges;
+    TimeOfDay timeOfDay;
+    bool dirty;
+    EventBus* events = nullptr;         // told when the time of day changes
+
+    World(float chunkSize = 64.0f)
+        : grid(chunkSize / 4), source(nullptr), chunkSize(chunkSize), streamRadius(1), residentLimit(64),
+          residentCount(0), clock(0), minCostPerDistance(INFINITY), timeOfDay(TimeOfDay::DAY), dirty(true) {}
+
+    // Switches to streaming: chunks outside the focus area are evicted to source.
+    void setChunkSource(ChunkSource* chunkSource, int radius = 1, size_t maxResidentChunks = 64) {
+        source = chunkSource;
+        streamRadius = radius;
+        residentLimit = maxResidentChunks;
+    }
+
+    size_t locationCount() const {
+        return nodes.size();
+    }
+
+    size_t residentChunks() const {
+        return residentCount;
+    }
+
+    const LocationNode& node(uint32_t id) const {
+        return nodes[id];
+    }
+
+    // Registers a location whose contents come from the chunk source. If its
+    // chunk is already resident, the source fills it in right away.
+    uint32_t addLocationNode(float x, float y) {
+        uint32_t id = addNode(x, y);
+        WorldChunk& chunk = chunks[nodes[id].chunk];
+        if (chunk.resident) {
+            if (source) {
+                source->load(nodes[id].chunk, { id }, chunk.locations);
+            } else {
+                chunk.locations.push_back(Location(""));
+            }
+        }
+        return id;
+    }
+
+    uint32_t addLocation(Location loc, float x = 0, float y = 0) {
+        uint32_t chunk = chunkAt(x, y);
+        if (source) {
+            makeResident(chunk);
+        }
+        uint32_t id = addNode(x, y);
+        chunks[chunk].locations.push_back(loc);
+        chunks[chunk].modified = true;
+        return id;
+    }
+
+    void addEdge(uint32_t from, uint32_t to, float cost) {
+        edges[from].push_back({ to, cost });
+        edges[to].push_back({ from, cost });
+        noteEdge(from, to, cost);
+    }
+
+    // Changes the cost of an existing two-way edge; INFINITY closes it.
+    void setEdgeCost(uint32_t from, uint32_t to, float cost) {
+        for (auto& edge : edges[from]) {
+            if (edge.to == to) edge.cost = cost;
+        }
+        for (auto& edge : edges[to]) {
+            if (edge.to == from) edge.cost = cost;
+        }
+        noteEdge(from, to, cost);
+    }
+
+    // Lower bound on edge cost per unit of distance, for admissible A* heuristics.
+    float costPerDistance() const {
+        return isinf(minCostPerDistance) ? 0.0f : minCostPerDistance;
+    }
+
+    const vector<uint32_t>& graphChanges() const {
+        return edgeChanges;
+    }
+
+    size_t chunkCount() const {
+        return chunks.size();
+    }
+
+    const WorldChunk& chunk(uint32_t index) const {
+        return chunks[index];
+    }
+
+    // Chunk index at the given chunk cell, or UINT32_MAX if there is none.
+    uint32_t chunkAtCell(int cellX, int cellY) const {
+        auto found = chunkByCell.find(((uint64_t)(uint32_t)cellX << 32) | (uint32_t)cellY);
+        return found == chunkByCell.end() ? UINT32_MAX : found->second;
+    }
+
+    float getChunkSize() const {
+        return chunkSize;
+    }
+
+    // Mutable access; streams the chunk in if needed and marks it modified.
+    Location& at(uint32_t id) {
+        uint32_t chunk = nodes[id].chunk;
+        makeResident(chunk);
+        chunks[chunk].modified = true;
+        return chunks[chunk].locations[nodes[id].slot];
+    }
+
+    // Resident contents only; nullptr if the chunk is streamed out.
+    const Location* find(uint32_t id) const {
+        const WorldChunk& chunk = chunks[nodes[id].chunk];
+        return chunk.resident ? &chunk.locations[nodes[id].slot] : nullptr;
+    }
+
+    // Replaces a location's contents by ID, adding a node if the ID is new. A
+    // location in a streamed-out chunk is handed to the source instead of
+    // streaming the chunk in.
+    void restoreLocation(uint32_t id, float x, float y, const Location& loc) {
+        while (nodes.size() <= id) {
+            addLocation(Location(""), x, y);
+        }
+        uint32_t chunk = nodes[id].chunk;
+        if (source && !chunks[chunk].resident) {
+            source->store(chunk, { id }, { loc });
+            return;
+        }
+        at(id) = loc;
+    }
+
+    template <typename Visit>
+    void forEachResident(Visit visit) {
+        for (auto& chunk : chunks) {
+            if (!chunk.resident) continue;
+            for (size_t i = 0; i < chunk.ids.size(); ++i) {
+                visit(chunk.ids[i], chunk.locations[i]);
+            }
+        }
+    }
+
+    template <typename Visit>
+    void forEachResident(Visit visit) const {
+        for (const auto& chunk : chunks) {
+            if (!chunk.resident) continue;
+            for (size_t i = 0; i < chunk.ids.size(); ++i) {
+                visit(chunk.ids[i], chunk.locations[i]);
+            }
+        }
+    }
+
+    // IDs of all locations within radius of (x, y).
+    vector<uint32_t> nearby(float x, float y, float radius) const {
+        vector<uint32_t> found;
+        grid.query(x, y, radius, [&](uint32_t id) {
+            float dx = nodes[id].x - x, dy = nodes[id].y - y;
+            if (dx * dx + dy * dy <= radius * radius) {
+                found.push_back(id);
+            }
+        });
+        return found;
+    }
+
+    // Keeps the chunks around the given location resident and evicts the least
+    // recently used chunks outside that area once over the resident limit.
+    void focus(uint32_t id) {
+        if (source == nullptr || id >= nodes.size()) {
+            return;
+        }
+        const WorldChunk& center = chunks[nodes[id].chunk];
+        int centerX = center.cellX, centerY = center.cellY;
+        for (int dx = -streamRadius; dx <= streamRadius; ++dx) {
+            for (int dy = -streamRadius; dy <= streamRadius; ++dy) {
+                uint64_t cell = ((uint64_t)(uint32_t)(centerX + dx) << 32) | (uint32_t)(centerY + dy);
+                auto found = chunkByCell.find(cell);
+                if (found != chunkByCell.end()) {
+                    makeResident(found->second);
+                }
+            }
+        }
+        while (residentCount > residentLimit) {
+            uint32_t oldest = UINT32_MAX;
+            for (uint32_t i = 0; i < chunks.size(); ++i) {
+                const WorldChunk& chunk = chunks[i];
+                bool inFocus = abs(chunk.cellX - centerX) <= streamRadius && abs(chunk.cellY - centerY) <= streamRadius;
+                if (chunk.resident && !inFocus && (oldest == UINT32_MAX || chunk.lastUsed < chunks[oldest].lastUsed)) {
+                    oldest = i;
+                }
+            }
+            if (oldest == UINT32_MAX) break;
+            evict(oldest);
+        }
+    }
+
+    void cycleTime() {
+        if (timeOfDay == TimeOfDay::DAY) {
+            timeOfDay = TimeOfDay::NIGHT;
+        } else {
+            timeOfDay = TimeOfDay::DAY;
+        }
+        dirty = true;
+        if (events) {
+            events->post(TimeOfDayChanged{ timeOfDay });
+        }
+    }
+
+    void showMap() const {
+        if (screen().quiet()) return;
+        screen() << "World Map:\n";
+        forEachResident([](uint32_t, const Location& location) {
+            location.display();
+        });
+    }
+
+    void interactWithLocation(int index) {
+        if (index < 0 || index >= (int)nodes.size()) {
+            screen() << "Invalid location.\n";
+            return;
+        }
+        Location& location = at(index);
+        screen() << "You are at " << location.name << "!\n";
+        location.forEachQuest([](const Quest& quest) {
+            quest.display();
+        });
+    }
+};
+
+// Pathfinding Service
+// A* over the location graph with a binary heap. Per-node scratch arrays are
+// stamped per query instead of cleared, so a short query on a huge world only
+// touches the nodes it expands. Long routes go through one hub per chunk:
+// the hub-level search runs over neighbouring chunks only, and each hub-to-hub
+// segment is searched inside its two chunks, so it depends on their edges alone
+// and stays cached until an edge in either chunk changes.
+class PathService {
+private:
+    struct Segment {
+        vector<uint32_t> path;
+        float cost;
+    };
+
+    const World& world;
+    vector<float> cost;
+    vector<uint32_t> parent;
+    vector<uint32_t> visitStamp;
+    vector<uint32_t> closedStamp;
+    uint32_t stamp;
+    size_t changesSeen;
+    vector<uint32_t> hubs;  // per chunk, UINT32_MAX until chosen
+    vector<float> hubCost;  // hub-level scratch, per chunk, stamped like the above
+    vector<uint32_t> hubParent;
+    vector<uint32_t> hubVisitStamp;
+    vector<uint32_t> hubClosedStamp;
+    uint32_t hubStamp;
+    unordered_map<uint64_t, Segment> segments;
+    unordered_map<uint32_t, vector<uint64_t>> segmentsByChunk;
+
+    static uint64_t pairKey(uint32_t a, uint32_t b) {
+        return ((uint64_t)a << 32) | b;
+    }
+
+    float heuristic(uint32_t from, uint32_t to) const {
+        const LocationNode& a = world.node(from);
+        const LocationNode& b = world.node(to);
+        float dx = a.x - b.x, dy = a.y - b.y;
+        return sqrt(dx * dx + dy * dy) * world.costPerDistance();
+    }
+
+    // Drops cached segments of chunks whose edges changed since last time.
+    void sync() {
+        size_t count = world.locationCount();
+        if (cost.size() < count) {
+            cost.resize(count);
+            parent.resize(count);
+            visitStamp.resize(count, 0);
+            closedStamp.resize(count, 0);
+        }
+        if (hubs.size() < world.chunkCount()) {
+            hubs.resize(world.chunkCount(), UINT32_MAX);
+            hubCost.resize(world.chunkCount());
+            hubParent.resize(world.chunkCount());
+            hubVisitStamp.resize(world.chunkCount(), 0);
+            hubClosedStamp.resize(world.chunkCount(), 0);
+        }
+        const vector<uint32_t>& changes = world.graphChanges();
+        for (; changesSeen < changes.size(); ++changesSeen) {
+            auto found = segmentsByChunk.find(changes[changesSeen]);
+            if (found == segmentsByChunk.end()) continue;
+            for (uint64_t key : found->second) {
+                segments.erase(key);
+            }
+            segmentsByChunk.erase(found);
+        }
+    }
+
+    uint32_t hubOf(uint32_t chunkIndex) {
+        if (hubs[chunkIndex] == UINT32_MAX) {
+            const WorldChunk& chunk = world.chunk(chunkIndex);
+            float size = world.getChunkSize();
+            float centerX = (chunk.cellX + 0.5f) * size, centerY = (chunk.cellY + 0.5f) * size;
+            float best = INFINITY;
+            for (uint32_t id : chunk.ids) {
+                float dx = world.node(id).x - centerX, dy = world.node(id).y - centerY;
+                if (dx * dx + dy * dy < best && !world.edges[id].empty()) {
+                    best = dx * dx + dy * dy;
+                    hubs[chunkIndex] = id;
+                }
+            }
+        }
+        return hubs[chunkIndex];
+    }
+
+    const Segment* segment(uint32_t fromHub, uint32_t toHub) {
+        uint64_t key = pairKey(fromHub, toHub);
+        auto found = segments.find(key);
+        if (found == segments.end()) {
+            Segment result;
+            uint32_t fromChunk = world.node(fromHub).chunk, toChunk = world.node(toHub).chunk;
+            if (!search(fromHub, toHub, result.path, result.cost, fromChunk, toChunk)) {
+                result.cost = INFINITY;
+                result.path.clear();
+            }
+            found = segments.emplace(key, move(result)).first;
+            segmentsByChunk[fromChunk].push_back(key);
+            segmentsByChunk[toChunk].push_back(key);
+        }
+        return isinf(found->second.cost) ? nullptr : &found->second;
+    }
+
+    // A* from one node to another; with chunk arguments, only nodes in those
+    // two chunks are expanded.
+    bool search(uint32_t from, uint32_t to, vector<uint32_t>& path, float& total,
+                uint32_t chunkA = UINT32_MAX, uint32_t chunkB = UINT32_MAX) {
+        typedef pair<float, uint32_t> Entry;
+        priority_queue<Entry, vector<Entry>, greater<Entry>> open;
+        if (++stamp == 0) {
+            fill(visitStamp.begin(), visitStamp.end(), 0);
+            fill(closedStamp.begin(), closedStamp.end(), 0);
+            stamp = 1;
+        }
+        cost[from] = 0;
+        parent[from] = from;
+        visitStamp[from] = stamp;
+        open.push({ heuristic(from, to), from });
+        while (!open.empty()) {
+            uint32_t current = open.top().second;
+            open.pop();
+            if (closedStamp[current] == stamp) continue;
+            closedStamp[current] = stamp;
+            if (current == to) {
+                path.clear();
+                for (uint32_t step = to; step != from; step = parent[step]) {
+                    path.push_back(step);
+                }
+                path.push_back(from);
+                reverse(path.begin(), path.end());
+                total = cost[to];
+                return true;
+            }
+            for (const auto& edge : world.edges[current]) {
+                float next = cost[current] + edge.cost;
+                if (isinf(edge.cost) || (visitStamp[edge.to] == stamp && next >= cost[edge.to])) continue;
+                if (chunkA != UINT32_MAX && world.node(edge.to).chunk != chunkA && world.node(edge.to).chunk != chunkB) continue;
+                visitStamp[edge.to] = stamp;
+                cost[edge.to] = next;
+                parent[edge.to] = current;
+                open.push({ next + heuristic(edge.to, to), edge.to });
+            }
+        }
+        return false;
+    }
+
+    static void append(vector<uint32_t>& path, const vector<uint32_t>& part) {
+        size_t skip = (!path.empty() && !part.empty() && path.back() == part.front()) ? 1 : 0;
+        path.insert(path.end(), part.begin() + skip, part.end());
+    }
+
+public:
+    PathService(const World& world) : world(world), stamp(0), changesSeen(0), hubStamp(0) {}
+
+    // Exact shortest path.
+    bool findPath(uint32_t from, uint32_t to, vector<uint32_t>& path, float* total = nullptr) {
+        sync();
+        float found;
+        if (!search(from, to, path, found)) {
+            return false;
+        }
+        if (total) *total = found;
+        return true;
+    }
+
+    // Route for travel and NPC movement. Nearby targets use exact A*; distant ones
+    // are stitched from local legs and cached hub-to-hub segments, with exact A*
+    // again if the hubs don't connect (a road that leaves the two chunks).
+    bool route(uint32_t from, uint32_t to, vector<uint32_t>& path, float* total = nullptr) {
+        sync();
+        const WorldChunk& start = world.chunk(world.node(from).chunk);
+        const WorldChunk& goal = world.chunk(world.node(to).chunk);
+        if (abs(start.cellX - goal.cellX) <= 1 && abs(start.cellY - goal.cellY) <= 1) {
+            return findPath(from, to, path, total);
+        }
+        uint32_t startChunk = world.node(from).chunk, goalChunk = world.node(to).chunk;
+        uint32_t startHub = hubOf(startChunk), goalHub = hubOf(goalChunk);
+        if (startHub == UINT32_MAX || goalHub == UINT32_MAX) {
+            return findPath(from, to, path, total);
+        }
+
+        // Hub-level A*: each chunk links to the hubs of its 8 neighbouring chunks.
+        typedef pair<float, uint32_t> Entry;
+        priority_queue<Entry, vector<Entry>, greater<Entry>> open;
+        if (++hubStamp == 0) {
+            fill(hubVisitStamp.begin(), hubVisitStamp.end(), 0);
+            fill(hubClosedStamp.begin(), hubClosedStamp.end(), 0);
+            hubStamp = 1;
+        }
+        hubCost[startChunk] = 0;
+        hubParent[startChunk] = startChunk;
+        hubVisitStamp[startChunk] = hubStamp;
+        open.push({ heuristic(startHub, goalHub), startChunk });
+        bool reached = false;
+        while (!open.empty()) {
+            uint32_t current = open.top().second;
+            open.pop();
+            if (hubClosedStamp[current] == hubStamp) continue;
+            hubClosedStamp[current] = hubStamp;
+            if (current == goalChunk) {
+                reached = true;
+                break;
+            }
+            const WorldChunk& chunk = world.chunk(current);
+            for (int dx = -1; dx <= 1; ++dx) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    uint32_t neighbour = world.chunkAtCell(chunk.cellX + dx, chunk.cellY + dy);
+                    if ((dx == 0 && dy == 0) || neighbour == UINT32_MAX || hubClosedStamp[neighbour] == hubStamp) continue;
+                    if (hubOf(neighbour) == UINT32_MAX) continue;
+                    const Segment* leg = segment(hubOf(current), hubOf(neighbour));
+                    if (!leg) continue;
+                    float next = hubCost[current] + leg->cost;
+                    if (hubVisitStamp[neighbour] == hubStamp && next >= hubCost[neighbour]) continue;
+                    hubVisitStamp[neighbour] = hubStamp;
+                    hubCost[neighbour] = next;
+                    hubParent[neighbour] = current;
+                    open.push({ next + heuristic(hubOf(neighbour), goalHub), neighbour });
+                }
+            }
+        }
+        if (!reached) {
+            return findPath(from, to, path, total);
+        }
+
+        vector<uint32_t> chunkPath;
+        for (uint32_t step = goalChunk; step != startChunk; step = hubParent[step]) {
+            chunkPath.push_back(step);
+        }
+        chunkPath.push_back(startChunk);
+        reverse(chunkPath.begin(), chunkPath.end());
+
+        vector<uint32_t> leg;
+        float legCost = 0, sum = 0;
+        path.clear();
+        if (!search(from, startHub, leg, legCost)) return findPath(from, to, path, total);
+        append(path, leg);
+        sum += legCost;
+        for (size_t i = 1; i < chunkPath.size(); ++i) {
+            const Segment* hop = segment(hubOf(chunkPath[i - 1]), hubOf(chunkPath[i]));
+            append(path, hop->path);
+            sum += hop->cost;
+        }
+        if (!search(goalHub, to, leg, legCost)) return findPath(from, to, path, total);
+        append(path, leg);
+        sum += legCost;
+        if (total) *total = sum;
+        return true;
+    }
+};
+
+// Binary Save Format
+// A save file is a header with a section table followed by 8-byte aligned arrays
+// of fixed-size records. Strings live in one blob and are referenced by offset,
+// so a mapped file can be read in place without any parsing.
+const char SAVE_MAGIC[4] = { 'R', 'P', 'G', 'S' };
+const uint32_t SAVE_VERSION = 3;
+
+enum SaveSectionId : uint32_t {
+    SECTION_STRINGS,
+    SECTION_CHARACTER,
+    SECTION_ITEMS,
+    SECTION_SKILLS,
+    SECTION_QUESTS,
+    SECTION_CHOICES,
+    SECTION_ENEMIES,
+    SECTION_LOCATIONS,
+    SECTION_QUEST_STATES,
+    SECTION_QUEST_PROGRESS,
+    SECTION_COUNT
+};
+
+struct SaveSection {
+    uint32_t id;
+    uint32_t count;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SaveHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t sectionCount;
+    uint32_t sequence;  // last autosave folded into this snapshot
+    SaveSection sections[SECTION_COUNT];
+};
+
+struct SavedString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SavedCharacter {
+    SavedString name;
+    int32_t health, maxHealth, attackPower, defensePower, level, experience;
+    int32_t equippedWeapon, equippedArmor;  // index into the character's items, -1 if none
+    uint32_t firstItem, itemCount;
+    uint32_t firstSkill, skillCount;
+    int32_t timeOfDay;
+    int32_t reserved;
+};
+
+struct SavedItem {
+    SavedString name;
+    uint8_t type;
+    uint8_t rarity;
+    uint16_t reserved;
+    int32_t value;
+    int32_t stat;  // attack, defense, healing amount or skill, depending on type
+};
+
+struct SavedSkill {
+    int32_t skill;
+    int32_t level;
+};
+
+struct SavedQuest {
+    SavedString title;
+    SavedString description;
+    uint8_t type;
+    uint8_t isCompleted;
+    uint16_t reserved;
+    int32_t rewardExp;
+    uint32_t firstChoice, choiceCount;
+};
+
+struct SavedEnemy {
+    SavedString name;
+    int32_t health;
+    int32_t attackPower;
+};
+
+// A running quest in the QuestEngine, as opposed to a SavedQuest on the map.
+struct SavedQuestState {
+    SavedString title;  // of the quest definition
+    uint32_t stage;
+    uint8_t isChoosing;
+    uint8_t reserved[3];
+    uint32_t firstProgress, progressCount;  // objective counts in SECTION_QUEST_PROGRESS
+};
+
+struct SavedLocation {
+    uint32_t id;
+    float x, y;
+    SavedString name;
+    uint32_t firstEnemy, enemyCount;
+    uint32_t firstHorde, hordeCount;
+    uint32_t firstQuest, questCount;
+    uint32_t firstItem, itemCount;
+};
+
+// Builds a snapshot in memory; the caller decides when and where to write it.
+class SaveWriter {
+private:
+    string strings;
+    unordered_map<string, SavedString> stringIndex;
+    vector<SavedCharacter> characters;
+    vector<SavedItem> items;
+    vector<SavedSkill> skills;
+    vector<SavedQuest> quests;
+    vector<SavedString> choices;
+    vector<SavedEnemy> enemies;
+    vector<SavedLocation> locations;
+    vector<SavedQuestState> questStates;
+    vector<uint32_t> questProgress;
+
+    SavedString addString(const string& text) {
+        auto found = stringIndex.find(text);
+        if (found != stringIndex.end()) {
+            return found->second;
+        }
+        SavedString saved = { (uint32_t)strings.size(), (uint32_t)text.size() };
+        strings += text;
+        stringIndex.emplace(text, saved);
+        return saved;
+    }
+
+    void addItem(const ItemRecord& record) {
+        SavedItem saved = {};
+        saved.name = addString(nameTable().get(record.nameId));
+        saved.type = (uint8_t)record.type;
+        saved.rarity = (uint8_t)record.rarity;
+        saved.value = record.value;
+        saved.stat = record.stat;
+        items.push_back(saved);
+    }
+
+    void addQuest(const Quest& quest) {
+        SavedQuest saved = {};
+        saved.title = addString(quest.title);
+        saved.description = addString(quest.description);
+        saved.type = (uint8_t)quest.type;
+        saved.isCompleted = quest.isCompleted;
+        saved.rewardExp = quest.rewardExp;
+        saved.firstChoice = (uint32_t)choices.size();
+        saved.choiceCount = (uint32_t)quest.choices.size();
+        for (const auto& choice : quest.choices) {
+            choices.push_back(addString(choice));
+        }
+        quests.push_back(saved);
+    }
+
+    template <typename T>
+    static void place(vector<char>& out, SaveHeader& header, SaveSectionId id, const T* data, size_t count) {
+        out.resize((out.size() + 7) & ~(size_t)7);
+        SaveSection& section = header.sections[id];
+        section.id = id;
+        section.count = (uint32_t)count;
+        section.offset = out.size();
+        section.size = count * sizeof(T);
+        out.insert(out.end(), (const char*)data, (const char*)data + section.size);
+    }
+
+public:
+    void addCharacter(Character& player, const World& world) {
+        SavedCharacter saved = {};
+        saved.name = addString(player.getName());
+        saved.health = player.getHealth();
+        saved.maxHealth = player.getMaxHealth();
+        saved.attackPower = player.getAttackPower();
+        saved.defensePower = player.getDefensePower();
+        saved.level = player.getLevel();
+        saved.experience = player.getExperience();
+        saved.equippedWeapon = -1;
+        saved.equippedArmor = -1;
+        saved.firstItem = (uint32_t)items.size();
+        // One saved item per item; the first of a worn stack is the worn one.
+        player.getInventory().forEachStack([&](const ItemStack& stack) {
+            int32_t index = (int32_t)(items.size() - saved.firstItem);
+            if (&stack.record == player.getEquippedWeapon()) saved.equippedWeapon = index;
+            if (&stack.record == player.getEquippedArmor()) saved.equippedArmor = index;
+            for (size_t i = 0; i < stack.count; ++i) {
+                addItem(stack.record);
+            }
+        });
+        saved.itemCount = (uint32_t)(items.size() - saved.firstItem);
+        saved.firstSkill = (uint32_t)skills.size();
+        saved.skillCount = (uint32_t)player.getSkillLevels().size();
+        for (const auto& skill : player.getSkillLevels()) {
+            skills.push_back({ (int32_t)skill.first, skill.second });
+        }
+        saved.timeOfDay = (int32_t)world.timeOfDay;
+        characters.push_back(saved);
+    }
+
+    void addQuestLog(const QuestEngine& questLog) {
+        questLog.forEachActive([&](uint32_t id) {
+            SavedQuestState saved = {};
+            saved.title = addString(questLog.definition(questLog.definitionOf(id)).title);
+            saved.stage = questLog.stageOf(id);
+            saved.isChoosing = questLog.isChoosing(id);
+            saved.firstProgress = (uint32_t)questProgress.size();
+            saved.progressCount = (uint32_t)questLog.currentStage(id).objectives.size();
+            for (uint32_t i = 0; i < saved.progressCount; ++i) {
+                questProgress.push_back(questLog.progress(id, i));
+            }
+            questStates.push_back(saved);
+        });
+    }
+
+    // Resident locations only; see ProceduralChunkSource::addTo() for the rest.
+    void addWorld(const World& world) {
+        world.forEachResident([&](uint32_t id, const Location& location) {
+            addLocation(world, id, location);
+        });
+    }
+
+    void addLocation(const World& world, uint32_t id, const Location& location) {
+        addLocation(id, world.node(id).x, world.node(id).y, location);
+    }
+
+    void addLocation(uint32_t id, float x, float y, const Location& location) {
+        SavedLocation saved = {};
+        saved.id = id;
+        saved.x = x;
+        saved.y = y;
+        saved.name = addString(location.name);
+        saved.firstEnemy = (uint32_t)enemies.size();
+        saved.enemyCount = (uint32_t)location.enemyCount();
+        location.forEachEnemy([&](const string& name, int health, int attackPower) {
+            enemies.push_back({ addString(name), health, attackPower });
+        });
+        saved.firstHorde = (uint32_t)enemies.size();
+        saved.hordeCount = (uint32_t)location.hordeSize();
+        location.forEachHordeMember([&](const string& name, int health, int attackPower) {
+            enemies.push_back({ addString(name), health, attackPower });
+        });
+        saved.firstQuest = (uint32_t)quests.size();
+        saved.questCount = (uint32_t)location.questCount();
+        location.forEachQuest([&](const Quest& quest) {
+            addQuest(quest);
+        });
+        saved.firstItem = (uint32_t)items.size();
+        saved.itemCount = (uint32_t)location.itemCount();
+        location.forEachItem([&](const ItemRecord& record) {
+            addItem(record);
+        });
+        locations.push_back(saved);
+    }
+
+    // Copies one location out of another image, e.g. a record kept by a
+    // ChunkSource. A template only because SaveView is defined further down.
+    template <typename View>
+    void addLocation(const View& save, const SavedLocation& from) {
+        uint32_t itemCount, questCount, choiceCount, enemyCount;
+        const SavedItem* savedItems = save.template section<SavedItem>(SECTION_ITEMS, itemCount);
+        const SavedQuest* savedQuests = save.template section<SavedQuest>(SECTION_QUESTS, questCount);
+        const SavedString* savedChoices = save.template section<SavedString>(SECTION_CHOICES, choiceCount);
+        const SavedEnemy* savedEnemies = save.template section<SavedEnemy>(SECTION_ENEMIES, enemyCount);
+
+        SavedLocation saved = from;
+        saved.name = addString(save.str(from.name));
+        saved.firstEnemy = (uint32_t)enemies.size();
+        for (uint32_t e = 0; e < from.enemyCount; ++e) {
+            const SavedEnemy& enemy = savedEnemies[from.firstEnemy + e];
+            enemies.push_back({ addString(save.str(enemy.name)), enemy.health, enemy.attackPower });
+        }
+        saved.firstHorde = (uint32_t)enemies.size();
+        for (uint32_t e = 0; e < from.hordeCount; ++e) {
+            const SavedEnemy& enemy = savedEnemies[from.firstHorde + e];
+            enemies.push_back({ addString(save.str(enemy.name)), enemy.health, enemy.attackPower });
+        }
+        saved.firstQuest = (uint32_t)quests.size();
+        for (uint32_t q = 0; q < from.questCount; ++q) {
+            SavedQuest quest = savedQuests[from.firstQuest + q];
+            quest.title = addString(save.str(quest.title));
+            quest.description = addString(save.str(quest.description));
+            uint32_t firstChoice = quest.firstChoice;
+            quest.firstChoice = (uint32_t)choices.size();
+            for (uint32_t c = 0; c < quest.choiceCount; ++c) {
+                choices.push_back(addString(save.str(savedChoices[firstChoice + c])));
+            }
+            quests.push_back(quest);
+        }
+        saved.firstItem = (uint32_t)items.size();
+        for (uint32_t t = 0; t < from.itemCount; ++t) {
+            SavedItem item = savedItems[from.firstItem + t];
+            item.name = addString(save.str(item.name));
+            items.push_back(item);
+        }
+        locations.push_back(saved);
+    }
+
+    vector<char> finish(uint32_t sequence = 0) const {
+        vector<char> out(sizeof(SaveHeader));
+        SaveHeader header = {};
+        memcpy(header.magic, SAVE_MAGIC, sizeof(header.magic));
+        header.version = SAVE_VERSION;
+        header.sectionCount = SECTION_COUNT;
+        header.sequence = sequence;
+        place(out, header, SECTION_STRINGS, strings.data(), strings.size());
+        place(out, header, SECTION_CHARACTER, characters.data(), characters.size());
+        place(out, header, SECTION_ITEMS, items.data(), items.size());
+        place(out, header, SECTION_SKILLS, skills.data(), skills.size());
+        place(out, header, SECTION_QUESTS, quests.data(), quests.size());
+        place(out, header, SECTION_CHOICES, choices.data(), choices.size());
+        place(out, header, SECTION_ENEMIES, enemies.data(), enemies.size());
+        place(out, header, SECTION_LOCATIONS, locations.data(), locations.size());
+        place(out, header, SECTION_QUEST_STATES, questStates.data(), questStates.size());
+        place(out, header, SECTION_QUEST_PROGRESS, questProgress.data(), questProgress.size());
+        out.resize((out.size() + 7) & ~(size_t)7);
+        memcpy(out.data(), &header, sizeof(header));
+        return out;
+    }
+
+    // Writes to a temporary file, syncs it and renames it over the target, then
+    // syncs the directory so the rename is on disk too. A crash at any point
+    // leaves either the old save or the new one, never a truncated file.
+    static bool writeFile(const string& path, const vector<char>& data) {
+        string tempPath = path + ".tmp";
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        bool synced = written == data.size() && fsync(fd) == 0;
+        ::close(fd);
+        if (!synced || rename(tempPath.c_str(), path.c_str()) != 0) {
+            unlink(tempPath.c_str());
+            return false;
+        }
+        size_t slash = path.find_last_of('/');
+        string directory = slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+        int directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directoryFd >= 0) {
+            fsync(directoryFd);
+            ::close(directoryFd);
+        }
+        return true;
+    }
+};
+
+// Read-only view of a save file mapped with mmap. Records are used in place.
+class SaveView {
+private:
+    const char* data;
+    size_t length;
+    bool mapped;
+
+public:
+    SaveView() : data(nullptr), length(0), mapped(false) {}
+    SaveView(const SaveView&) = delete;
+    SaveView& operator=(const SaveView&) = delete;
+
+    bool open(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(SaveHeader)) {
+            void* region = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (region != MAP_FAILED) {
+                data = (const char*)region;
+                length = info.st_size;
+                mapped = true;
+            }
+        }
+        ::close(fd);
+        if (data && !valid()) {
+            close();
+        }
+        return data != nullptr;
+    }
+
+    // Views a snapshot that is already in memory (e.g. a journal record).
+    bool open(const char* bytes, size_t size) {
+        close();
+        if (size < sizeof(SaveHeader) || ((uintptr_t)bytes & 7) != 0) {
+            return false;
+        }
+        data = bytes;
+        length = size;
+        if (!valid()) {
+            close();
+        }
+        return data != nullptr;
+    }
+
+    bool isOpen() const {
+        return data != nullptr;
+    }
+
+    void close() {
+        if (data && mapped) {
+            munmap((void*)data, length);
+        }
+        data = nullptr;
+        length = 0;
+        mapped = false;
+    }
+
+    ~SaveView() {
+        close();
+    }
+
+    const SaveHeader& header() const {
+        return *(const SaveHeader*)data;
+    }
+
+    template <typename T>
+    const T* section(SaveSectionId id, uint32_t& count) const {
+        const SaveSection& entry = header().sections[id];
+        count = entry.count;
+        return (const T*)(data + entry.offset);
+    }
+
+    string str(const SavedString& saved) const {
+        const SaveSection& strings = header().sections[SECTION_STRINGS];
+        return string(data + strings.offset + saved.offset, saved.length);
+    }
+
+private:
+    static size_t recordSize(uint32_t id) {
+        static const size_t sizes[SECTION_COUNT] = { 1, sizeof(SavedCharacter), sizeof(SavedItem), sizeof(SavedSkill),
+                                                     sizeof(SavedQuest), sizeof(SavedString), sizeof(SavedEnemy), sizeof(SavedLocation),
+                                                     sizeof(SavedQuestState), sizeof(uint32_t) };
+        return sizes[id];
+    }
+
+    bool valid() const {
+        const SaveHeader& h = header();
+        if (memcmp(h.magic, SAVE_MAGIC, sizeof(h.magic)) != 0 || h.version != SAVE_VERSION || h.sectionCount != SECTION_COUNT) {
+            return false;
+        }
+        for (uint32_t id = 0; id < SECTION_COUNT; ++id) {
+            const SaveSection& entry = h.sections[id];
+            if (entry.offset > length || entry.size > length - entry.offset || entry.offset % 8 != 0 ||
+                (uint64_t)entry.count * recordSize(id) > entry.size) {
+                return false;
+            }
+        }
+        return contentsValid();
+    }
+
+    // Checks every string, index range and enum the loaders use, once, so they
+    // can index the mapped records without checking again.
+    bool contentsValid() const {
+        uint64_t stringBytes = header().sections[SECTION_STRINGS].size;
+        auto text = [stringBytes](const SavedString& saved) { return (uint64_t)saved.offset + saved.length <= stringBytes; };
+        auto range = [](uint32_t first, uint32_t count, uint32_t total) { return (uint64_t)first + count <= total; };
+        auto equipped = [](int32_t index, uint32_t count) { return index >= -1 && index < (int64_t)count; };
+        const uint32_t skillLimit = (uint32_t)Skill::LIGHTNING_STRIKE;
+
+        uint32_t characterCount, itemCount, skillCount, questCount, choiceCount, enemyCount, locationCount, stateCount, progressCount;
+        const SavedCharacter* characters = section<SavedCharacter>(SECTION_CHARACTER, characterCount);
+        const SavedItem* items = section<SavedItem>(SECTION_ITEMS, itemCount);
+        const SavedSkill* skills = section<SavedSkill>(SECTION_SKILLS, skillCount);
+        const SavedQuest* quests = section<SavedQuest>(SECTION_QUESTS, questCount);
+        const SavedString* choices = section<SavedString>(SECTION_CHOICES, choiceCount);
+        const SavedEnemy* enemies = section<SavedEnemy>(SECTION_ENEMIES, enemyCount);
+        const SavedLocation* locations = section<SavedLocation>(SECTION_LOCATIONS, locationCount);
+        const SavedQuestState* states = section<SavedQuestState>(SECTION_QUEST_STATES, stateCount);
+        section<uint32_t>(SECTION_QUEST_PROGRESS, progressCount);
+
+        for (uint32_t i = 0; i < itemCount; ++i) {
+            const SavedItem& item = items[i];
+            if (!text(item.name) || item.type >= ITEM_TYPE_COUNT || item.rarity > (uint8_t)Rarity::LEGENDARY) return false;
+            if (item.type == (uint8_t)ItemType::SCROLL && (uint32_t)item.stat > skillLimit) return false;
+        }
+        for (uint32_t i = 0; i < skillCount; ++i) {
+            if ((uint32_t)skills[i].skill > skillLimit) return false;
+        }
+        for (uint32_t i = 0; i < characterCount; ++i) {
+            const SavedCharacter& character = characters[i];
+            if (!text(character.name) || !range(character.firstItem, character.itemCount, itemCount) ||
+                !range(character.firstSkill, character.skillCount, skillCount) ||
+                !equipped(character.equippedWeapon, character.itemCount) || !equipped(character.equippedArmor, character.itemCount) ||
+                (uint32_t)character.timeOfDay > (uint32_t)TimeOfDay::NIGHT) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < questCount; ++i) {
+            const SavedQuest& quest = quests[i];
+            if (!text(quest.title) || !text(quest.description) || quest.type > (uint8_t)QuestType::SIDE ||
+                !range(quest.firstChoice, quest.choiceCount, choiceCount)) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < choiceCount; ++i) {
+            if (!text(choices[i])) return false;
+        }
+        for (uint32_t i = 0; i < enemyCount; ++i) {
+            if (!text(enemies[i].name)) return false;
+        }
+        for (uint32_t i = 0; i < locationCount; ++i) {
+            const SavedLocation& location = locations[i];
+            if (!text(location.name) || !range(location.firstEnemy, location.enemyCount, enemyCount) ||
+                !range(location.firstHorde, location.hordeCount, enemyCount) || !range(location.firstQuest, location.questCount, questCount) ||
+                !range(location.firstItem, location.itemCount, itemCount)) {
+                return false;
+            }
+        }
+        for (uint32_t i = 0; i < stateCount; ++i) {
+            const SavedQuestState& state = states[i];
+            if (!text(state.title) || state.isChoosing > 1 || !range(state.firstProgress, state.progressCount, progressCount)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Generates wilderness locations from their ID and keeps only the ones that were
+// changed, so a million-location world costs memory for what the player touched.
+// Changed locations are kept in save format, items included by value; rebuild
+// turns one back into a Location with items of its own (Game::makeLocation).
+class ProceduralChunkSource : public ChunkSource {
+private:
+    unordered_map<uint32_t, vector<char>> changed;
+    unordered_set<uint32_t> unjournaled;  // stored with changes no autosave has seen
+
+    // Views a stored record; nullptr unless it holds exactly one location.
+    static const SavedLocation* open(SaveView& view, const vector<char>& record) {
+        uint32_t count = 0;
+        const SavedLocation* saved = nullptr;
+        if (view.open(record.data(), record.size())) {
+            saved = view.section<SavedLocation>(SECTION_LOCATIONS, count);
+        }
+        return count == 1 ? saved : nullptr;
+    }
+
+public:
+    function<Location(const SaveView&, const SavedLocation&)> rebuild;
+
+    void load(uint32_t, const vector<uint32_t>& ids, vector<Location>& out) override {
+        for (uint32_t id : ids) {
+            auto found = changed.find(id);
+            if (found != changed.end()) {
+                SaveView view;
+                if (const SavedLocation* saved = open(view, found->second)) {
+                    out.push_back(rebuild(view, *saved));
+                    // Changes not journaled yet stay pending on the resident copy.
+                    if (unjournaled.erase(id) == 0) {
+                        out.back().markClean();
+                    }
+                    continue;
+                }
+            }
+            Location location("Wilds " + to_string(id));
+            if (id % 3 == 0) {
+                location.addEnemy(Enemy(id % 2 ? "Troll" : "Goblin", id % 2 ? 100 : 50, id % 2 ? 20 : 10));
+            }
+            location.markClean();
+            out.push_back(location);
+        }
+    }
+
+    void store(uint32_t, const vector<uint32_t>& ids, const vector<Location>& locations) override {
+        for (size_t i = 0; i < ids.size(); ++i) {
+            SaveWriter writer;
+            writer.addLocation(ids[i], 0, 0, locations[i]);
+            changed[ids[i]] = writer.finish();
+            if (locations[i].hasChanges()) {
+                unjournaled.insert(ids[i]);
+            }
+        }
+    }
+
+    size_t changedCount() const {
+        return changed.size();
+    }
+
+    // Copies a stored location into writer, at its position in world.
+    bool copyTo(SaveWriter& writer, const World& world, uint32_t id) const {
+        auto found = changed.find(id);
+        if (found == changed.end()) {
+            return false;
+        }
+        SaveView view;
+        const SavedLocation* saved = open(view, found->second);
+        if (!saved) {
+            return false;
+        }
+        SavedLocation located = *saved;
+        located.x = world.node(id).x;
+        located.y = world.node(id).y;
+        writer.addLocation(view, located);
+        return true;
+    }
+
+    // Adds the stored locations that are streamed out to a snapshot; the World
+    // writes the resident ones.
+    void addTo(SaveWriter& writer, const World& world) const {
+        for (const auto& entry : changed) {
+            if (!world.find(entry.first)) {
+                copyTo(writer, world, entry.first);
+            }
+        }
+    }
+
+    // Calls visit(id) for every location stored with changes since the last
+    // call or markJournaled(), then forgets them.
+    template <typename Visit>
+    void takeUnjournaled(Visit visit) {
+        for (uint32_t id : unjournaled) {
+            visit(id);
+        }
+        unjournaled.clear();
+    }
+
+    void markJournaled() {
+        unjournaled.clear();
+    }
+};
+
+// Autosave Journal
+// Autosaves append only the records that changed since the last one. Each record
+// is a small snapshot image (the character, the running quests, or one location)
+// behind a header carrying its sequence number and checksum. Loading takes the
+// full snapshot and replays newer, intact records on top of it.
+enum JournalRecordKind : uint32_t {
+    RECORD_CHARACTER,
+    RECORD_LOCATION,
+    RECORD_QUESTS
+};
+
+struct JournalRecord {
+    uint32_t kind;
+    uint32_t index;     // location ID for RECORD_LOCATION
+    uint32_t sequence;
+    uint32_t size;      // payload bytes following the header, a multiple of 8
+    uint64_t checksum;  // FNV-1a over the payload
+};
+
+uint64_t fnv1a(const char* data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t)data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+void appendJournalRecord(vector<char>& batch, JournalRecordKind kind, uint32_t index, uint32_t sequence, const vector<char>& payload) {
+    JournalRecord record = { kind, index, sequence, (uint32_t)payload.size(), fnv1a(payload.data(), payload.size()) };
+    batch.insert(batch.end(), (const char*)&record, (const char*)&record + sizeof(record));
+    batch.insert(batch.end(), payload.begin(), payload.end());
+}
+
+// Owns the disk side of saving for any number of games. Games hand over finished
+// buffers and return at once; this thread coalesces a game's queued journal
+// batches into one write followed by fsync, and swaps in full snapshots when
+// compaction is requested. A server shares one between all of its sessions.
+class SaveQueue {
+private:
+    struct Job {
+        uint64_t owner;
+        bool isSnapshot;
+        string snapshotPath;
+        string journalPath;
+        vector<char> data;
+    };
+
+    deque<Job> jobs;
+    mutex lock;
+    condition_variable wake;
+    condition_variable idle;
+    uint64_t busyOwner;  // 0 while no job is being written
+    uint64_t nextOwner;
+    bool stopping;
+    thread worker;
+
+    static void appendToJournal(const string& journalPath, const vector<char>& batch) {
+        int fd = ::open(journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (fd < 0) {
+            return;
+        }
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t n = ::write(fd, batch.data() + written, batch.size() - written);
+            if (n <= 0) break;
+            written += n;
+        }
+        fsync(fd);
+        ::close(fd);
+    }
+
+    static void writeSnapshot(const string& snapshotPath, const string& journalPath, const vector<char>& snapshot) {
+        if (SaveWriter::writeFile(snapshotPath, snapshot)) {
+            // Records up to the snapshot's sequence are folded in; anything left over
+            // after a crash here is skipped on load by its sequence number.
+            truncate(journalPath.c_str(), 0);
+        }
+    }
+
+    bool pending(uint64_t owner) const {
+        if (busyOwner == owner) return true;
+        for (const auto& job : jobs) {
+            if (job.owner == owner) return true;
+        }
+        return false;
+    }
+
+    void run() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            wake.wait(guard, [this]() { return stopping || !jobs.empty(); });
+            if (jobs.empty()) {
+                break;
+            }
+            Job job = move(jobs.front());
+            jobs.pop_front();
+            while (!job.isSnapshot && !jobs.empty() && !jobs.front().isSnapshot && jobs.front().owner == job.owner) {
+                job.data.insert(job.data.end(), jobs.front().data.begin(), jobs.front().data.end());
+                jobs.pop_front();
+            }
+            busyOwner = job.owner;
+            guard.unlock();
+            if (job.isSnapshot) {
+                writeSnapshot(job.snapshotPath, job.journalPath, job.data);
+            } else {
+                appendToJournal(job.journalPath, job.data);
+            }
+            guard.lock();
+            busyOwner = 0;
+            idle.notify_all();
+        }
+    }
+
+public:
+    SaveQueue() : busyOwner(0), nextOwner(1), stopping(false) {}
+    SaveQueue(const SaveQueue&) = delete;
+    SaveQueue& operator=(const SaveQueue&) = delete;
+
+    ~SaveQueue() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    // An ID for one game's jobs, so flush() can wait for that game alone.
+    uint64_t addOwner() {
+        lock_guard<mutex> guard(lock);
+        return nextOwner++;
+    }
+
+    void push(uint64_t owner, bool isSnapshot, const string& snapshotPath, const string& journalPath, vector<char>&& data) {
+        {
+            lock_guard<mutex> guard(lock);
+            // Started on first use, so games that never save never start a thread.
+            if (!worker.joinable()) {
+                worker = thread([this]() { run(); });
+            }
+            jobs.push_back({ owner, isSnapshot, snapshotPath, journalPath, move(data) });
+        }
+        wake.notify_one();
+    }
+
+    // Blocks until everything the owner queued so far is on disk.
+    void flush(uint64_t owner) {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this, owner]() { return !pending(owner); });
+    }
+};
+
+// One game's save files, written through a SaveQueue: the game's own unless
+// one is passed in to share.
+class AutosaveWriter {
+private:
+    shared_ptr<SaveQueue> queue;
+    uint64_t owner;
+    string snapshotPath;
+    string journalPath;
+
+public:
+    AutosaveWriter(const string& snapshotPath, const string& journalPath, shared_ptr<SaveQueue> shared = nullptr)
+        : queue(shared ? move(shared) : make_shared<SaveQueue>()), owner(queue->addOwner()),
+          snapshotPath(snapshotPath), journalPath(journalPath) {}
+
+    const string& snapshotFile() const { return snapshotPath; }
+    const string& journalFile() const { return journalPath; }
+
+    void appendBatch(vector<char>&& batch) {
+        if (!batch.empty()) {
+            queue->push(owner, false, snapshotPath, journalPath, move(batch));
+        }
+    }
+
+    void replaceSnapshot(vector<char>&& snapshot) {
+        queue->push(owner, true, snapshotPath, journalPath, move(snapshot));
+    }
+
+    // Blocks until everything queued so far is on disk.
+    void flush() {
+        queue->flush(owner);
+    }
+};
+
+// Line Input
+// Reads a file descriptor (stdin by default) without blocking the simulation:
+// poll() waits at most until the next tick, read() takes whatever has arrived,
+// and complete lines are queued for the game to handle on its next tick.
+class LineInput {
+private:
+    int fd;
+    string partial;
+    deque<string> lines;
+    bool closed;
+
+public:
+    LineInput(int fd = STDIN_FILENO) : fd(fd), closed(false) {}
+
+    // Waits up to timeoutMs for input and queues any complete lines.
+    void wait(int timeoutMs) {
+        if (closed) {
+            if (timeoutMs > 0) this_thread::sleep_for(chrono::milliseconds(timeoutMs));
+            return;
+        }
+        pollfd watch = { fd, POLLIN, 0 };
+        if (poll(&watch, 1, timeoutMs) <= 0) {
+            return;
+        }
+        char buffer[4096];
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got <= 0) {
+            closed = true;
+            if (!partial.empty()) {
+                lines.push_back(partial);
+                partial.clear();
+            }
+            return;
+        }
+        partial.append(buffer, got);
+        size_t start = 0;
+        for (size_t end; (end = partial.find('\n', start)) != string::npos; start = end + 1) {
+            lines.push_back(partial.substr(start, end - start));
+            if (!lines.back().empty() && lines.back().back() == '\r') lines.back().pop_back();
+        }
+        partial.erase(0, start);
+    }
+
+    void push(const string& line) {
+        lines.push_back(line);
+    }
+
+    bool pending() const {
+        return !lines.empty();
+    }
+
+    string pop() {
+        string line = lines.front();
+        lines.pop_front();
+        return line;
+    }
+
+    // True once the other end has closed and every queued line has been taken.
+    bool finished() const {
+        return closed && lines.empty();
+    }
+};
+
+// Tick Scheduler
+// Runs the registered systems once per fixed timestep, always in the order they
+// were added, and times each one against its budget. Between ticks it waits on
+// input instead of sleeping. A tick that falls behind is counted as an overrun;
+// if the loop is more than a few steps behind, the backlog is dropped rather
+// than run back to back.
+class TickScheduler {
+private:
+    struct System {
+        string name;
+        double budgetMs;
+        function<void(uint64_t)> update;
+        double lastMs = 0;
+        double worstMs = 0;
+        double totalMs = 0;
+        uint64_t overruns = 0;
+    };
+
+    static constexpr int maxCatchUp = 4;
+
+    vector<System> systems;
+    chrono::nanoseconds step;
+    uint64_t tick;
+    uint64_t lateTicks;
+    uint64_t droppedTicks;
+    double worstTickMs;
+
+public:
+    TickScheduler(int hz)
+        : step(chrono::nanoseconds(1000000000LL / hz)), tick(0), lateTicks(0), droppedTicks(0), worstTickMs(0) {}
+
+    void addSystem(const string& name, double budgetMs, function<void(uint64_t)> update) {
+        System system;
+        system.name = name;
+        system.budgetMs = budgetMs;
+        system.update = move(update);
+        systems.push_back(move(system));
+    }
+
+    uint64_t currentTick() const {
+        return tick;
+    }
+
+    double stepMs() const {
+        return chrono::duration<double, milli>(step).count();
+    }
+
+    void runTick() {
+        auto tickStart = chrono::steady_clock::now();
+        for (auto& system : systems) {
+            auto start = chrono::steady_clock::now();
+            system.update(tick);
+            system.lastMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            system.totalMs += system.lastMs;
+            system.worstMs = max(system.worstMs, system.lastMs);
+            if (system.lastMs > system.budgetMs) {
+                system.overruns++;
+            }
+        }
+        double tickMs = chrono::duration<double, milli>(chrono::steady_clock::now() - tickStart).count();
+        worstTickMs = max(worstTickMs, tickMs);
+        if (tickMs > stepMs()) {
+            lateTicks++;
+        }
+        tick++;
+    }
+
+    // Ticks at the fixed rate until keepRunning() returns false, reading input
+    // from the given source while waiting.
+    void run(LineInput& input, const function<bool()>& keepRunning) {
+        auto next = chrono::steady_clock::now() + step;
+        while (keepRunning()) {
+            auto now = chrono::steady_clock::now();
+            if (now < next) {
+                input.wait((int)chrono::duration_cast<chrono::milliseconds>(next - now + chrono::microseconds(999)).count());
+                continue;
+            }
+            for (int i = 0; i < maxCatchUp && now >= next && keepRunning(); ++i) {
+                runTick();
+                next += step;
+            }
+            if (now >= next) {
+                droppedTicks += (now - next) / step + 1;
+                next = now + step;
+            }
+        }
+    }
+
+    void report() const {
+        screen() << "Tick Report (" << tick << " ticks at " << stepMs() << " ms, " << lateTicks << " late, "
+                 << droppedTicks << " dropped, worst " << worstTickMs << " ms):\n";
+        for (const auto& system : systems) {
+            screen() << "  " << system.name << ": avg " << (tick ? system.totalMs / tick : 0.0) << " ms, worst "
+                     << system.worstMs << " ms, budget " << system.budgetMs << " ms, " << system.overruns << " over budget\n";
+        }
+    }
+};
+
+// Work-Stealing Thread Pool
+// Tasks are plain indices dealt round-robin to per-worker deques. A worker pops
+// from the back of its own deque and steals from the front of the others once
+// it runs dry. Worker threads live as long as the pool and sleep between
+// batches; the calling thread takes part as worker 0.
+class WorkStealingPool {
+private:
+    struct Worker {
+        mutex lock;
+        deque<int> tasks;
+    };
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    mutex batchLock;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)>* body;
+    uint64_t batch;
+    int remaining;  // tasks not yet finished in the current batch
+    bool stopping;
+
+    bool pop(int self, int& task) {
+        Worker& own = *workers[self];
+        lock_guard<mutex> guard(own.lock);
+        if (own.tasks.empty()) return false;
+        task = own.tasks.back();
+        own.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int self, int& task) {
+        for (size_t i = 1; i < workers.size(); ++i) {
+            Worker& victim = *workers[(self + i) % workers.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int self) {
+        int task;
+        while (pop(self, task) || steal(self, task)) {
+            (*body)(task);
+            lock_guard<mutex> guard(batchLock);
+            if (--remaining == 0) done.notify_all();
+        }
+    }
+
+    void loop(int self) {
+        uint64_t seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(batchLock);
+                wake.wait(guard, [&] { return stopping || batch != seen; });
+                if (stopping) return;
+                seen = batch;
+            }
+            work(self);
+        }
+    }
+
+public:
+    WorkStealingPool(int threadCount) : body(nullptr), batch(0), remaining(0), stopping(false) {
+        for (int i = 0; i < max(1, threadCount); ++i) {
+            workers.push_back(unique_ptr<Worker>(new Worker()));
+        }
+        for (int i = 1; i < size(); ++i) {
+            threads.emplace_back([this, i]() { loop(i); });
+        }
+    }
+
+    ~WorkStealingPool() {
+        {
+            lock_guard<mutex> guard(batchLock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+
+    int size() const { return (int)workers.size(); }
+
+    // Runs task(i) for every i in [0, taskCount) and returns when all are done.
+    void run(int taskCount, const function<void(int)>& task) {
+        if (taskCount == 0) return;
+        if (workers.size() == 1) {
+            for (int i = 0; i < taskCount; ++i) task(i);
+            return;
+        }
+        // A worker still draining the last batch can take a task the moment it
+        // is pushed, so the batch state must be in place before any task is.
+        {
+            lock_guard<mutex> guard(batchLock);
+            body = &task;
+            remaining = taskCount;
+        }
+        for (int i = 0; i < taskCount; ++i) {
+            lock_guard<mutex> guard(workers[i % workers.size()]->lock);
+            workers[i % workers.size()]->tasks.push_back(i);
+        }
+        {
+            lock_guard<mutex> guard(batchLock);
+            batch++;
+        }
+        wake.notify_all();
+        work(0);
+        unique_lock<mutex> guard(batchLock);
+        done.wait(guard, [&] { return remaining == 0; });
+    }
+};
+
+// Makes a game's registry, status engine and name table the current ones on
+// this thread until it goes out of scope. The server installs a session's
+// whenever it runs it; JobGraph installs its game's around every job, since
+// pool threads otherwise see their own defaults.
+class SessionScope {
+private:
+    Registry* previousRegistry;
+    StatusEngine* previousEffects;
+    StringPool* previousNames;
+
+public:
+    SessionScope(Registry& entities, StatusEngine& effects, StringPool& names)
+        : previousRegistry(currentRegistry()), previousEffects(currentStatusEngine()), previousNames(currentNameTable()) {
+        currentRegistry() = &entities;
+        currentStatusEngine() = &effects;
+        currentNameTable() = &names;
+    }
+
+    ~SessionScope() {
+        currentRegistry() = previousRegistry;
+        currentStatusEngine() = previousEffects;
+        currentNameTable() = previousNames;
+    }
+};
+
+// Job Graph
+// Per-tick systems declare what they read and write: component types by their
+// ComponentTraits bit, shared state by a Resource bit. A system is placed one
+// stage after the last earlier system it conflicts with, and the systems of a
+// stage run together on the pool. Systems never change the registry's structure
+// or print directly; they record that in a CommandBuffer, and the buffers are
+// applied in registration order after each stage, so results do not depend on
+// which thread ran what.
+enum Resource : uint32_t {
+    RESOURCE_STATUS = 1u << 16,  // statusEngine()
+    RESOURCE_WORLD = 1u << 17,   // World nodes, edges and locations
+    RESOURCE_PLAYER = 1u << 18,  // the player's Character facade
+};
+
+class CommandBuffer {
+private:
+    Registry& target;
+    vector<Entity> destroyed;
+    vector<function<void()>> deferred;
+
+public:
+    CommandBuffer(Registry& target) : target(target) {}
+
+    void destroy(Entity entity) {
+        destroyed.push_back(entity);
+    }
+
+    // Runs on the ticking thread during the merge, e.g. to print or call into facades.
+    void defer(function<void()> action) {
+        deferred.push_back(move(action));
+    }
+
+    void apply() {
+        for (Entity entity : destroyed) {
+            target.destroy(entity);
+        }
+        for (auto& action : deferred) {
+            action();
+        }
+        destroyed.clear();
+        deferred.clear();
+    }
+};
+
+// The game a job belongs to. Pool threads are not the game's thread, so the
+// graph also installs these as registry(), statusEngine() and nameTable().
+struct JobContext {
+    Registry& entities;
+    StatusEngine& effects;
+    StringPool& names;
+    CommandBuffer& commands;
+    uint64_t tick;
+};
+
+class JobGraph {
+private:
+    struct Job {
+        string name;
+        uint32_t reads;
+        uint32_t writes;
+        function<void(JobContext&)> run;
+        vector<size_t> after;  // earlier jobs this one conflicts with
+        size_t stage = 0;
+        double lastMs = 0;
+        double worstMs = 0;
+        double totalMs = 0;
+        unique_ptr<CommandBuffer> commands;
+    };
+
+    Registry& entities;
+    StatusEngine& effects;
+    StringPool& names;
+    WorkStealingPool pool;
+    vector<Job> jobs;
+    vector<vector<size_t>> stages;
+    uint64_t ticks;
+    double lastTickMs;
+
+    static bool conflicts(const Job& a, const Job& b) {
+        return (a.writes & (b.reads | b.writes)) || (b.writes & a.reads);
+    }
+
+public:
+    JobGraph(Registry& entities, StatusEngine& effects, StringPool& names, int threadCount)
+        : entities(entities), effects(effects), names(names), pool(threadCount), ticks(0), lastTickMs(0) {}
+
+    void addJob(const string& name, uint32_t reads, uint32_t writes, function<void(JobContext&)> run) {
+        Job job;
+        job.name = name;
+        job.reads = reads;
+        job.writes = writes;
+        job.run = move(run);
+        job.commands.reset(new CommandBuffer(entities));
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (conflicts(jobs[i], job)) {
+                job.after.push_back(i);
+                job.stage = max(job.stage, jobs[i].stage + 1);
+            }
+        }
+        if (stages.size() <= job.stage) stages.resize(job.stage + 1);
+        stages[job.stage].push_back(jobs.size());
+        jobs.push_back(move(job));
+    }
+
+    void runTick(uint64_t tick) {
+        auto tickStart = chrono::steady_clock::now();
+        for (const auto& stage : stages) {
+            pool.run((int)stage.size(), [&](int i) {
+                Job& job = jobs[stage[i]];
+                SessionScope scope(entities, effects, names);
+                JobContext context = { entities, effects, names, *job.commands, tick };
+                auto start = chrono::steady_clock::now();
+                job.run(context);
+                job.lastMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            });
+            for (size_t index : stage) {
+                Job& job = jobs[index];
+                job.commands->apply();
+                job.totalMs += job.lastMs;
+                job.worstMs = max(job.worstMs, job.lastMs);
+            }
+        }
+        lastTickMs = chrono::duration<double, milli>(chrono::steady_clock::now() - tickStart).count();
+        ticks++;
+    }
+
+    // Stage layout, per-job timing, and the chain of dependent jobs that took
+    // longest last tick: no thread count can make a tick faster than that chain.
+    void report() const {
+        screen() << "Job Graph (" << pool.size() << " threads, " << stages.size() << " stages, last tick "
+                 << lastTickMs << " ms):\n";
+        for (size_t s = 0; s < stages.size(); ++s) {
+            screen() << "  Stage " << s + 1 << ":";
+            for (size_t index : stages[s]) {
+                const Job& job = jobs[index];
+                screen() << " " << job.name << " (" << job.lastMs << " ms, avg " << (ticks ? job.totalMs / ticks : 0.0)
+                         << ", worst " << job.worstMs << ")";
+            }
+            screen() << "\n";
+        }
+        vector<double> finish(jobs.size(), 0.0);
+        vector<size_t> previous(jobs.size(), SIZE_MAX);
+        size_t last = SIZE_MAX;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            for (size_t before : jobs[i].after) {
+                if (finish[before] > finish[i]) {
+                    finish[i] = finish[before];
+                    previous[i] = before;
+                }
+            }
+            finish[i] += jobs[i].lastMs;
+            if (last == SIZE_MAX || finish[i] > finish[last]) last = i;
+        }
+        if (last == SIZE_MAX) return;
+        vector<size_t> chain;
+        for (size_t i = last; i != SIZE_MAX; i = previous[i]) chain.push_back(i);
+        screen() << "  Critical path (" << finish[last] << " ms):";
+        for (size_t i = chain.size(); i-- > 0;) {
+            screen() << (i + 1 == chain.size() ? " " : " -> ") << jobs[chain[i]].name;
+        }
+        screen() << "\n";
+    }
+};
+
+// Replay Log
+// A session is reproducible from its RNG seed and its input lines, each stamped
+// with the tick that consumed it. The log is a small header followed by records
+// of a kind byte, the tick delta as a varint and the payload: the line for input,
+// a state hash for checkpoints and the final hash at the end. Records are flushed
+// as they are written, so a crashed session still leaves a usable log.
+enum ReplayKind : uint8_t { REPLAY_INPUT = 1, REPLAY_CHECKPOINT = 2, REPLAY_END = 3 };
+
+struct ReplayHeader {
+    char magic[4];  // "RPGR"
+    uint32_t version;
+    uint64_t seed;
+};
+
+struct ReplayRecord {
+    ReplayKind kind;
+    uint64_t tick;
+    string line;
+    uint64_t hash;
+};
+
+static constexpr uint32_t REPLAY_VERSION = 1;
+
+class ReplayRecorder {
+private:
+    FILE* file;
+    uint64_t lastTick;
+    string pending;
+
+    void putVarint(uint64_t value) {
+        while (value >= 0x80) {
+            pending.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        pending.push_back((char)value);
+    }
+
+    void begin(ReplayKind kind, uint64_t tick) {
+        pending.push_back((char)kind);
+        putVarint(tick - lastTick);
+        lastTick = tick;
+    }
+
+    void flush() {
+        if (file) {
+            fwrite(pending.data(), 1, pending.size(), file);
+            fflush(file);
+        }
+        pending.clear();
+    }
+
+public:
+    ReplayRecorder() : file(nullptr), lastTick(0) {}
+
+    ~ReplayRecorder() {
+        if (file) fclose(file);
+    }
+
+    bool open(const string& path, uint64_t seed) {
+        file = fopen(path.c_str(), "wb");
+        if (!file) {
+            screen() << "Could not open " << path << " for recording.\n";
+            return false;
+        }
+        ReplayHeader header = { { 'R', 'P', 'G', 'R' }, REPLAY_VERSION, seed };
+        pending.append((const char*)&header, sizeof(header));
+        flush();
+        return true;
+    }
+
+    void input(uint64_t tick, const string& line) {
+        begin(REPLAY_INPUT, tick);
+        putVarint(line.size());
+        pending += line;
+        flush();
+    }
+
+    void checkpoint(uint64_t tick, uint64_t hash) {
+        begin(REPLAY_CHECKPOINT, tick);
+        pending.append((const char*)&hash, sizeof(hash));
+        flush();
+    }
+
+    void finish(uint64_t tick, uint64_t hash) {
+        begin(REPLAY_END, tick);
+        pending.append((const char*)&hash, sizeof(hash));
+        flush();
+    }
+};
+
+class ReplayReader {
+private:
+    vector<char> data;
+    size_t offset;
+    uint64_t tick;
+    ReplayHeader header;
+
+    bool getVarint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+            uint8_t byte = (uint8_t)data[offset++];
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+public:
+    ReplayReader() : offset(0), tick(0) {}
+
+    bool open(const string& path) {
+        ifstream in(path, ios::binary);
+        data.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        if (data.size() < sizeof(header)) {
+            screen() << "Replay " << path << " is missing or truncated.\n";
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, "RPGR", 4) != 0 || header.version != REPLAY_VERSION) {
+            screen() << "Replay " << path << " is not a replay log.\n";
+            return false;
+        }
+        offset = sizeof(header);
+        return true;
+    }
+
+    uint64_t seed() const { return header.seed; }
+
+    // False at the end of the log or at a torn record.
+    bool next(ReplayRecord& record) {
+        if (offset >= data.size()) return false;
+        record.kind = (ReplayKind)data[offset++];
+        uint64_t delta, length;
+        if (!getVarint(delta)) return false;
+        tick += delta;
+        record.tick = tick;
+        if (record.kind == REPLAY_INPUT) {
+            if (!getVarint(length) || length > data.size() - offset) return false;
+            record.line.assign(data.data() + offset, length);
+            offset += length;
+        } else {
+            if (data.size() - offset < sizeof(record.hash)) return false;
+            memcpy(&record.hash, data.data() + offset, sizeof(record.hash));
+            offset += sizeof(record.hash);
+        }
+        return true;
+    }
+};
+
+// How a Game is run: on its own from the console, or as one session of a server.
+struct GameConfig {
+    string saveName = "savegame";  // autosave files are <saveName>.bin and <saveName>.journal
+    int simulationThreads = 0;     // 0: one per core
+    bool hosted = false;           // frames are left for the host to take() instead of written
+    uint32_t wildernessSize = 0;   // procedural locations east of the map, streamed in chunks
+    shared_ptr<SaveQueue> saves;   // null: the game writes its saves on its own thread
+    shared_ptr<const ContentPack> content;  // null: the game loads its own, see loadContentPack()
+};
+
+// Game Class with added features
+class Game {
+private:
+    Character* player;
+    ProceduralChunkSource wilds;
+    World world;
+    bool isRunning;
+
+    static constexpr float travelRadius = 12.0f;
+    static constexpr float wildsOrigin = 20.0f;
+    static constexpr float wildsSpacing = 4.0f;
+    uint32_t wildernessSize;
+
+    static constexpr int autosaveIntervalSeconds = 30;
+    static constexpr int autosavesPerSnapshot = 20;
+    AutosaveWriter autosaver;
+    uint32_t saveSequence;
+    int autosavesSinceSnapshot;
+    bool unsaved;  // a new game with no snapshot of its own yet
+    chrono::steady_clock::time_point lastAutosave;
+
+    uint32_t currentLocation;
+    PathService paths;
+    shared_ptr<const ContentPack> content;
+    LootSystem loot;
+    CraftingSystem crafting;
+    shared_ptr<const WorldTemplate> startingMap;
+    QuestEngine questLog;
+    EventBus events;
+    uint64_t seed;
+    CounterRng rng;
+
+    // Which question the next input line answers.
+    enum class Prompt { NAME, MENU, TRAVEL, INTERACT, INVENTORY, CRAFT, QUESTS };
+    static constexpr int ticksPerSecond = 60;
+    static constexpr uint64_t ticksPerDayPhase = 120 * ticksPerSecond;
+    LineInput input;
+    TickScheduler scheduler;
+    Prompt prompt;
+    InventoryFilter inventoryFilter;
+    InventorySort inventorySort;
+    size_t inventoryPage;
+    Registry& entities;
+    JobGraph simulation;
+
+    static constexpr uint64_t checkpointInterval = 5 * ticksPerSecond;
+    static constexpr int fireballDamage = 40;
+    static constexpr int areaKillExperience = 5;
+    unique_ptr<ReplayRecorder> recorder;
+    bool replaying;
+    bool hosted;
+
+    static ItemRecord makeItem(const SaveView& save, const SavedItem& saved) {
+        ItemRecord record;
+        record.type = (ItemType)saved.type;
+        record.rarity = (Rarity)saved.rarity;
+        record.value = saved.value;
+        record.nameId = nameTable().intern(save.str(saved.name));
+        record.stat = saved.stat;
+        return record;
+    }
+
+public:
+    Game(const GameConfig& config = GameConfig())
+        : player(nullptr), isRunning(true), wildernessSize(config.wildernessSize), autosaver(config.saveName + ".bin", config.saveName + ".journal", config.saves),
+          saveSequence(0), autosavesSinceSnapshot(0), unsaved(false), lastAutosave(chrono::steady_clock::now()),
+          currentLocation(0), paths(world),
+          content(config.content ? config.content : loadContentPack()), loot(*content), crafting(*content), seed((uint64_t)chrono::steady_clock::now().time_since_epoch().count()), rng(seed, 0),
+          scheduler(ticksPerSecond), prompt(Prompt::NAME), inventorySort(InventorySort::VALUE), inventoryPage(0),
+          entities(registry()),
+          simulation(entities, statusEngine(), nameTable(), config.simulationThreads > 0 ? config.simulationThreads : (int)max(1u, thread::hardware_concurrency())),
+          replaying(false), hosted(config.hosted) {
+        wilds.rebuild = [this](const SaveView& save, const SavedLocation& saved) { return makeLocation(save, saved); };
+        world.events = &events;
+        startingMap = WorldTemplate::standard(*content);
+        defineQuests();
+        defineLoot();
+        addDefaultRecipes(crafting);
+        defineJobs();
+        defineSystems();
+        subscribeEvents();
+    }
+
+    // Who reacts to what. Producers only post; the handlers run when the bus is
+    // dispatched, after each command and at the end of every tick's simulation.
+    void subscribeEvents() {
+        events.subscribe<EnemyDefeated>([this](const EnemyDefeated& defeated) {
+            if (player) player->gainExperience(defeated.experience);
+        });
+        events.subscribe<EnemyDefeated>([this](const EnemyDefeated& defeated) {
+            if (player) dropLoot(defeated.nameId);
+        });
+        events.subscribe<EnemyDefeated>([this](const EnemyDefeated& defeated) {
+            questEvent(QuestTrigger::KILL, defeated.nameId);
+        });
+        events.subscribe<ItemAcquired>([this](const ItemAcquired& acquired) {
+            questEvent(QuestTrigger::COLLECT, acquired.nameId, acquired.count);
+        });
+        events.subscribe<QuestCompleted>([this](const QuestCompleted& completed) {
+            Quest* quest = findQuest(questLog.definition(completed.quest).title);
+            if (quest && !quest->isCompleted && player) {
+                quest->complete();
+                player->gainExperience(quest->rewardExp);
+            }
+        });
+        events.subscribe<LevelUp>([](const LevelUp& levelUp) {
+            screen() << nameTable().get(levelUp.nameId) << " leveled up to level " << levelUp.level << "!\n";
+        });
+        events.subscribe<TimeOfDayChanged>([](const TimeOfDayChanged& changed) {
+            screen() << "Time has shifted to " << (changed.timeOfDay == TimeOfDay::DAY ? "Day" : "Night") << "\n";
+        });
+    }
+
+    // Per-tick simulation passes, run in parallel where their accesses allow.
+    void defineJobs() {
+        auto afflicted = make_shared<Query<Health, Status>>(entities);
+        // Settles damage over time only; the status clock is the combat round.
+        simulation.addJob("effects", componentMask<Status>(), componentMask<Health>() | RESOURCE_STATUS, [this, afflicted](JobContext& job) {
+            Entity self = player ? player->entity() : NO_ENTITY;
+            afflicted->each([&](Entity entity, Health& health, Status& status) {
+                if (entity.index == self.index && entity.generation == self.generation) return;
+                health.current = max(0, health.current - job.effects.takePendingDamage(status.host));
+            });
+            if (player) {
+                job.commands.defer([this] { player->applyStatus(); });
+            }
+        });
+        auto resting = make_shared<Query<Health, Progress>>(entities);
+        simulation.addJob("regen", componentMask<Progress>(), componentMask<Health>(), [resting](JobContext& job) {
+            if (job.tick % ticksPerSecond != 0) return;
+            resting->each([](Entity, Health& health, Progress&) {
+                if (health.current > 0) health.current = min(health.max, health.current + 1);
+            });
+        });
+        auto walkers = make_shared<Query<Wander>>(entities);
+        simulation.addJob("wander", RESOURCE_WORLD, componentMask<Wander>(), [this, walkers](JobContext& job) {
+            walkers->each([&](Entity entity, Wander& wander) {
+                if (wander.nextMove > job.tick) return;
+                const auto& roads = world.edges[wander.location];
+                uint64_t roll = CounterRng::mix(((uint64_t)entity.index << 32) ^ job.tick);
+                if (!roads.empty()) wander.location = roads[roll % roads.size()].to;
+                wander.nextMove = (uint32_t)(job.tick + ticksPerSecond * 2 + (roll >> 32) % (ticksPerSecond * 2));
+            });
+        });
+        auto wanderers = make_shared<Query<Health, Wander>>(entities);
+        simulation.addJob("reaper", componentMask<Health, Wander>(), 0, [wanderers](JobContext& job) {
+            wanderers->each([&](Entity entity, Health& health, Wander&) {
+                if (health.current == 0) job.commands.destroy(entity);
+            });
+        });
+        simulation.addJob("clock", 0, RESOURCE_WORLD, [this](JobContext& job) {
+            if (player && job.tick > 0 && job.tick % ticksPerDayPhase == 0) {
+                job.commands.defer([this] { world.cycleTime(); });
+            }
+        });
+    }
+
+    // Villagers who walk between locations; they exist only as entities.
+    void spawnWanderers(uint32_t location, int count) {
+        for (int i = 0; i < count; ++i) {
+            entities.create(Health{ 30, 30 }, Named{ nameTable().intern("Villager") }, Wander{ location, (uint32_t)i % ticksPerSecond });
+        }
+    }
+
+    // Systems run in this order every tick; budgets are in milliseconds.
+    void defineSystems() {
+        scheduler.addSystem("input", 2.0, [this](uint64_t) {
+            while (input.pending() && isRunning) {
+                string line = input.pop();
+                if (recorder) recorder->input(scheduler.currentTick(), line);
+                processCommand(line);
+            }
+            if (input.finished()) {
+                isRunning = false;
+            }
+        });
+        scheduler.addSystem("simulation", 8.0, [this](uint64_t tick) {
+            simulation.runTick(tick);
+            events.dispatch();
+        });
+        scheduler.addSystem("streaming", 4.0, [this](uint64_t) {
+            if (player) world.focus(currentLocation);
+        });
+        scheduler.addSystem("autosave", 1.0, [this](uint64_t) {
+            if (player && !replaying) autosaveIfDue();
+        });
+        scheduler.addSystem("render", 2.0, [this](uint64_t) {
+            if (!hosted) screen().present();
+        });
+        scheduler.addSystem("replay", 1.0, [this](uint64_t tick) {
+            if (recorder && tick % checkpointInterval == 0) recorder->checkpoint(tick, stateHash());
+        });
+    }
+
+    // Quest stages; the titles match the quests placed on the starting map.
+    void defineQuests() {
+        auto placeNamed = [this](const string& name) {
+            for (uint32_t i = 0; i < startingMap->locations.size(); ++i) {
+                if (startingMap->locations[i].name == name) return i;
+            }
+            return 0u;
+        };
+        uint32_t elder = questLog.define("Visit the Town Elder");
+        questLog.addStage(elder, { { { QuestTrigger::REACH, placeNamed("Town"), 1 } },
+                                   { "Clear the goblins from the forest", "Bring the elder iron ore" }, { 1, 2 } });
+        questLog.addStage(elder, { { { QuestTrigger::KILL, nameTable().intern("Goblin"), 3 } }, {}, {} });
+        questLog.addStage(elder, { { { QuestTrigger::COLLECT, nameTable().intern("Iron Ore"), 3 } }, {}, {} });
+
+        uint32_t troll = questLog.define("Defeat the Troll");
+        questLog.addStage(troll, { { { QuestTrigger::REACH, placeNamed("Dungeon"), 1 },
+                                     { QuestTrigger::KILL, nameTable().intern("Troll"), 1 } }, {}, {} });
+    }
+
+    // Starts every defined quest whose quest on the map is not completed yet.
+    void startQuests() {
+        questLog.clear();
+        for (uint32_t definition = 0; definition < questLog.definitionCount(); ++definition) {
+            bool finished = false;
+            world.forEachResident([&](uint32_t, const Location& location) {
+                location.forEachQuest([&](const Quest& quest) {
+                    if (quest.title == questLog.definition(definition).title && quest.isCompleted) finished = true;
+                });
+            });
+            if (!finished) questLog.start(definition);
+        }
+        settleQuests();
+    }
+
+    Quest* findQuest(const string& title) {
+        Quest* found = nullptr;
+        world.forEachResident([&](uint32_t, Location& location) {
+            if (!found) found = location.editQuest(title);
+        });
+        return found;
+    }
+
+    // Feeds one game event to the quest engine and applies what it finished.
+    void questEvent(QuestTrigger trigger, uint32_t target, uint32_t amount = 1) {
+        questLog.notify(trigger, target, amount);
+        settleQuests();
+    }
+
+    void settleQuests() {
+        vector<uint32_t> changed;
+        questLog.takeChoices(changed);
+        for (uint32_t id : changed) {
+            const QuestDefinition& definition = questLog.definition(questLog.definitionOf(id));
+            if (Quest* quest = findQuest(definition.title)) {
+                quest->addChoices(questLog.currentStage(id).choices);
+            }
+            screen() << "Quest " << definition.title << " has a decision waiting (menu 11).\n";
+        }
+        questLog.takeCompleted(changed);
+        for (uint32_t definition : changed) {
+            events.post(QuestCompleted{ definition });
+        }
+    }
+
+    // Quest prompt: "<quest> <choice>" to decide a branch, or "back".
+    void questCommand(const string& command) {
+        istringstream words(command);
+        string first;
+        words >> first;
+        if (first == "back") {
+            return;
+        }
+        vector<uint32_t> shown;
+        questLog.forEachActive([&](uint32_t id) { shown.push_back(id); });
+        if (!first.empty()) {
+            size_t number = (size_t)atoi(first.c_str());
+            int choice = 0;
+            words >> choice;
+            if (number < 1 || number > shown.size() || choice < 1 || !questLog.choose(shown[number - 1], choice - 1)) {
+                screen() << "Invalid choice!\n";
+            } else {
+                settleQuests();
+                shown.clear();
+                questLog.forEachActive([&](uint32_t id) { shown.push_back(id); });
+            }
+        }
+        screen() << "Quests:\n";
+        for (size_t i = 0; i < shown.size(); ++i) {
+            uint32_t id = shown[i];
+            const QuestStage& stage = questLog.currentStage(id);
+            screen() << i + 1 << ". " << questLog.definition(questLog.definitionOf(id)).title << "\n";
+            if (questLog.isChoosing(id)) {
+                for (size_t c = 0; c < stage.choices.size(); ++c) {
+                    screen() << "   " << c + 1 << ") " << stage.choices[c] << "\n";
+                }
+                continue;
+            }
+            for (size_t o = 0; o < stage.objectives.size(); ++o) {
+                const QuestObjective& objective = stage.objectives[o];
+                static const char* const verbs[] = { "Defeat", "Collect", "Reach" };
+                string target = objective.trigger == QuestTrigger::REACH ? startingMap->locations[objective.target].name
+                                                                        : nameTable().get(objective.target);
+                screen() << "   " << verbs[(int)objective.trigger] << " " << target << ": " << questLog.progress(id, o)
+                         << "/" << objective.count << "\n";
+            }
+        }
+        screen() << "Quest number and choice number, or back:\n";
+        prompt = Prompt::QUESTS;
+    }
+
+    void defineLoot() {
+        uint32_t common = loot.addTable("common_drops", 1);
+        loot.addItem(common, "healing_potion");
+        loot.addItem(common, "leather_armor");
+        loot.addItem(common, "fireball_scroll");
+        loot.addItem(common, "sword");
+        loot.addItem(common, "iron_ore", 0, 1, 3);
+        loot.addItem(common, "wood", 0, 1, 2);
+        loot.addItem(common, "leather_scrap", 0, 1, 2);
+
+        uint32_t goblin = loot.addTable("Goblin", 1);
+        loot.addSubTable(goblin, common, 40);
+        loot.addNothing(goblin, 60);
+
+        uint32_t troll = loot.addTable("Troll", 2);
+        loot.addGuaranteed(troll, "healing_potion", 1, 2);
+        loot.addSubTable(troll, common, 70);
+        loot.addItem(troll, "sword", 30);
+    }
 
     void start() {
-        cout << "Enter your character's name: ";
-        string name;
-        cin >> name;
+        welcome();
+
+        // Game loop
+        gameLoop();
+    }
+
+    // Asks for the player's name; the next input line answers it.
+    void welcome() {
+        screen() << "Enter your character's name: ";
+        prompt = Prompt::NAME;
+    }
+
+    // Creates the player and the starting world without touching the console.
+    void newGame(const string& name) {
         player = new Character(name);
+        player->attachEvents(&events);
+
+        // Locations start as views of the shared map; see WorldTemplate.
+        for (const auto& place : startingMap->locations) {
+            world.addLocation(Location(place), place.x, place.y);
+        }
+        for (const auto& edge : startingMap->edges) {
+            world.addEdge(edge.from, edge.to, edge.cost);
+        }
+        if (wildernessSize > 0) {
+            addWilderness(wildernessSize);
+        }
+        currentLocation = startingMap->start;
+        spawnWanderers(currentLocation, 8);
+        startQuests();
+        // Whatever save is on disk belongs to another game until this one's
+        // first snapshot replaces it; see autosave().
+        saveSequence = 0;
+        unsaved = true;
+    }
+
+    // A square of procedural locations east of the starting map with a road to
+    // each neighbour and one back to the start. Only the chunks around the
+    // player stay resident; see ProceduralChunkSource.
+    void addWilderness(uint32_t count) {
+        world.setChunkSource(&wilds);
+        uint32_t side = (uint32_t)ceil(sqrt((double)count));
+        uint32_t first = (uint32_t)world.locationCount();
+        for (uint32_t i = 0; i < count; ++i) {
+            world.addLocationNode(wildsOrigin + (i % side) * wildsSpacing, (i / side) * wildsSpacing);
+        }
+        for (uint32_t i = 0; i < count; ++i) {
+            if (i % side + 1 < side && i + 1 < count) world.addEdge(first + i, first + i + 1, wildsSpacing);
+            if (i + side < count) world.addEdge(first + i, first + i + side, wildsSpacing);
+        }
+        const LocationNode& start = world.node(startingMap->start);
+        world.addEdge(startingMap->start, first, wildsOrigin - start.x);
+    }
+
+    // Locations within travelRadius of the player, whether streamed in or not.
+    void showNearby() {
+        const LocationNode& here = world.node(currentLocation);
+        const char* separator = " ";
+        screen() << "Nearby:";
+        for (uint32_t id : world.nearby(here.x, here.y, travelRadius)) {
+            if (id == currentLocation) continue;
+            const Location* location = world.find(id);
+            screen() << separator << id + 1 << ". " << (location ? location->name : "#" + to_string(id + 1));
+            separator = ", ";
+        }
+        screen() << "\n";
+    }
+
+    Character& getPlayer() { return *player; }
+    World& getWorld() { return world; }
+    PathService& getPaths() { return paths; }
+    QuestEngine& getQuestLog() { return questLog; }
+
+    void gameLoop() {
+        scheduler.run(input, [this] { return isRunning; });
+        if (recorder) recorder->finish(scheduler.currentTick(), stateHash());
+        if (player) autosave();
+        screen().present();
+    }
+
+    // Everything replay has to reproduce, folded into one number.
+    uint64_t stateHash() const {
+        uint64_t hash = 0;
+        auto fold = [&](uint64_t value) { hash = CounterRng::mix(hash ^ value); };
+        fold(rng.counter);
+        fold(currentLocation);
+        fold((uint64_t)world.timeOfDay);
+        fold(entities.count());
+        if (player) {
+            fold(player->getHealth());
+            fold(player->getMaxHealth());
+            fold(player->getAttackPower());
+            fold(player->getDefensePower());
+            fold(player->getLevel());
+            fold(player->getExperience());
+            player->getInventory().forEachStack([&](const ItemStack& stack) {
+                fold(((uint64_t)stack.record.nameId << 32) | stack.count);
+            });
+        }
+        Query<Wander> walkers(entities);
+        walkers.each([&](Entity entity, Wander& wander) {
+            fold(((uint64_t)entity.index << 32) | wander.location);
+        });
+        return hash;
+    }
+
+    void setSeed(uint64_t newSeed) {
+        seed = newSeed;
+        rng = CounterRng(seed, 0);
+    }
+
+    bool startRecording(const string& path) {
+        recorder.reset(new ReplayRecorder());
+        if (!recorder->open(path, seed)) {
+            recorder.reset();
+            return false;
+        }
+        return true;
+    }
+
+    // Runs a recorded session headlessly, as fast as possible, checking the state
+    // hash at every checkpoint. Returns false at the first mismatch.
+    bool replay(const string& path) {
+        ReplayReader reader;
+        if (!reader.open(path)) {
+            return false;
+        }
+        setSeed(reader.seed());
+        replaying = true;
+        screen().setLevel(LogLevel::QUIET);
+        auto begin = chrono::steady_clock::now();
+        ReplayRecord record;
+        size_t inputs = 0, checkpoints = 0;
+        bool matched = true, ended = false;
+        while (matched && reader.next(record)) {
+            uint64_t target = record.kind == REPLAY_CHECKPOINT ? record.tick + 1 : record.tick;
+            while (scheduler.currentTick() < target) {
+                scheduler.runTick();
+            }
+            if (record.kind == REPLAY_INPUT) {
+                input.push(record.line);
+                inputs++;
+                continue;
+            }
+            checkpoints++;
+            matched = stateHash() == record.hash;
+            ended = record.kind == REPLAY_END;
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+        screen().discard();
+        screen().setLevel(LogLevel::NORMAL);
+        screen() << "Replayed " << scheduler.currentTick() << " ticks and " << inputs << " inputs in " << ms << " ms; ";
+        if (!matched) {
+            screen() << "state diverged at tick " << record.tick << " (checkpoint " << checkpoints << ").\n";
+        } else {
+            screen() << checkpoints << " checkpoints matched" << (ended ? "" : ", log ends early") << ".\n";
+        }
+        return matched;
+    }
+
+    bool running() const { return isRunning; }
+    uint64_t currentTick() const { return scheduler.currentTick(); }
+
+    // Runs one simulation tick without waiting, for hosts that drive the game themselves.
+    void tick() {
+        scheduler.runTick();
+    }
+
+    void queueInput(const string& line) {
+        input.push(line);
+    }
+
+    void showMenu() {
+        screen() << "\nWhat would you like to do?\n";
+        screen() << "1. View Stats\n";
+        screen() << "2. View Inventory\n";
+        screen() << "3. Travel\n";
+        screen() << "4. Interact with World\n";
+        screen() << "5. Save Game\n";
+        screen() << "6. Load Game\n";
+        screen() << "7. Fight\n";
+        screen() << "8. Exit Game\n";
+        screen() << "9. Performance Report\n";
+        screen() << "10. Craft\n";
+        screen() << "11. Quests\n";
+    }
+
+    // Handles one line of input as the answer to the current prompt.
+    void processCommand(const string& line) {
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos) {
+            return;
+        }
+        string word = line.substr(start, line.find_first_of(" \t", start) - start);
+        int choice = atoi(word.c_str());
+        Prompt current = prompt;
+        prompt = Prompt::MENU;
+        switch (current) {
+            case Prompt::NAME:
+                newGame(word);
+                break;
+            case Prompt::TRAVEL:
+                travelTo(choice);
+                break;
+            case Prompt::INTERACT:
+                world.interactWithLocation(choice - 1);
+                break;
+            case Prompt::QUESTS:
+                questCommand(line.substr(start));
+                break;
+            case Prompt::INVENTORY:
+                browseInventory(line.substr(start));
+                break;
+            case Prompt::CRAFT:
+                craftCommand(line.substr(start));
+                break;
+            case Prompt::MENU:
+                handleMenu(choice);
+                break;
+        }
+        events.dispatch();
+        if (isRunning && prompt == Prompt::MENU) {
+            showMenu();
+        }
+    }
+
+    void handleMenu(int choice) {
+        switch (choice) {
+            case 1:
+                player->displayStats();
+                break;
+            case 2:
+                inventoryPage = 0;
+                browseInventory("");
+                break;
+            case 3:
+                if (wildernessSize == 0) {
+                    world.showMap();  // with a wilderness, thousands of locations are resident
+                }
+                showNearby();
+                screen() << "Where do you want to go? (1-" << world.locationCount() << ")\n";
+                prompt = Prompt::TRAVEL;
+                break;
+            case 4:
+                screen() << "Which location would you like to interact with?\n";
+                prompt = Prompt::INTERACT;
+                break;
+            case 5:
+                saveGame();
+                break;
+            case 6:
+                loadGame();
+                break;
+            case 7:
+                fight();
+                break;
+            case 8:
+                isRunning = false;
+                screen() << "Exiting game...\n";
+                break;
+            case 9:
+                scheduler.report();
+                simulation.report();
+                break;
+            case 10:
+                craftCommand("");
+                break;
+            case 11:
+                questCommand("");
+                break;
+            default:
+                screen() << "Invalid option. Try again.\n";
+                break;
+        }
+    }
+
+    // Inventory prompt: a page number, "sort value|rarity|name", "type <name>|all",
+    // "rarity <0-3>|all", "equip <n>", or "back".
+    void browseInventory(const string& command) {
+        static const char* const typeNames[] = { "weapon", "armor", "potion", "scroll", "trap", "artifact", "material" };
+        string verb = command.substr(0, command.find(' '));
+        string argument = command.find(' ') == string::npos ? "" : command.substr(command.find(' ') + 1);
+        if (verb == "back") {
+            return;
+        }
+        if (verb == "sort") {
+            inventorySort = argument == "rarity" ? InventorySort::RARITY : argument == "name" ? InventorySort::NAME : InventorySort::VALUE;
+            inventoryPage = 0;
+        } else if (verb == "type") {
+            inventoryFilter.type = -1;
+            for (int i = 0; i < (int)ITEM_TYPE_COUNT; ++i) {
+                if (argument == typeNames[i]) inventoryFilter.type = i;
+            }
+            inventoryPage = 0;
+        } else if (verb == "rarity") {
+            inventoryFilter.rarity = argument == "all" ? -1 : max(-1, min(3, atoi(argument.c_str())));
+            inventoryPage = 0;
+        } else if (verb == "equip") {
+            player->equipFromView(atoi(argument.c_str()), inventoryFilter, inventorySort);
+        } else if (verb == "use") {
+            useFromView(atoi(argument.c_str()));
+        } else if (!verb.empty()) {
+            inventoryPage = max(1, atoi(verb.c_str())) - 1;
+        }
+        player->showInventoryPage(inventoryPage, inventoryFilter, inventorySort);
+        screen() << "Page number, sort value|rarity|name, type <type>|all, rarity <0-3>|all, equip <n>, use <n>, or back:\n";
+        prompt = Prompt::INVENTORY;
+    }
+
+    // Uses an item from the current inventory view. A Fireball scroll also hits
+    // everything at the player's location.
+    void useFromView(size_t number) {
+        ItemRecord used;
+        if (!player->useFromView(number, inventoryFilter, inventorySort, used)) {
+            return;
+        }
+        if (used.type == ItemType::SCROLL && used.skill == Skill::FIREBALL) {
+            castFireball();
+        }
+    }
+
+    void castFireball() {
+        vector<uint32_t> defeated;
+        int count = world.at(currentLocation).applyAreaDamage(fireballDamage, defeated);
+        screen() << "The blast defeats " << count << (count == 1 ? " enemy" : " enemies") << ".\n";
+        for (uint32_t nameId : defeated) {
+            events.post(EnemyDefeated{ nameId, currentLocation, areaKillExperience });
+        }
+    }
+
+    // Crafting prompt: "<recipe> [count|max]", "combine <item key>...", or "back".
+    void craftCommand(const string& command) {
+        istringstream words(command);
+        string verb;
+        words >> verb;
+        if (verb == "back") {
+            return;
+        }
+        if (verb == "combine") {
+            vector<uint32_t> prototypes;
+            for (string key; words >> key;) {
+                prototypes.push_back(content->findItem(key));
+            }
+            uint32_t recipe = crafting.match(prototypes);
+            if (recipe == UINT32_MAX) {
+                screen() << "Those items do not make anything.\n";
+            } else if (!crafting.craft(*player, recipe, 1)) {
+                screen() << "You do not have those items.\n";
+            } else {
+                uint32_t made = content->item(crafting.output(recipe)).record.nameId;
+                screen() << "Crafted " << nameTable().get(made) << "\n";
+                events.post(ItemAcquired{ made, crafting.outputCount(recipe) });
+            }
+        } else if (!verb.empty()) {
+            uint32_t recipe = (uint32_t)atoi(verb.c_str()) - 1;
+            string amount;
+            words >> amount;
+            if (recipe >= crafting.recipeCount()) {
+                screen() << "Invalid recipe!\n";
+            } else {
+                uint64_t wanted = amount == "max" ? UINT64_MAX / 2 : (uint64_t)max(1, atoi(amount.c_str()));
+                uint64_t crafted = crafting.craft(*player, recipe, wanted);
+                uint32_t made = content->item(crafting.output(recipe)).record.nameId;
+                screen() << "Crafted " << crafted * crafting.outputCount(recipe) << " x " << nameTable().get(made) << "\n";
+                if (crafted) events.post(ItemAcquired{ made, (uint32_t)(crafted * crafting.outputCount(recipe)) });
+            }
+        }
+        vector<CraftStep> steps;
+        screen() << "Recipes:\n";
+        for (uint32_t recipe = 0; recipe < crafting.recipeCount(); ++recipe) {
+            screen() << recipe + 1 << ". " << nameTable().get(content->item(crafting.output(recipe)).record.nameId) << " <-";
+            for (const auto& ingredient : crafting.ingredients(recipe)) {
+                screen() << " " << ingredient.count << "x " << nameTable().get(content->item(ingredient.prototype).record.nameId);
+            }
+            screen() << " (can make " << crafting.plan(*player, recipe, UINT64_MAX / 2, steps) << ")\n";
+        }
+        screen() << "Recipe number with a count or max, combine <item key>..., or back:\n";
+        prompt = Prompt::CRAFT;
+    }
+
+    void travelTo(int choice) {
+        if (choice < 1 || choice > (int)world.locationCount()) {
+            screen() << "Invalid location.\n";
+            return;
+        }
+        vector<uint32_t> route;
+        float distance = 0;
+        if (!paths.route(currentLocation, choice - 1, route, &distance)) {
+            screen() << "There is no road there.\n";
+            return;
+        }
+        screen() << "Route:";
+        for (uint32_t step : route) {
+            const Location* location = world.find(step);
+            screen() << (step == route.front() ? " " : " -> ") << (location ? location->name : "#" + to_string(step + 1));
+        }
+        screen() << " (distance " << distance << ")\n";
+        currentLocation = choice - 1;
+        world.focus(currentLocation);
+        screen() << "You arrive at " << world.at(currentLocation).name << ".\n";
+        questEvent(QuestTrigger::REACH, currentLocation);
+    }
+
+    // Fights the first enemy still standing here, trading blows until one falls.
+    void fight() {
+        Location& location = world.at(currentLocation);
+        Enemy* enemy = location.nextEnemy();
+        if (!enemy) {
+            screen() << "There is nothing to fight here.\n";
+            return;
+        }
+        location.dirty = true;
+        while (enemy->isAlive() && player->getHealth() > 0) {
+            if (player->isStunned()) {
+                screen() << player->getName() << " is stunned!\n";
+            } else {
+                enemy->takeDamage(player->effectiveAttack());
+            }
+            if (enemy->isAlive()) {
+                enemy->attack(*player);
+                enemy->useAbility(*player);
+            }
+            statusEngine().advance();
+            player->applyStatus();
+            enemy->applyStatus();
+        }
+        enemy->clearStatus();
+        if (player->getHealth() == 0) {
+            screen() << "You have been defeated by the " << enemy->getName() << "!\n";
+            isRunning = false;
+            return;
+        }
+        screen() << "You defeated the " << enemy->getName() << "!\n";
+        events.post(EnemyDefeated{ nameTable().intern(enemy->getName()), currentLocation, 50 });
+    }
+
+    void dropLoot(uint32_t enemyNameId) {
+        uint32_t table = loot.tableFor(enemyNameId);
+        if (table == UINT32_MAX) return;
+        vector<LootDrop> drops;
+        loot.roll(table, rng, drops);
+        for (const auto& drop : drops) {
+            const ItemRecord& found = content->item(drop.prototype).record;
+            for (uint32_t i = 0; i < drop.count; ++i) {
+                screen() << "You found " << nameTable().get(found.nameId) << ".\n";
+                player->addItem(found);
+                events.post(ItemAcquired{ found.nameId, 1 });
+            }
+        }
+    }
+
+    LootSystem& getLoot() { return loot; }
+    JobGraph& getSimulation() { return simulation; }
+
+    void saveGame() {
+        saveSnapshot();
+        screen() << "Game saved.\n";
+    }
+
+    // Queues a full snapshot; the writer replaces savegame.bin and resets the journal.
+    void saveSnapshot() {
+        SaveWriter writer;
+        writer.addCharacter(*player, world);
+        writer.addQuestLog(questLog);
+        writer.addWorld(world);
+        wilds.addTo(writer, world);
+        autosaver.replaceSnapshot(writer.finish(saveSequence));
+        markAllClean();
+        unsaved = false;
+        autosavesSinceSnapshot = 0;
+        lastAutosave = chrono::steady_clock::now();
+    }
+
+    // Called from the game loop; journals whatever changed once the interval is up.
+    void autosaveIfDue() {
+        if (chrono::steady_clock::now() - lastAutosave >= chrono::seconds(autosaveIntervalSeconds)) {
+            autosave();
+        }
+    }
+
+    void autosave() {
+        if (unsaved) {
+            // Journal records only make sense on top of this game's own snapshot;
+            // appended to an older game's journal they would be skipped on load.
+            saveSnapshot();
+            return;
+        }
+        lastAutosave = chrono::steady_clock::now();
+        uint32_t sequence = saveSequence + 1;
+        vector<char> batch;
+        if (player->isDirty() || world.dirty) {
+            SaveWriter writer;
+            writer.addCharacter(*player, world);
+            appendJournalRecord(batch, RECORD_CHARACTER, 0, sequence, writer.finish(sequence));
+            player->markClean();
+            world.dirty = false;
+        }
+        if (questLog.hasChanges()) {
+            SaveWriter writer;
+            writer.addQuestLog(questLog);
+            appendJournalRecord(batch, RECORD_QUESTS, 0, sequence, writer.finish(sequence));
+            questLog.markClean();
+        }
+        // Changed locations that were streamed out since the last autosave.
+        wilds.takeUnjournaled([&](uint32_t id) {
+            SaveWriter writer;
+            if (wilds.copyTo(writer, world, id)) {
+                appendJournalRecord(batch, RECORD_LOCATION, id, sequence, writer.finish(sequence));
+            }
+        });
+        world.forEachResident([&](uint32_t id, Location& location) {
+            if (location.hasChanges()) {
+                SaveWriter writer;
+                writer.addLocation(world, id, location);
+                appendJournalRecord(batch, RECORD_LOCATION, id, sequence, writer.finish(sequence));
+                location.markClean();
+            }
+        });
+        if (batch.empty()) {
+            return;
+        }
+        saveSequence = sequence;
+        autosaver.appendBatch(move(batch));
+        if (++autosavesSinceSnapshot >= autosavesPerSnapshot) {
+            saveSnapshot();
+        }
+    }
+
+    void markAllClean() {
+        player->markClean();
+        world.dirty = false;
+        questLog.markClean();
+        world.forEachResident([](uint32_t, Location& location) {
+            location.markClean();
+        });
+        wilds.markJournaled();
+    }
+
+    void applyCharacter(const SaveView& save) {
+        uint32_t characterCount, itemCount, skillCount;
+        const SavedCharacter* characters = save.section<SavedCharacter>(SECTION_CHARACTER, characterCount);
+        const SavedItem* items = save.section<SavedItem>(SECTION_ITEMS, itemCount);
+        const SavedSkill* skills = save.section<SavedSkill>(SECTION_SKILLS, skillCount);
+        if (characterCount != 1) {
+            return;
+        }
+
+        const SavedCharacter& saved = characters[0];
+        Character* loaded = new Character(save.str(saved.name));
+        loaded->attachEvents(&events);
+        ItemRecord weapon, armor;
+        for (uint32_t i = 0; i < saved.itemCount; ++i) {
+            ItemRecord record = makeItem(save, items[saved.firstItem + i]);
+            if ((int32_t)i == saved.equippedWeapon) weapon = record;
+            if ((int32_t)i == saved.equippedArmor) armor = record;
+            loaded->addItem(record);
+        }
+        for (uint32_t i = 0; i < saved.skillCount; ++i) {
+            loaded->getSkillLevels()[(Skill)skills[saved.firstSkill + i].skill] = skills[saved.firstSkill + i].level;
+        }
+        loaded->restore(saved.health, saved.maxHealth, saved.attackPower, saved.defensePower, saved.level, saved.experience,
+                        saved.equippedWeapon >= 0 ? &weapon : nullptr, saved.equippedArmor >= 0 ? &armor : nullptr);
+        delete player;
+        player = loaded;
+        world.timeOfDay = (TimeOfDay)saved.timeOfDay;
+    }
+
+    // Replaces the running quests with the saved ones. A quest whose definition
+    // or stage no longer exists is dropped.
+    void applyQuests(const SaveView& save) {
+        uint32_t stateCount, progressCount;
+        const SavedQuestState* states = save.section<SavedQuestState>(SECTION_QUEST_STATES, stateCount);
+        const uint32_t* progress = save.section<uint32_t>(SECTION_QUEST_PROGRESS, progressCount);
+        questLog.clear();
+        for (uint32_t i = 0; i < stateCount; ++i) {
+            string title = save.str(states[i].title);
+            for (uint32_t definition = 0; definition < questLog.definitionCount(); ++definition) {
+                if (questLog.definition(definition).title != title) continue;
+                if (states[i].stage < questLog.definition(definition).stages.size()) {
+                    questLog.resume(definition, states[i].stage, progress + states[i].firstProgress, states[i].progressCount,
+                                    states[i].isChoosing != 0);
+                }
+                break;
+            }
+        }
+    }
+
+    Location makeLocation(const SaveView& save, const SavedLocation& saved) {
+        uint32_t itemCount, questCount, choiceCount, enemyCount;
+        const SavedItem* items = save.section<SavedItem>(SECTION_ITEMS, itemCount);
+        const SavedQuest* quests = save.section<SavedQuest>(SECTION_QUESTS, questCount);
+        const SavedString* choices = save.section<SavedString>(SECTION_CHOICES, choiceCount);
+        const SavedEnemy* enemies = save.section<SavedEnemy>(SECTION_ENEMIES, enemyCount);
+
+        Location location(save.str(saved.name));
+        for (uint32_t e = 0; e < saved.enemyCount; ++e) {
+            const SavedEnemy& enemy = enemies[saved.firstEnemy + e];
+            location.addEnemy(Enemy(save.str(enemy.name), enemy.health, enemy.attackPower));
+        }
+        for (uint32_t e = 0; e < saved.hordeCount; ++e) {
+            const SavedEnemy& enemy = enemies[saved.firstHorde + e];
+            location.horde.add(nameTable().intern(save.str(enemy.name)), enemy.health, enemy.attackPower);
+        }
+        for (uint32_t q = 0; q < saved.questCount; ++q) {
+            const SavedQuest& savedQuest = quests[saved.firstQuest + q];
+            Quest quest(save.str(savedQuest.title), save.str(savedQuest.description), (QuestType)savedQuest.type, savedQuest.rewardExp);
+            quest.isCompleted = savedQuest.isCompleted;
+            for (uint32_t c = 0; c < savedQuest.choiceCount; ++c) {
+                quest.choices.push_back(save.str(choices[savedQuest.firstChoice + c]));
+            }
+            location.addQuest(quest);
+        }
+        for (uint32_t t = 0; t < saved.itemCount; ++t) {
+            location.addItem(makeItem(save, items[saved.firstItem + t]));
+        }
+        return location;
+    }
+
+    // Applies intact journal records newer than the snapshot. Stops at the first
+    // torn or corrupt record, which can only be the tail of an interrupted write.
+    bool replayJournal(uint32_t snapshotSequence) {
+        ifstream inFile(autosaver.journalFile(), ios::binary | ios::ate);
+        if (!inFile) {
+            return false;
+        }
+        size_t size = (size_t)inFile.tellg();
+        vector<uint64_t> buffer((size + 7) / 8);  // keeps records 8-byte aligned
+        inFile.seekg(0);
+        inFile.read((char*)buffer.data(), size);
+        const char* data = (const char*)buffer.data();
+
+        bool applied = false;
+        size_t offset = 0;
+        while (offset + sizeof(JournalRecord) <= size) {
+            JournalRecord record;
+            memcpy(&record, data + offset, sizeof(record));
+            const char* payload = data + offset + sizeof(record);
+            if (record.size > size - offset - sizeof(record) || fnv1a(payload, record.size) != record.checksum) {
+                break;
+            }
+            offset += sizeof(record) + record.size;
+            if (record.sequence <= snapshotSequence) {
+                continue;
+            }
+
+            SaveView view;
+            if (!view.open(payload, record.size)) {
+                break;
+            }
+            if (record.kind == RECORD_CHARACTER) {
+                applyCharacter(view);
+            } else if (record.kind == RECORD_QUESTS) {
+                applyQuests(view);
+            } else if (record.kind == RECORD_LOCATION) {
+                uint32_t count;
+                const SavedLocation* saved = view.section<SavedLocation>(SECTION_LOCATIONS, count);
+                if (count == 1 && locationIdsFit(saved, count)) {
+                    world.restoreLocation(saved[0].id, saved[0].x, saved[0].y, makeLocation(view, saved[0]));
+                }
+            }
+            saveSequence = max(saveSequence, record.sequence);
+            applied = true;
+        }
+        return applied;
+    }
+
+    // A save can add locations past the end of the world, one per saved location
+    // at most; an ID further out than that is corrupt, not a world to grow into.
+    bool locationIdsFit(const SavedLocation* locations, uint32_t count) const {
+        for (uint32_t i = 0; i < count; ++i) {
+            if ((uint64_t)locations[i].id >= (uint64_t)world.locationCount() + count) return false;
+        }
+        return true;
+    }
+
+    void loadGame() {
+        autosaver.flush();
+        uint32_t snapshotSequence = 0;
+        bool loaded = false;
+        {
+            SaveView save;
+            uint32_t locationCount = 0;
+            const SavedLocation* locations = nullptr;
+            if (save.open(autosaver.snapshotFile().c_str())) {
+                locations = save.section<SavedLocation>(SECTION_LOCATIONS, locationCount);
+            }
+            if (locations && !locationIdsFit(locations, locationCount)) {
+                save.close();
+            }
+            if (save.isOpen()) {
+                applyCharacter(save);
+                applyQuests(save);
+                for (uint32_t i = 0; i < locationCount; ++i) {
+                    world.restoreLocation(locations[i].id, locations[i].x, locations[i].y, makeLocation(save, locations[i]));
+                }
+                snapshotSequence = save.header().sequence;
+                loaded = true;
+            }
+        }
+        saveSequence = snapshotSequence;
+        if (replayJournal(snapshotSequence)) {
+            loaded = true;
+        }
+        if (!loaded) {
+            screen() << "No saved game found.\n";
+            return;
+        }
+        // Hands out decisions the saved quests were still waiting on.
+        settleQuests();
+        markAllClean();
+        unsaved = false;
+        screen() << "Game loaded.\n";
+    }
+
+    ~Game() {
+        delete player;
+    }
+};
 
-        // Adding Locations and Quests to World
-        Location town("Town");
-        Location dungeon("Dungeon");
+// Game Server
+// Hosts many independent games in one process. The listening thread accepts
+// connections and deals them round-robin to workers. Each worker thread is
+// pinned to a core and keeps its sessions for life, watching their sockets with
+// its own epoll set. A session is a hosted Game with its own registry and status
+// engine, installed with SessionScope whenever the worker runs it; the sessions
+// of one worker share a name table and a content pack, and all sessions share
+// one save queue. Lines read from a socket are queued as the
+// game's input and handled by an immediate tick, and the frame that tick drew is
+// written back. Sessions that had input in the last few seconds keep ticking at
+// the game rate so effects and the clock run; idle ones cost only memory.
+class GameServer {
+private:
+    static constexpr int ticksPerSecond = 60;
+    static constexpr size_t maxOutbox = 1 << 20;  // a client this far behind is dropped
+    static constexpr size_t latencySamples = 1 << 16;
+
+    struct Session {
+        int fd;
+        Registry entities;
+        StatusEngine effects;
+        unique_ptr<Game> game;
+        string partial;  // input after the last newline
+        string outbox;   // output the socket has not taken yet
+        chrono::steady_clock::time_point lastInput;
+        bool active = false;
+        bool writing = false;  // EPOLLOUT is armed
+        bool closing = false;
+    };
+
+    struct Worker {
+        int index;
+        int epollFd;
+        int wakeFd;
+        thread runner;
+        mutex lock;                              // guards arrivals and latencies
+        vector<pair<int, uint64_t>> arrivals;    // new sockets and their session IDs
+        vector<float> latencies;                 // microseconds, latest samples
+        size_t latencyCount = 0;
+        atomic<size_t> sessionCount{ 0 };
+        atomic<size_t> activeCount{ 0 };
+        StringPool names;
+        shared_ptr<const ContentPack> content;  // interned into names
+        unordered_map<int, unique_ptr<Session>> sessions;
+        vector<Session*> active;
+    };
+
+    shared_ptr<SaveQueue> saves;
+    vector<unique_ptr<Worker>> workers;
+    int listenFd;
+    bool tcp;
+    atomic<bool> stopping;
+    uint64_t nextSession;
+    size_t nextWorker;
+
+    static void pin(int index) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % max(1u, thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
 
-        town.addQuest(Quest("Visit the Town Elder", "Speak with the elder in town.", QuestType::MAIN));
-        dungeon.addQuest(Quest("Defeat the Troll", "Defeat the troll guarding the dungeon.", QuestType::SIDE));
+    static void wake(Worker& worker) {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(worker.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
 
-        world.addLocation(town);
-        world.addLocation(dungeon);
+    // Runs one tick of the session's game and keeps what it drew.
+    void step(Worker& worker, Session& session) {
+        SessionScope scope(session.entities, session.effects, worker.names);
+        session.game->tick();
+        session.outbox += screen().take();
+        if (!session.game->running()) {
+            session.closing = true;
+        }
+    }
 
-        // Add Items and Enemies to Locations
-        town.addItem(new Potion("Healing Potion", 30, Rarity::COMMON, 50));
-        dungeon.addItem(new Weapon("Sword", 100, Rarity::RARE, 30));
-        dungeon.addEnemy(Enemy("Troll", 100, 30));
+    void flush(Worker& worker, Session& session) {
+        size_t written = 0;
+        while (written < session.outbox.size()) {
+            ssize_t n = ::send(session.fd, session.outbox.data() + written, session.outbox.size() - written, MSG_NOSIGNAL);
+            if (n > 0) {
+                written += n;
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                session.closing = true;
+                written = session.outbox.size();
+            }
+        }
+        session.outbox.erase(0, written);
+        if (session.outbox.size() > maxOutbox) {
+            session.outbox.clear();
+            session.closing = true;
+        }
+        bool waiting = !session.outbox.empty();
+        if (waiting != session.writing) {
+            epoll_event event = { (uint32_t)(EPOLLIN | EPOLLRDHUP) | (waiting ? (uint32_t)EPOLLOUT : (uint32_t)0), {} };
+            event.data.fd = session.fd;
+            epoll_ctl(worker.epollFd, EPOLL_CTL_MOD, session.fd, &event);
+            session.writing = waiting;
+        }
+    }
 
-        // Game loop
-        gameLoop();
+    void closeSession(Worker& worker, int fd) {
+        auto found = worker.sessions.find(fd);
+        if (found == worker.sessions.end()) return;
+        Session& session = *found->second;
+        if (session.active) {
+            worker.active.erase(std::find(worker.active.begin(), worker.active.end(), &session));
+        }
+        {
+            SessionScope scope(session.entities, session.effects, worker.names);
+            session.game.reset();
+            screen().discard();
+        }
+        epoll_ctl(worker.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        worker.sessions.erase(found);
+        worker.sessionCount = worker.sessions.size();
+        worker.activeCount = worker.active.size();
     }
 
-    void gameLoop() {
-        while (isRunning) {
-            cout << "\nWhat would you like to do?\n";
-            cout << "1. View Stats\n";
-            cout << "2. View Inventory\n";
-            cout << "3. Travel\n";
-            cout << "4. Interact with World\n";
-            cout << "5. Exit Game\n";
-            int choice;
-            cin >> choice;
+    void acceptArrivals(Worker& worker) {
+        uint64_t count;
+        ssize_t ignored = ::read(worker.wakeFd, &count, sizeof(count));
+        (void)ignored;
+        vector<pair<int, uint64_t>> arrivals;
+        {
+            lock_guard<mutex> guard(worker.lock);
+            arrivals.swap(worker.arrivals);
+        }
+        for (const auto& arrival : arrivals) {
+            unique_ptr<Session> session(new Session());
+            session->fd = arrival.first;
+            {
+                SessionScope scope(session->entities, session->effects, worker.names);
+                GameConfig config;
+                config.saveName = "session-" + to_string(arrival.second);
+                config.simulationThreads = 1;  // the worker threads are the parallelism
+                config.hosted = true;
+                config.saves = saves;
+                config.content = worker.content;
+                session->game.reset(new Game(config));
+                session->game->welcome();
+                session->outbox = screen().take();
+            }
+            epoll_event event = { EPOLLIN | EPOLLRDHUP, {} };
+            event.data.fd = arrival.first;
+            epoll_ctl(worker.epollFd, EPOLL_CTL_ADD, arrival.first, &event);
+            Session& added = *session;
+            worker.sessions[arrival.first] = move(session);
+            flush(worker, added);
+        }
+        worker.sessionCount = worker.sessions.size();
+    }
 
-            switch (choice) {
-                case 1:
-                    player->displayStats();
-                    break;
-                case 2:
-                    player->showInventory();
-                    break;
-                case 3:
-                    world.showMap();
-                    break;
-                case 4:
-                    cout << "Which location would you like to interact with?\n";
-                    int locationChoice;
-                    cin >> locationChoice;
-                    world.interactWithLocation(locationChoice - 1, *player);
-                    break;
-                case 5:
-                    isRunning = false;
-                    cout << "Exiting game..." << endl;
-                    break;
-                default:
-                    cout << "Invalid option. Try again." << endl;
-                    break;
+    // Reads everything available; if that completed any lines, answers them now.
+    void readSession(Worker& worker, Session& session) {
+        char buffer[4096];
+        bool gotLines = false;
+        while (true) {
+            ssize_t got = ::read(session.fd, buffer, sizeof(buffer));
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+            if (got <= 0) {
+                session.closing = true;
+                break;
+            }
+            session.partial.append(buffer, got);
+            size_t start = 0;
+            for (size_t end; (end = session.partial.find('\n', start)) != string::npos; start = end + 1) {
+                string line = session.partial.substr(start, end - start);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                session.game->queueInput(line);
+                gotLines = true;
+            }
+            session.partial.erase(0, start);
+        }
+        if (!gotLines) {
+            return;
+        }
+        auto received = chrono::steady_clock::now();
+        step(worker, session);
+        flush(worker, session);
+        float micros = chrono::duration<float, micro>(chrono::steady_clock::now() - received).count();
+        {
+            lock_guard<mutex> guard(worker.lock);
+            if (worker.latencies.size() < latencySamples) {
+                worker.latencies.push_back(micros);
+            } else {
+                worker.latencies[worker.latencyCount % latencySamples] = micros;
             }
+            worker.latencyCount++;
+        }
+        session.lastInput = received;
+        if (!session.active) {
+            session.active = true;
+            worker.active.push_back(&session);
+            worker.activeCount = worker.active.size();
         }
     }
 
-    ~Game() {
-        delete player;
+    void tickActive(Worker& worker, chrono::steady_clock::time_point now) {
+        vector<int> finished;
+        for (size_t i = 0; i < worker.active.size();) {
+            Session& session = *worker.active[i];
+            if (now - session.lastInput > chrono::seconds(activeSeconds)) {
+                session.active = false;
+                worker.active[i] = worker.active.back();
+                worker.active.pop_back();
+                continue;
+            }
+            step(worker, session);
+            if (!session.outbox.empty()) flush(worker, session);
+            if (session.closing && session.outbox.empty()) finished.push_back(session.fd);
+            i++;
+        }
+        for (int fd : finished) {
+            closeSession(worker, fd);
+        }
+        worker.activeCount = worker.active.size();
+    }
+
+    void runWorker(Worker& worker) {
+        pin(worker.index);
+        epoll_event events[256];
+        const auto step = chrono::microseconds(1000000 / ticksPerSecond);
+        auto nextTick = chrono::steady_clock::now() + step;
+        while (!stopping) {
+            int timeout = 1000;
+            if (!worker.active.empty()) {
+                auto wait = chrono::duration_cast<chrono::milliseconds>(nextTick - chrono::steady_clock::now()).count();
+                timeout = (int)max<int64_t>(0, wait);
+            }
+            int count = epoll_wait(worker.epollFd, events, 256, timeout);
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == worker.wakeFd) {
+                    acceptArrivals(worker);
+                    continue;
+                }
+                auto found = worker.sessions.find(fd);
+                if (found == worker.sessions.end()) continue;
+                Session& session = *found->second;
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) readSession(worker, session);
+                if (events[i].events & EPOLLOUT) flush(worker, session);
+                if (session.closing && (session.outbox.empty() || events[i].events & (EPOLLHUP | EPOLLERR))) {
+                    closeSession(worker, fd);
+                }
+            }
+            auto now = chrono::steady_clock::now();
+            if (now >= nextTick) {
+                if (!worker.active.empty()) tickActive(worker, now);
+                nextTick += step;
+                if (nextTick < now) nextTick = now + step;
+            }
+        }
+        while (!worker.sessions.empty()) {
+            closeSession(worker, worker.sessions.begin()->first);
+        }
+    }
+
+    bool listenOn(int fd, const sockaddr* address, socklen_t size) {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, address, size) < 0 || listen(fd, SOMAXCONN) < 0) {
+            screen() << "Could not listen: " << strerror(errno) << "\n";
+            ::close(fd);
+            return false;
+        }
+        listenFd = fd;
+        return true;
+    }
+
+public:
+    // A session keeps ticking on its own this long after its last input.
+    static constexpr int activeSeconds = 5;
+
+    GameServer(int workerCount)
+        : saves(make_shared<SaveQueue>()), listenFd(-1), tcp(false), stopping(false), nextSession(1), nextWorker(0) {
+        for (int i = 0; i < max(1, workerCount); ++i) {
+            unique_ptr<Worker> worker(new Worker());
+            worker->index = i;
+            {
+                SessionScope scope(registry(), statusEngine(), worker->names);
+                worker->content = loadContentPack();
+            }
+            worker->epollFd = epoll_create1(EPOLL_CLOEXEC);
+            worker->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            epoll_event event = { EPOLLIN, {} };
+            event.data.fd = worker->wakeFd;
+            epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &event);
+            workers.push_back(move(worker));
+        }
+        for (auto& worker : workers) {
+            Worker* self = worker.get();
+            worker->runner = thread([this, self]() { runWorker(*self); });
+        }
+    }
+
+    GameServer(const GameServer&) = delete;
+    GameServer& operator=(const GameServer&) = delete;
+
+    ~GameServer() {
+        stop();
+        for (auto& worker : workers) {
+            worker->runner.join();
+            ::close(worker->epollFd);
+            ::close(worker->wakeFd);
+        }
+        if (listenFd >= 0) ::close(listenFd);
+    }
+
+    // Listens on 127.0.0.1; port 0 picks a free one (see port()).
+    bool listenTcp(int port) {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        tcp = true;
+        return listenOn(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), (const sockaddr*)&address, sizeof(address));
+    }
+
+    bool listenUnix(const string& path) {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+        unlink(path.c_str());
+        tcp = false;
+        return listenOn(socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), (const sockaddr*)&address, sizeof(address));
+    }
+
+    int port() const {
+        sockaddr_in address = {};
+        socklen_t size = sizeof(address);
+        getsockname(listenFd, (sockaddr*)&address, &size);
+        return ntohs(address.sin_port);
+    }
+
+    // Accepts connections until stop(); reports every reportSeconds if nonzero.
+    void run(int reportSeconds = 0) {
+        auto lastReport = chrono::steady_clock::now();
+        while (!stopping) {
+            pollfd watch = { listenFd, POLLIN, 0 };
+            if (poll(&watch, 1, 200) > 0) {
+                int fd;
+                while ((fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    if (tcp) {
+                        int yes = 1;
+                        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+                    }
+                    Worker& worker = *workers[nextWorker++ % workers.size()];
+                    {
+                        lock_guard<mutex> guard(worker.lock);
+                        worker.arrivals.push_back({ fd, nextSession++ });
+                    }
+                    wake(worker);
+                }
+            }
+            if (reportSeconds > 0 && chrono::steady_clock::now() - lastReport >= chrono::seconds(reportSeconds)) {
+                report();
+                screen().present();
+                lastReport = chrono::steady_clock::now();
+            }
+        }
+    }
+
+    void stop() {
+        stopping = true;
+        for (auto& worker : workers) {
+            wake(*worker);
+        }
+    }
+
+    size_t sessionCount() const {
+        size_t total = 0;
+        for (const auto& worker : workers) total += worker->sessionCount;
+        return total;
+    }
+
+    // Sessions, and command latency (read to reply written) over recent commands.
+    void report() {
+        vector<float> samples;
+        size_t sessions = 0, active = 0, commands = 0;
+        for (auto& worker : workers) {
+            lock_guard<mutex> guard(worker->lock);
+            samples.insert(samples.end(), worker->latencies.begin(), worker->latencies.end());
+            sessions += worker->sessionCount;
+            active += worker->activeCount;
+            commands += worker->latencyCount;
+        }
+        screen() << "Server: " << sessions << " sessions (" << active << " active) on " << workers.size()
+                 << " workers, " << commands << " commands\n";
+        if (samples.empty()) return;
+        auto percentile = [&](double fraction) {
+            size_t at = min(samples.size() - 1, (size_t)(fraction * samples.size()));
+            nth_element(samples.begin(), samples.begin() + at, samples.end());
+            return samples[at];
+        };
+        screen() << "Command latency: p50 " << percentile(0.50) << " us, p99 " << percentile(0.99) << " us, max "
+                 << *max_element(samples.begin(), samples.end()) << " us\n";
     }
 };
 
-int main() {
-    Game game;
+// Compares the Item* path (a dynamic_cast per item, as the class hierarchy needs)
+// against ItemRecord table dispatch for summing equipment stats.
+void benchmarkItemDispatch(int itemCount, int rounds) {
+    vector<Item*> items;
+    for (int i = 0; i < itemCount; ++i) {
+        switch (i % 4) {
+            case 0: items.push_back(new Weapon("Sword", 10, Rarity::COMMON, i % 50)); break;
+            case 1: items.push_back(new Armor("Shield", 10, Rarity::COMMON, i % 30)); break;
+            case 2: items.push_back(new Potion("Potion", 5, Rarity::COMMON, 20)); break;
+            default: items.push_back(new Scroll("Scroll", 40, Rarity::RARE, Skill::FIREBALL)); break;
+        }
+    }
+    vector<ItemRecord> records;
+    for (auto* item : items) {
+        records.push_back(toRecord(item));
+    }
+
+    long long virtualTotal = 0;
+    auto begin = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (auto* item : items) {
+            if (Weapon* weapon = dynamic_cast<Weapon*>(item)) {
+                virtualTotal += weapon->attackPower;
+            } else if (Armor* armor = dynamic_cast<Armor*>(item)) {
+                virtualTotal += armor->defensePower;
+            }
+        }
+    }
+    double virtualSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    long long recordTotal = 0;
+    begin = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        EquipmentStats stats = aggregateStats(records.data(), records.size());
+        recordTotal += stats.attackPower + stats.defensePower;
+    }
+    double recordSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    double lookups = (double)itemCount * rounds;
+    screen() << "dynamic_cast path: " << virtualSeconds * 1e9 / lookups << " ns/item (checksum " << virtualTotal << ")\n";
+    screen() << "ItemRecord path: " << recordSeconds * 1e9 / lookups << " ns/item (checksum " << recordTotal << ")\n";
+    for (auto* item : items) {
+        delete item;
+    }
+}
+
+// Compares a damage pass through Enemy facades stored in a vector (one registry
+// lookup per call) against a Query over the dense Health and Combat columns.
+void benchmarkEntities(int enemyCount, int rounds) {
+    LogLevel previous = screen().quiet() ? LogLevel::QUIET : LogLevel::NORMAL;
+    screen().setLevel(LogLevel::QUIET);
+    vector<Enemy> enemies;
+    enemies.reserve(enemyCount);
+    for (int i = 0; i < enemyCount; ++i) {
+        enemies.push_back(Enemy(i % 2 ? "Troll" : "Goblin", 1000000, 10));
+    }
+
+    auto begin = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        for (auto& enemy : enemies) {
+            enemy.takeDamage(3);
+        }
+    }
+    double facadeSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    Query<Health, Combat> combatants;
+    begin = chrono::steady_clock::now();
+    for (int round = 0; round < rounds; ++round) {
+        combatants.each([](Entity, Health& health, Combat& combat) {
+            health.current = max(0, health.current - max(0, 3 - combat.defense));
+        });
+    }
+    double querySeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    screen().setLevel(previous);
+
+    double updates = (double)enemyCount * rounds;
+    screen() << "Enemy facade path: " << facadeSeconds * 1e9 / updates << " ns/enemy\n";
+    screen() << "Query path: " << querySeconds * 1e9 / updates << " ns/enemy (health " << enemies[0].getHealth() << ")\n";
+}
+
+// Gives a character the given number of each raw material and times planning
+// and running "craft max" for iron swords, which smelts ingots and makes hilts first.
+void benchmarkCrafting(int materials) {
+    ContentPack content;
+    content.loadText(DEFAULT_CONTENT);
+    CraftingSystem crafting(content);
+    addDefaultRecipes(crafting);
+    Character player("Smith");
+    for (const char* key : { "iron_ore", "wood", "leather_scrap" }) {
+        player.addItem(content.item(content.findItem(key)).record, materials);
+    }
+
+    uint32_t swordRecipe = crafting.match({ content.findItem("iron_ingot"), content.findItem("iron_ingot"), content.findItem("sword_hilt") });
+    vector<CraftStep> steps;
+    auto begin = chrono::steady_clock::now();
+    uint64_t planned = crafting.plan(player, swordRecipe, UINT64_MAX / 2, steps);
+    double planSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    begin = chrono::steady_clock::now();
+    uint64_t crafted = crafting.craft(player, swordRecipe, UINT64_MAX / 2);
+    double craftSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    screen() << "Planned " << planned << " iron swords in " << steps.size() << " steps: " << planSeconds * 1e6 << " us\n";
+    screen() << "Crafted " << crafted << ": " << craftSeconds * 1e3 << " ms, " << player.getInventory().size() << " items left\n";
+}
+
+// Plays the sequence that once lost a new game's progress: a first game is
+// autosaved, loaded and saved again, then a second new game is played and
+// autosaved, and loading must bring back the second game. Uses its own save
+// files; returns false if anything comes back wrong.
+bool checkSaves() {
+    GameConfig config;
+    config.saveName = "/tmp/rpg-check-" + to_string(getpid());
+    config.simulationThreads = 1;
+    bool passed = true;
+    auto expect = [&passed](Game& game, const string& name, int experience, const char* step) {
+        const Character& player = game.getPlayer();
+        if (player.getName() != name || player.getExperience() != experience) {
+            screen() << "FAILED " << step << ": loaded " << player.getName() << " with " << player.getExperience() << " experience\n";
+            passed = false;
+        }
+    };
+    {
+        Game alice(config);
+        alice.newGame("Alice");
+        alice.getPlayer().gainExperience(30);
+        alice.autosave();
+    }
+    {
+        Game again(config);
+        again.newGame("Nobody");
+        again.loadGame();
+        expect(again, "Alice", 30, "new game, autosave, load");
+        again.saveGame();
+    }
+    {
+        Game bob(config);
+        bob.newGame("Bob");
+        bob.getPlayer().gainExperience(70);
+        bob.autosave();
+    }
+    {
+        Game check(config);
+        check.newGame("Nobody");
+        check.loadGame();
+        expect(check, "Bob", 70, "second new game over an older save");
+    }
+    {
+        // A wilderness location changed and then streamed out is journaled by
+        // the next autosave and kept by snapshots taken while it is out.
+        GameConfig wild = config;
+        wild.wildernessSize = 100000;
+        uint32_t side = (uint32_t)ceil(sqrt((double)wild.wildernessSize));
+        uint32_t first, target;
+        size_t enemies;
+        auto streamedOut = [&](Game& game, const char* step) {
+            World& world = game.getWorld();
+            for (uint32_t row = 0; row < side; row += 16) {
+                for (uint32_t column = 0; column < side; column += 16) {
+                    world.focus(min(first + row * side + column, (uint32_t)world.locationCount() - 1));
+                }
+            }
+            if (world.find(target)) {
+                screen() << "FAILED " << step << ": location " << target << " is still resident\n";
+                passed = false;
+            }
+        };
+        auto expectEnemies = [&](Game& game, const char* step) {
+            size_t found = game.getWorld().at(target).enemyCount();
+            if (found != enemies) {
+                screen() << "FAILED " << step << ": " << found << " enemies instead of " << enemies << "\n";
+                passed = false;
+            }
+        };
+        {
+            Game carol(wild);
+            carol.newGame("Carol");
+            carol.autosave();
+            first = (uint32_t)carol.getWorld().locationCount() - wild.wildernessSize;
+            target = first + 40 * side + 40;
+            carol.getWorld().at(target).addEnemy(Enemy("Warden", 70, 7));
+            enemies = carol.getWorld().at(target).enemyCount();
+            streamedOut(carol, "evict a changed location");
+            carol.autosave();
+        }
+        {
+            Game check(wild);
+            check.newGame("Nobody");
+            check.loadGame();
+            expect(check, "Carol", 0, "journaled wilderness change");
+            check.saveGame();
+            expectEnemies(check, "journaled wilderness change");
+        }
+        {
+            Game check(wild);
+            check.newGame("Nobody");
+            check.loadGame();
+            expectEnemies(check, "snapshot of a streamed-out location");
+        }
+    }
+    {
+        // Quest progress is snapshotted and journaled like the rest, and only
+        // arriving somewhere counts toward a REACH objective.
+        auto placeNamed = [](Game& game, const string& name) {
+            for (uint32_t id = 0; id < game.getWorld().locationCount(); ++id) {
+                if (game.getWorld().at(id).name == name) return id;
+            }
+            return 0u;
+        };
+        auto questNamed = [](Game& game, const string& title) {
+            QuestEngine& quests = game.getQuestLog();
+            uint32_t found = UINT32_MAX;
+            quests.forEachActive([&](uint32_t id) {
+                if (quests.definition(quests.definitionOf(id)).title == title) found = id;
+            });
+            return found;
+        };
+        auto expectQuest = [&](Game& game, const string& title, uint32_t stage, uint32_t progress, const char* step) {
+            QuestEngine& quests = game.getQuestLog();
+            uint32_t id = questNamed(game, title);
+            if (id == UINT32_MAX || quests.stageOf(id) != stage || quests.isChoosing(id) || quests.progress(id, 0) != progress) {
+                screen() << "FAILED " << step << ": " << title << " is not in stage " << stage << " with " << progress << " done\n";
+                passed = false;
+            }
+        };
+        {
+            Game dave(config);
+            dave.queueInput("Dave");
+            dave.tick();
+            dave.autosave();
+            dave.queueInput("4");
+            dave.queueInput(to_string(placeNamed(dave, "Dungeon") + 1));
+            dave.tick();
+            expectQuest(dave, "Defeat the Troll", 0, 0, "interacting with a location");
+            QuestEngine& quests = dave.getQuestLog();
+            quests.notify(QuestTrigger::REACH, placeNamed(dave, "Town"));
+            quests.choose(questNamed(dave, "Visit the Town Elder"), 0);
+            quests.notify(QuestTrigger::KILL, nameTable().intern("Goblin"), 2);
+            dave.autosave();
+        }
+        {
+            Game check(config);
+            check.newGame("Nobody");
+            check.loadGame();
+            expect(check, "Dave", 0, "journaled quest progress");
+            expectQuest(check, "Visit the Town Elder", 1, 2, "journaled quest progress");
+            check.saveGame();
+        }
+        {
+            Game check(config);
+            check.newGame("Nobody");
+            check.loadGame();
+            expectQuest(check, "Visit the Town Elder", 1, 2, "snapshot of quest progress");
+            expectQuest(check, "Defeat the Troll", 0, 0, "snapshot of quest progress");
+        }
+    }
+    remove((config.saveName + ".bin").c_str());
+    remove((config.saveName + ".journal").c_str());
+    screen() << (passed ? "Save checks passed.\n" : "Save checks failed.\n");
+    return passed;
+}
+
+// Runs status effects through the timer wheel on a private engine: a burn
+// whose expiry and last tick fall due together (after a cascade from the
+// second level), then buffs scheduled on the timers that burn freed. Then
+// casts a buff in a running game and lets it idle. Returns false if a timer is
+// lost, freed twice or fires for the wrong effect, or the buff wears off
+// outside combat.
+bool checkStatus() {
+    StatusEngine engine;
+    bool passed = true;
+    auto expect = [&passed](bool holds, const char* step) {
+        if (!holds) {
+            screen() << "FAILED " << step << "\n";
+            passed = false;
+        }
+    };
+    uint32_t host = UINT32_MAX;
+    engine.apply(host, EffectKind::BURN, 3, 130, 10);
+    engine.advance(200);
+    expect(engine.activeEffects() == 0 && engine.pendingTimers() == 0, "burn expiring on a tick");
+    expect(engine.takePendingDamage(host) >= 36, "burn damage");
+
+    engine.apply(host, EffectKind::ATTACK_UP, 5, 5);
+    engine.apply(host, EffectKind::DEFENSE_UP, 4, 50);
+    engine.advance(10);
+    expect(engine.attackBonus(host) == 0 && engine.defenseBonus(host) == 4, "short buff after a burn");
+    engine.advance(50);
+    expect(engine.defenseBonus(host) == 0 && engine.pendingTimers() == 0, "long buff after a burn");
+
+    // A buff lasts a number of combat rounds, however long the game runs
+    // between casting it and the next fight.
+    GameConfig config;
+    config.saveName = "/tmp/rpg-check-" + to_string(getpid());
+    config.simulationThreads = 1;
+    {
+        Game game(config);
+        game.newGame("Dana");
+        Character& player = game.getPlayer();
+        int attack = player.effectiveAttack();
+        player.castSkill(Skill::STRENGTH_BOOST);
+        for (int tick = 0; tick < 120; ++tick) {
+            game.tick();
+        }
+        expect(player.effectiveAttack() == attack + 10, "strength boost two seconds after casting");
+    }
+    remove((config.saveName + ".bin").c_str());
+    remove((config.saveName + ".journal").c_str());
+    screen() << (passed ? "Status checks passed.\n" : "Status checks failed.\n");
+    return passed;
+}
+
+// Area damage against a horde: one pass over the EnemyStore per wave, against
+// the same waves dealt one Enemy object at a time. Nobody dies, so every wave
+// touches the whole horde.
+void benchmarkHorde(int size, int waves) {
+    Location lair("Lair");
+    uint32_t skeleton = nameTable().intern("Skeleton");
+    for (int i = 0; i < size; ++i) {
+        lair.horde.add(skeleton, waves + 1, 6);
+    }
+    vector<uint32_t> defeated;
+    auto begin = chrono::steady_clock::now();
+    for (int wave = 0; wave < waves; ++wave) {
+        lair.applyAreaDamage(1, defeated);
+    }
+    double storeSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    vector<Enemy> crowd;
+    crowd.reserve(size);
+    for (int i = 0; i < size; ++i) {
+        crowd.push_back(Enemy("Skeleton", waves + 1, 6));
+    }
+    begin = chrono::steady_clock::now();
+    for (int wave = 0; wave < waves; ++wave) {
+        for (auto& enemy : crowd) {
+            enemy.takeDamage(1);
+        }
+        screen().discard();
+    }
+    double objectSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    double hits = (double)size * waves;
+    screen() << size << " enemies, " << waves << " waves: store " << storeSeconds * 1e9 / hits << " ns/enemy, objects "
+             << objectSeconds * 1e9 / hits << " ns/enemy, " << lair.hordeSize() << " still standing\n";
+}
+
+// Builds a game with a wilderness of the given size and visits random locations
+// in it. Each visit streams in the chunks around the location and drops a potion
+// there, so evicted chunks store items and load them back; the first location
+// must still hold all of its potions at the end. Then times nearby()
+// and PathService::route() between random locations.
+void benchmarkWorld(int locations, int visits) {
+    GameConfig config;
+    config.saveName = "/tmp/rpg-bench-" + to_string(getpid());
+    config.simulationThreads = 1;
+    config.wildernessSize = locations;
+    auto begin = chrono::steady_clock::now();
+    Game game(config);
+    game.newGame("Bench");
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    World& world = game.getWorld();
+    ItemRecord potion = { ItemType::POTION, Rarity::COMMON, 30, nameTable().intern("Healing Potion"), { 50 } };
+
+    CounterRng rng(11, 0);
+    uint32_t first = (uint32_t)(world.locationCount() - locations);
+    uint32_t home = first + (uint32_t)rng.range(0, locations - 1);
+    size_t homePotions = 0, found = 0;
+    begin = chrono::steady_clock::now();
+    for (int visit = 0; visit < visits; ++visit) {
+        uint32_t id = visit % 4 == 0 ? home : first + (uint32_t)rng.range(0, locations - 1);
+        world.focus(id);
+        world.at(id).addItem(potion);
+        if (id == home) homePotions++;
+    }
+    double visitSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    begin = chrono::steady_clock::now();
+    for (int query = 0; query < visits; ++query) {
+        const LocationNode& node = world.node(first + (uint32_t)rng.range(0, locations - 1));
+        found += world.nearby(node.x, node.y, 12.0f).size();
+    }
+    double nearbySeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    // Routes between random pairs: the first batch fills the hub segment cache and
+    // the second runs against it. Every 50th route is checked against exact A*.
+    PathService& paths = game.getPaths();
+    vector<uint32_t> path, exact;
+    double routeSeconds[2] = { 0, 0 }, slowest = 0, detour = 0;
+    int checked = 0;
+    float cost = 0, exactCost = 0;
+    for (int batch = 0; batch < 2; ++batch) {
+        for (int query = 0; query < visits; ++query) {
+            uint32_t from = first + (uint32_t)rng.range(0, locations - 1), to = first + (uint32_t)rng.range(0, locations - 1);
+            begin = chrono::steady_clock::now();
+            paths.route(from, to, path, &cost);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+            routeSeconds[batch] += seconds;
+            if (batch == 1) slowest = max(slowest, seconds);
+            if (query % 50 == 0 && paths.findPath(from, to, exact, &exactCost) && exactCost > 0) {
+                detour += cost / exactCost - 1;
+                checked++;
+            }
+        }
+    }
+
+    // Closing a road on the last route must drop every cached segment that used it.
+    uint32_t cutFrom = path[path.size() / 2], cutTo = path[path.size() / 2 + 1];
+    world.setEdgeCost(cutFrom, cutTo, INFINITY);
+    bool rerouted = paths.route(path.front(), path.back(), path, &cost);
+    for (size_t i = 0; rerouted && i + 1 < path.size(); ++i) {
+        if ((path[i] == cutFrom && path[i + 1] == cutTo) || (path[i] == cutTo && path[i + 1] == cutFrom)) rerouted = false;
+    }
+
+    world.focus(home);
+    size_t kept = world.at(home).itemCount();
+    screen() << locations << " locations in " << world.chunkCount() << " chunks, built in " << buildSeconds * 1e3 << " ms\n"
+             << visits << " visits: " << visitSeconds * 1e6 / visits << " us each, " << world.residentChunks() << " chunks resident\n"
+             << "nearby: " << nearbySeconds * 1e6 / visits << " us per query, " << (double)found / visits << " locations each\n"
+             << "routes: " << routeSeconds[0] * 1e6 / visits << " us cold, " << routeSeconds[1] * 1e6 / visits << " us warm, "
+             << slowest * 1e6 << " us slowest warm, " << (checked ? detour * 100 / checked : 0) << "% longer than exact\n"
+             << "closed road on a route: " << (rerouted ? "rerouted around it" : "FAILED") << "\n"
+             << "home location kept " << kept << " of " << homePotions << " potions\n";
+}
+
+// Posts from other threads while nothing dispatches, more than a ring holds,
+// then again from several threads while this one dispatches. Returns false if a
+// post blocks (the check then never finishes), or an event is lost or arrives
+// out of its thread's order.
+bool checkEvents() {
+    const uint32_t producers = 4, perProducer = 20000;
+    EventBus bus;
+    vector<uint32_t> next(producers, 0);
+    uint64_t received = 0;
+    bool passed = true;
+    bus.subscribe<ItemAcquired>([&](const ItemAcquired& acquired) {
+        if (acquired.nameId >= producers || acquired.count != next[acquired.nameId]++) passed = false;
+        received++;
+    });
+    auto produce = [&bus, perProducer](uint32_t producer) {
+        for (uint32_t i = 0; i < perProducer; ++i) {
+            bus.post(ItemAcquired{ producer, i });
+        }
+    };
+
+    thread alone(produce, 0);
+    alone.join();
+    bus.dispatch();
+    if (received != perProducer) {
+        screen() << "FAILED posting without a dispatcher: " << received << " of " << perProducer << " events\n";
+        passed = false;
+    }
+
+    fill(next.begin(), next.end(), 0);
+    received = 0;
+    vector<thread> threads;
+    for (uint32_t p = 0; p < producers; ++p) {
+        threads.emplace_back(produce, p);
+    }
+    while (received < (uint64_t)producers * perProducer) {
+        if (bus.dispatch() == 0) this_thread::yield();
+    }
+    for (auto& producer : threads) {
+        producer.join();
+    }
+    if (!passed) {
+        screen() << "FAILED: events lost or out of order\n";
+    }
+    screen() << (passed ? "Event checks passed.\n" : "Event checks failed.\n");
+    return passed;
+}
+
+// Producer threads post item events as fast as they can while this thread
+// dispatches them in batches, as the game loop would once per tick.
+void benchmarkEvents(int producers, int eventsPerProducer) {
+    EventBus bus;
+    uint64_t received = 0, total = 0;
+    bus.subscribe<ItemAcquired>([&](const ItemAcquired& acquired) {
+        received++;
+        total += acquired.count;
+    });
+    uint64_t expected = (uint64_t)producers * eventsPerProducer;
+    uint64_t batches = 0;
+    auto begin = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int p = 0; p < producers; ++p) {
+        threads.emplace_back([&bus, p, eventsPerProducer]() {
+            for (int i = 0; i < eventsPerProducer; ++i) {
+                bus.post(ItemAcquired{ (uint32_t)p, 1 });
+            }
+        });
+    }
+    while (received < expected) {
+        if (bus.dispatch() == 0) {
+            this_thread::yield();
+        } else {
+            batches++;
+        }
+    }
+    for (auto& producer : threads) {
+        producer.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    screen() << producers << " producers, " << received << " events (" << (total == expected ? "all counted" : "MISCOUNTED")
+             << ") in " << batches << " batches: " << seconds * 1e9 / max<uint64_t>(received, 1) << " ns/event\n";
+}
+
+// Runs the given number of quests, each a chain of kill objectives against one of
+// 1000 enemy kinds, and fires events across 10000 kinds, most of which no quest
+// waits on. Compares the trigger index with checking every quest on every event.
+void benchmarkQuests(int quests, int events) {
+    const uint32_t kinds = 1000, eventKinds = 10000;
+    QuestEngine engine;
+    for (uint32_t kind = 0; kind < kinds; ++kind) {
+        uint32_t definition = engine.define("Hunt " + to_string(kind));
+        engine.addStage(definition, { { { QuestTrigger::KILL, kind, 5 } }, {}, { 1 } });
+        engine.addStage(definition, { { { QuestTrigger::KILL, (kind + 1) % kinds, 5 } }, {}, {} });
+    }
+    for (int i = 0; i < quests; ++i) {
+        engine.start((uint32_t)i % kinds);
+    }
+
+    CounterRng rng(7, 0);
+    vector<uint32_t> targets(events);
+    for (auto& target : targets) {
+        target = (uint32_t)rng.range(0, eventKinds - 1);
+    }
+    auto begin = chrono::steady_clock::now();
+    for (uint32_t target : targets) {
+        engine.notify(QuestTrigger::KILL, target);
+    }
+    double indexedSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    vector<uint32_t> completed;
+    engine.takeCompleted(completed);
+
+    // The first events again, checked against every running quest's current stage.
+    size_t scanned = min(targets.size(), (size_t)1000);
+    uint64_t matches = 0;
+    begin = chrono::steady_clock::now();
+    for (size_t e = 0; e < scanned; ++e) {
+        uint32_t target = targets[e];
+        engine.forEachActive([&](uint32_t id) {
+            for (const QuestObjective& objective : engine.currentStage(id).objectives) {
+                matches += objective.trigger == QuestTrigger::KILL && objective.target == target;
+            }
+        });
+    }
+    double scanSeconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+
+    screen() << quests << " quests, " << events << " events: indexed " << indexedSeconds * 1e9 / events
+             << " ns/event, scanning " << scanSeconds * 1e9 / max(scanned, (size_t)1) << " ns/event\n";
+    screen() << completed.size() << " quests completed, " << engine.subscriptionCount() << " subscriptions left, "
+             << matches << " scan matches\n";
+}
+
+// Starts a server and a forked client process. The client opens the given number
+// of sessions, names a character in each and lets them go idle, then keeps
+// activeSessions of them busy for the given number of seconds: each sends a menu
+// command, waits for the reply and thinks for thinkMs before the next one.
+void benchmarkServer(int sessions, int activeSessions, int seconds, int thinkMs) {
+    GameServer server((int)max(1u, thread::hardware_concurrency()));
+    if (!server.listenTcp(0)) {
+        return;
+    }
+    int port = server.port();
+    thread listener([&server]() { server.run(); });
+    screen().present();
+
+    // The client holds its sessions open until the server has reported.
+    int measured[2], release[2];
+    if (pipe(measured) < 0 || pipe(release) < 0) {
+        return;
+    }
+    pid_t client = fork();
+    if (client == 0) {
+        vector<int> fds;
+        vector<chrono::steady_clock::time_point> sent(sessions), due(sessions);
+        vector<bool> waiting(sessions, false);
+        vector<float> latencies;
+        int epollFd = epoll_create1(0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((uint16_t)port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        char buffer[65536];
+        auto sendLine = [&](int i, const string& line) {
+            sent[i] = chrono::steady_clock::now();
+            waiting[i] = true;
+            ssize_t ignored = send(fds[i], line.data(), line.size(), MSG_NOSIGNAL);
+            (void)ignored;
+        };
+        for (int i = 0; i < sessions; ++i) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, (const sockaddr*)&address, sizeof(address)) < 0) {
+                printf("Connect failed after %d sessions: %s\n", i, strerror(errno));
+                _exit(1);
+            }
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            epoll_event event = { EPOLLIN, {} };
+            event.data.u32 = (uint32_t)i;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+            fds.push_back(fd);
+            sendLine(i, "Player" + to_string(i) + "\n");
+        }
+        // Replies to the name (and the welcome before it) are drained before timing.
+        int named = 0;
+        epoll_event events[256];
+        while (named < sessions) {
+            int count = epoll_wait(epollFd, events, 256, 5000);
+            if (count <= 0) break;
+            for (int e = 0; e < count; ++e) {
+                int i = (int)events[e].data.u32;
+                while (recv(fds[i], buffer, sizeof(buffer), 0) > 0) {}
+                if (waiting[i]) {
+                    waiting[i] = false;
+                    named++;
+                }
+            }
+        }
+        printf("%d sessions connected and named\n", named);
+        fflush(stdout);
+        this_thread::sleep_for(chrono::seconds(GameServer::activeSeconds + 1));
+
+        static const char* const commands[] = { "1\n", "2\n", "back\n", "10\n", "back\n" };
+        auto begin = chrono::steady_clock::now();
+        auto end = begin + chrono::seconds(seconds);
+        for (int i = 0; i < activeSessions; ++i) {
+            due[i] = begin + chrono::milliseconds(thinkMs * i / max(1, activeSessions));
+        }
+        size_t issued = 0;
+        while (chrono::steady_clock::now() < end) {
+            auto now = chrono::steady_clock::now();
+            for (int i = 0; i < activeSessions; ++i) {
+                if (!waiting[i] && now >= due[i]) {
+                    sendLine(i, commands[issued++ % 5]);
+                }
+            }
+            int count = epoll_wait(epollFd, events, 256, 1);
+            now = chrono::steady_clock::now();
+            for (int e = 0; e < count; ++e) {
+                int i = (int)events[e].data.u32;
+                bool got = false;
+                while (recv(fds[i], buffer, sizeof(buffer), 0) > 0) got = true;
+                if (got && waiting[i]) {
+                    waiting[i] = false;
+                    latencies.push_back(chrono::duration<float, micro>(now - sent[i]).count());
+                    due[i] = now + chrono::milliseconds(thinkMs);
+                }
+            }
+        }
+        sort(latencies.begin(), latencies.end());
+        if (!latencies.empty()) {
+            printf("Client: %zu replies in %d s, round trip p50 %.0f us, p99 %.0f us\n", latencies.size(), seconds,
+                   latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100]);
+        }
+        fflush(stdout);
+        char byte = 0;
+        if (write(measured[1], &byte, 1) != 1 || read(release[0], &byte, 1) < 0) _exit(1);
+        _exit(0);
+    }
+
+    char byte = 0;
+    if (read(measured[0], &byte, 1) != 1) {
+        screen() << "Client failed.\n";
+    }
+    long pages = 0, residentPages = 0;
+    if (FILE* statm = fopen("/proc/self/statm", "r")) {
+        if (fscanf(statm, "%ld %ld", &pages, &residentPages) != 2) residentPages = 0;
+        fclose(statm);
+    }
+    server.report();
+    screen() << "Server memory: " << residentPages * sysconf(_SC_PAGESIZE) / (1024 * 1024) << " MB resident\n";
+    if (write(release[1], &byte, 1) != 1) kill(client, SIGKILL);
+    int status = 0;
+    waitpid(client, &status, 0);
+    for (int fd : { measured[0], measured[1], release[0], release[1] }) ::close(fd);
+    server.stop();
+    listener.join();
+}
+
+#ifdef RPG_BENCHMARK
+// Benchmarks (Google Benchmark)
+// Build with -DRPG_BENCHMARK and link -lbenchmark -lpthread. Run with
+// --benchmark_out=<file> --benchmark_out_format=json to keep results for
+// comparison between releases.
+#include <benchmark/benchmark.h>
+
+// Output is still formatted into the renderer's frame, but each benchmark drops
+// it with screen().discard() instead of presenting it.
+
+static void BM_CharacterTakeDamage(benchmark::State& state) {
+    Character hero("Bench");
+    for (auto _ : state) {
+        hero.takeDamage(15);
+        hero.heal(15);
+        screen().discard();
+    }
+}
+BENCHMARK(BM_CharacterTakeDamage);
+
+static void BM_CharacterGainExperience(benchmark::State& state) {
+    Character hero("Bench");
+    for (auto _ : state) {
+        hero.gainExperience(10);
+        screen().discard();
+    }
+}
+BENCHMARK(BM_CharacterGainExperience);
+
+// saveGame() followed by loadGame(), which waits for the writer thread, with
+// state.range(0) items in the player's inventory.
+static void BM_SaveLoadRoundTrip(benchmark::State& state) {
+    GameConfig config;
+    config.saveName = "/tmp/rpg-bench-" + to_string(getpid());
+    Game game(config);
+    game.newGame("Bench");
+    ItemRecord sword = { ItemType::WEAPON, Rarity::RARE, 100, nameTable().intern("Sword"), { 30 } };
+    game.getPlayer().addItem(sword, state.range(0));
+    for (auto _ : state) {
+        game.saveGame();
+        game.loadGame();
+        screen().discard();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    remove((config.saveName + ".bin").c_str());
+    remove((config.saveName + ".journal").c_str());
+}
+BENCHMARK(BM_SaveLoadRoundTrip)->Arg(1000)->Arg(100000)->Unit(benchmark::kMillisecond);
+
+static void BM_WorldShowMap(benchmark::State& state) {
+    screen().setLevel(state.range(1) ? LogLevel::QUIET : LogLevel::NORMAL);
+    size_t budget = screen().frameBudget();
+    screen().setFrameBudget(SIZE_MAX);
+    ItemRecord potion = { ItemType::POTION, Rarity::COMMON, 30, nameTable().intern("Healing Potion"), { 50 } };
+    World world;
+    for (int i = 0; i < state.range(0); ++i) {
+        Location location("Location " + to_string(i));
+        location.addItem(potion);
+        world.addLocation(location);
+    }
+    for (auto _ : state) {
+        world.showMap();
+        screen().discard();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    screen().setFrameBudget(budget);
+    screen().setLevel(LogLevel::NORMAL);
+}
+// Second argument: 1 renders in quiet mode.
+BENCHMARK(BM_WorldShowMap)->Args({ 10000, 0 })->Args({ 100000, 0 })->Args({ 100000, 1 })->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
+#else
+int main(int argc, char* argv[]) {
+    if (argc >= 4 && string(argv[1]) == "--compile-content") {
+        ifstream in(argv[2], ios::binary);
+        string source((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        vector<char> table;
+        if (!in || !compileContent(source, table)) {
+            screen() << "Could not compile " << argv[2] << "\n";
+            screen().present();
+            return 1;
+        }
+        ofstream(argv[3], ios::binary).write(table.data(), table.size());
+        screen() << "Wrote " << argv[3] << " (" << table.size() << " bytes)\n";
+        screen().present();
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "--loot-sim") {
+        Game game;
+        LootSystem& loot = game.getLoot();
+        string name = argc >= 4 ? argv[3] : "Troll";
+        uint32_t table = loot.findTable(name);
+        if (table == UINT32_MAX) {
+            screen() << "No loot table named " << name << ". Tables:";
+            for (uint32_t i = 0; i < loot.tableCount(); ++i) {
+                screen() << " " << loot.tableName(i);
+            }
+            screen() << "\n";
+            screen().present();
+            return 1;
+        }
+        loot.showDistribution(table, strtoull(argv[2], nullptr, 10), 1);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 3 && string(argv[1]) == "--replay") {
+        Game game;
+        bool matched = game.replay(argv[2]);
+        screen().present();
+        return matched ? 0 : 1;
+    }
+    if (argc >= 3 && string(argv[1]) == "--record") {
+        Game game;
+        if (!game.startRecording(argv[2])) {
+            screen().present();
+            return 1;
+        }
+        game.start();
+        return 0;
+    }
+    if (argc >= 3 && (string(argv[1]) == "--serve" || string(argv[1]) == "--serve-unix")) {
+        GameServer server(argc >= 4 ? atoi(argv[3]) : (int)max(1u, thread::hardware_concurrency()));
+        bool listening = string(argv[1]) == "--serve" ? server.listenTcp(atoi(argv[2])) : server.listenUnix(argv[2]);
+        if (!listening) {
+            screen().present();
+            return 1;
+        }
+        screen() << "Serving on " << argv[2] << "\n";
+        screen().present();
+        server.run(10);
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-server") {
+        benchmarkServer(argc >= 3 ? atoi(argv[2]) : 10000, argc >= 4 ? atoi(argv[3]) : 1000,
+                        argc >= 5 ? atoi(argv[4]) : 10, argc >= 6 ? atoi(argv[5]) : 100);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-entities") {
+        benchmarkEntities(argc >= 3 ? atoi(argv[2]) : 50000, argc >= 4 ? atoi(argv[3]) : 100);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--check-saves") {
+        bool passed = checkSaves();
+        screen().present();
+        return passed ? 0 : 1;
+    }
+    if (argc >= 2 && string(argv[1]) == "--check-status") {
+        bool passed = checkStatus();
+        screen().present();
+        return passed ? 0 : 1;
+    }
+    if (argc >= 2 && string(argv[1]) == "--check-events") {
+        bool passed = checkEvents();
+        screen().present();
+        return passed ? 0 : 1;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-horde") {
+        benchmarkHorde(argc >= 3 ? atoi(argv[2]) : 100000, argc >= 4 ? atoi(argv[3]) : 100);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-world") {
+        benchmarkWorld(argc >= 3 ? atoi(argv[2]) : 1000000, argc >= 4 ? atoi(argv[3]) : 1000);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-events") {
+        benchmarkEvents(argc >= 3 ? atoi(argv[2]) : 4, argc >= 4 ? atoi(argv[3]) : 1000000);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-quests") {
+        benchmarkQuests(argc >= 3 ? atoi(argv[2]) : 100000, argc >= 4 ? atoi(argv[3]) : 100000);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-craft") {
+        benchmarkCrafting(argc >= 3 ? atoi(argv[2]) : 30000);
+        screen().present();
+        return 0;
+    }
+    if (argc >= 2 && string(argv[1]) == "--bench-items") {
+        benchmarkItemDispatch(argc >= 3 ? atoi(argv[2]) : 100000, argc >= 4 ? atoi(argv[3]) : 100);
+        screen().present();
+        return 0;
+    }
+    GameConfig config;
+    if (argc >= 3 && string(argv[1]) == "--wilderness") {
+        config.wildernessSize = atoi(argv[2]);
+    }
+    Game game(config);
     game.start();
     return 0;
-}
\ No newline at end of file
+}
+#endif